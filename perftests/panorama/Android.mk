@@ -2,15 +2,13 @@ local_target_dir := $(TARGET_OUT_DATA)/local/tmp
 
 LOCAL_PATH:= $(call my-dir)
 
-include $(CLEAR_VARS)
-
-LOCAL_C_INCLUDES := \
+panorama_c_includes := \
     $(LOCAL_PATH)/feature_mos/src \
     $(LOCAL_PATH)/feature_stab/src \
     $(LOCAL_PATH)/feature_stab/db_vlvm
 
-LOCAL_SRC_FILES := benchmark.cpp \
-	feature_mos/src/mosaic/ImageUtils.cpp \
+panorama_src_files := \
+    feature_mos/src/mosaic/ImageUtils.cpp \
     feature_mos/src/mosaic/Mosaic.cpp \
     feature_mos/src/mosaic/AlignFeatures.cpp \
     feature_mos/src/mosaic/Blend.cpp \
@@ -36,6 +34,12 @@ LOCAL_SRC_FILES := benchmark.cpp \
     feature_stab/src/dbreg/dbreg.cpp \
     feature_stab/src/dbreg/vp_motionmodel.c
 
+include $(CLEAR_VARS)
+
+LOCAL_C_INCLUDES := $(panorama_c_includes)
+
+LOCAL_SRC_FILES := benchmark.cpp $(panorama_src_files)
+
 LOCAL_CFLAGS := -O3 -DNDEBUG -Wno-unused-parameter -Wno-maybe-uninitialized
 LOCAL_CPPFLAGS := -std=c++98
 LOCAL_MODULE_TAGS := tests
@@ -49,3 +53,23 @@ LOCAL_FORCE_STATIC_EXECUTABLE := true
 LOCAL_STATIC_LIBRARIES := libc libm
 
 include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_C_INCLUDES := $(panorama_c_includes)
+
+LOCAL_SRC_FILES := replay.cpp $(panorama_src_files)
+
+LOCAL_CFLAGS := -O3 -DNDEBUG -Wno-unused-parameter -Wno-maybe-uninitialized
+LOCAL_CPPFLAGS := -std=c++98
+LOCAL_MODULE_TAGS := tests
+LOCAL_MODULE := panorama_replay
+LOCAL_MODULE_STEM_32 := panorama_replay
+LOCAL_MODULE_STEM_64 := panorama_replay64
+LOCAL_MULTILIB := both
+LOCAL_MODULE_PATH := $(local_target_dir)
+LOCAL_ADDITIONAL_DEPENDENCIES := $(LOCAL_PATH)/Android.mk
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+LOCAL_STATIC_LIBRARIES := libc libm
+
+include $(BUILD_EXECUTABLE)
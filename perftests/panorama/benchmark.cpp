@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#include <math.h>
 #include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -24,6 +25,7 @@
 
 #define MAX_FRAMES 200
 #define KERNEL_ITERATIONS 10
+#define PRESET_ITERATIONS 3
 
 const int blendingType = Blend::BLEND_TYPE_HORZ;
 const int stripType = Blend::STRIP_TYPE_WIDE;
@@ -48,6 +50,124 @@ int loadImages(const char* basename, int &width, int &height)
     return i;
 }
 
+const char *qualityNames[Blend::QUALITY_COUNT] = { "final", "balanced", "preview" };
+
+const char *memoryNames[DB_MEM_NR_SUBSYSTEMS] = {
+    "align", "frames", "pyramids", "mosaic", "triangulation"
+};
+
+// Bytes held at the end of a phase and at the peak during it, per subsystem
+// and in total. db_ResetMemoryPeaks() marks the start of the phase. Returns
+// the total peak.
+long long printMemoryPhase(const char *phase)
+{
+    db_MemoryStats stats;
+    db_GetMemoryStats(&stats);
+
+    printf("%-8s held", phase);
+    for (int i = 0; i < DB_MEM_NR_SUBSYSTEMS; i++) {
+        printf(" %13lld", stats.current[i]);
+    }
+    printf(" %11lld\n", stats.total_current);
+
+    printf("%-8s peak", phase);
+    for (int i = 0; i < DB_MEM_NR_SUBSYSTEMS; i++) {
+        printf(" %13lld", stats.peak[i]);
+    }
+    printf(" %11lld\n", stats.total_peak);
+
+    return stats.total_peak;
+}
+
+// Peak signal to noise ratio of an RGB image against the golden output, or
+// a negative value if the sizes differ
+double computePSNR(ImageType imageRGB, int width, int height, ImageType goldenRGB,
+                   int goldenWidth, int goldenHeight)
+{
+    if (width != goldenWidth || height != goldenHeight) return -1.0;
+
+    int n = width * height * 3;
+    double sse = 0.0;
+    for (int i = 0; i < n; i++) {
+        double d = (double) imageRGB[i] - (double) goldenRGB[i];
+        sse += d * d;
+    }
+    if (sse == 0.0) return INFINITY;
+    return 10.0 * log10(255.0 * 255.0 * n / sse);
+}
+
+// Create the mosaic with each blend quality preset and report its best time
+// out of PRESET_ITERATIONS and its PSNR against the golden output
+void comparePresets(int totalFrames, int width, int height, const char *goldenFilename)
+{
+    int goldenWidth, goldenHeight;
+    ImageType goldenRGB = ImageUtils::readBinaryPPM(goldenFilename, goldenWidth, goldenHeight);
+    if (goldenRGB == NULL) {
+        printf("Could not read %s\n", goldenFilename);
+        return;
+    }
+
+    for (int quality = 0; quality < Blend::QUALITY_COUNT; quality++) {
+        float bestAddImageTime = 0, bestStitchImageTime = 0;
+        double psnr = 0.0;
+        int mosaicWidth = 0, mosaicHeight = 0;
+
+        for (int iteration = 0; iteration < PRESET_ITERATIONS; iteration++) {
+            struct timespec t1, t2, t3;
+            Mosaic mosaic;
+
+            mosaic.initialize(blendingType, stripType, width, height, -1, false, 0, quality);
+
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            for (int i = 0; i < totalFrames; i++) {
+                mosaic.addFrame(yvuFrames[i]);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &t2);
+
+            float progress = 0.0;
+            bool cancelComputation = false;
+
+            mosaic.createMosaic(progress, cancelComputation);
+
+            ImageType resultYVU = mosaic.getMosaic(mosaicWidth, mosaicHeight);
+
+            clock_gettime(CLOCK_MONOTONIC, &t3);
+
+            float addImageTime =
+                (t2.tv_sec - t1.tv_sec) + (t2.tv_nsec - t1.tv_nsec)/1e9;
+            float stitchImageTime =
+                (t3.tv_sec - t2.tv_sec) + (t3.tv_nsec - t2.tv_nsec)/1e9;
+
+            if (iteration == 0 ||
+                    addImageTime + stitchImageTime < bestAddImageTime + bestStitchImageTime) {
+                bestAddImageTime = addImageTime;
+                bestStitchImageTime = stitchImageTime;
+            }
+
+            // The output does not change between iterations
+            if (iteration == 0) {
+                ImageType imageRGB = ImageUtils::allocateImage(
+                    mosaicWidth, mosaicHeight, ImageUtils::IMAGE_TYPE_NUM_CHANNELS);
+                ImageUtils::yvu2rgb(imageRGB, resultYVU, mosaicWidth, mosaicHeight);
+                psnr = computePSNR(imageRGB, mosaicWidth, mosaicHeight,
+                                   goldenRGB, goldenWidth, goldenHeight);
+                ImageUtils::freeImage(imageRGB);
+            }
+        }
+
+        printf("Preset %-8s: %dx%d mosaic in %.2f seconds (%.2f + %.2f), ",
+               qualityNames[quality], mosaicWidth, mosaicHeight,
+               bestAddImageTime + bestStitchImageTime, bestAddImageTime, bestStitchImageTime);
+        if (psnr < 0.0) {
+            printf("size differs from golden %dx%d\n", goldenWidth, goldenHeight);
+        } else {
+            printf("PSNR %.2f dB\n", psnr);
+        }
+    }
+
+    ImageUtils::freeImage(goldenRGB);
+}
+
 int main(int argc, char **argv)
 {
     struct timespec t1, t2, t3;
@@ -57,13 +177,15 @@ int main(int argc, char **argv)
 
     const char *basename;
     const char *filename;
+    const char *goldenFilename = NULL;
 
-    if (argc != 3) {
-        printf("Usage: %s input_dir output_filename\n", argv[0]);
+    if (argc != 3 && argc != 4) {
+        printf("Usage: %s input_dir output_filename [golden_filename]\n", argv[0]);
         return 0;
     } else {
         basename = argv[1];
         filename = argv[2];
+        if (argc == 4) goldenFilename = argv[3];
     }
 
     // Load the images outside the computational kernel
@@ -78,23 +200,52 @@ int main(int argc, char **argv)
     printf("%d frames loaded\n", totalFrames);
 
 
+    long long peakBytes = 0;
+
     // Interesting stuff is here
     for (int iteration = 0; iteration < KERNEL_ITERATIONS; iteration++)  {
         Mosaic mosaic;
 
+        // Account the memory of the first iteration by phase
+        if (iteration == 0) {
+            printf("Memory in bytes:");
+            for (int i = 0; i < DB_MEM_NR_SUBSYSTEMS; i++) {
+                printf(" %13s", memoryNames[i]);
+            }
+            printf(" %11s\n", "total");
+            db_ResetMemoryPeaks();
+        }
+
         mosaic.initialize(blendingType, stripType, width, height, -1, false, 0);
 
+        if (iteration == 0) {
+            peakBytes = printMemoryPhase("init");
+            db_ResetMemoryPeaks();
+        }
+
         clock_gettime(CLOCK_MONOTONIC, &t1);
         for (int i = 0; i < totalFrames; i++) {
             mosaic.addFrame(yvuFrames[i]);
         }
         clock_gettime(CLOCK_MONOTONIC, &t2);
 
+        if (iteration == 0) {
+            long long phasePeak = printMemoryPhase("capture");
+            if (phasePeak > peakBytes) peakBytes = phasePeak;
+            db_ResetMemoryPeaks();
+        }
+
         float progress = 0.0;
         bool cancelComputation = false;
 
         mosaic.createMosaic(progress, cancelComputation);
 
+        if (iteration == 0) {
+            long long phasePeak = printMemoryPhase("blend");
+            if (phasePeak > peakBytes) peakBytes = phasePeak;
+            printf("Peak memory: %lld bytes\n", peakBytes);
+        }
+
         int mosaicWidth, mosaicHeight;
         ImageType resultYVU = mosaic.getMosaic(mosaicWidth, mosaicHeight);
 
@@ -127,5 +278,9 @@ int main(int argc, char **argv)
     }
     printf("Total elapsed time: %.2f seconds\n", totalElapsedTime);
 
+    if (goldenFilename != NULL) {
+        comparePresets(totalFrames, width, height, goldenFilename);
+    }
+
     return 0;
 }
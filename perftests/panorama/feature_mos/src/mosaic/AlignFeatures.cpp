@@ -33,6 +33,15 @@
 Align::Align()
 {
   width = height = 0;
+  cascadeTopK = 0;
+  timeBudget = 0.0;
+  budgetScale = 1.0;
+  minDisparity = 0.0;
+  memset(&maxParams, 0, sizeof(maxParams));
+  params = lastParams = maxParams;
+  imageGray = ImageUtils::IMAGE_TYPE_NOIMAGE;
+  imageQuarterRes = ImageUtils::IMAGE_TYPE_NOIMAGE;
+  quarterResRows = NULL;
   frame_number = 0;
   num_frames_captured = 0;
   reference_frame_index = 0;
@@ -45,6 +54,10 @@ Align::~Align()
   // Free gray-scale image
   if (imageGray != ImageUtils::IMAGE_TYPE_NOIMAGE)
     ImageUtils::freeImage(imageGray);
+
+  if (imageQuarterRes != ImageUtils::IMAGE_TYPE_NOIMAGE)
+    ImageUtils::freeImage(imageQuarterRes);
+  delete[] quarterResRows;
 }
 
 char* Align::getRegProfileString()
@@ -52,7 +65,7 @@ char* Align::getRegProfileString()
   return reg.profile_string;
 }
 
-int Align::initialize(int width, int height, bool _quarter_res, float _thresh_still)
+void Align::initRegistration()
 {
   int    nr_corners = DEFAULT_NR_CORNERS;
   double max_disparity = DEFAULT_MAX_DISPARITY;
@@ -68,6 +81,24 @@ int Align::initialize(int width, int height, bool _quarter_res, float _thresh_st
   const bool DEFAULT_USE_SMALLER_MATCHING_WINDOW = false;
   bool   use_smaller_matching_window = DEFAULT_USE_SMALLER_MATCHING_WINDOW;
 
+  reg.Init(width, height, motion_model_type, 20, linear_polish, quarter_res,
+          scale, reference_update_period, false, 0, nrsamples, chunk_size,
+          nr_corners, max_disparity, use_smaller_matching_window,
+          nrhorz, nrvert, cascadeTopK, DEFAULT_NR_MATCH_THREADS);
+}
+
+void Align::setMatchCascade(int top_k)
+{
+  cascadeTopK = top_k;
+  if (reg.Initialized())
+  {
+    initRegistration();
+    applyBudgetScale();
+  }
+}
+
+int Align::initialize(int width, int height, bool _quarter_res, float _thresh_still)
+{
   quarter_res = _quarter_res;
   thresh_still = _thresh_still;
 
@@ -77,17 +108,38 @@ int Align::initialize(int width, int height, bool _quarter_res, float _thresh_st
   db_Identity3x3(Hcurr);
   db_Identity3x3(Hprev);
 
-  if (!reg.Initialized())
-  {
-    reg.Init(width, height, motion_model_type, 20, linear_polish, quarter_res,
-            scale, reference_update_period, false, 0, nrsamples, chunk_size,
-            nr_corners, max_disparity, use_smaller_matching_window,
-            nrhorz, nrvert);
-  }
   this->width = width;
   this->height = height;
 
-  imageGray = ImageUtils::allocateImage(width, height, 1);
+  if (!reg.Initialized())
+    initRegistration();
+
+  maxParams.nr_corners = DEFAULT_NR_CORNERS;
+  maxParams.max_disparity = DEFAULT_MAX_DISPARITY;
+  maxParams.nr_samples = DB_DEFAULT_NR_SAMPLES;
+  maxParams.chunk_size = DB_DEFAULT_CHUNK_SIZE;
+  maxParams.align_ms = 0.0;
+  maxParams.match_ms = 0.0;
+  maxParams.nr_inliers = 0;
+  budgetScale = 1.0;
+  params = lastParams = maxParams;
+
+  // Free the images of an earlier initialize before allocating them again
+  if (imageGray != ImageUtils::IMAGE_TYPE_NOIMAGE)
+    ImageUtils::freeImage(imageGray);
+  if (imageQuarterRes != ImageUtils::IMAGE_TYPE_NOIMAGE)
+    ImageUtils::freeImage(imageQuarterRes);
+  delete[] quarterResRows;
+  imageQuarterRes = ImageUtils::IMAGE_TYPE_NOIMAGE;
+  quarterResRows = NULL;
+
+  imageGray = ImageUtils::allocateImage(width, height, 1, 0, DB_MEM_ALIGN);
+
+  if (quarter_res)
+  {
+    imageQuarterRes = ImageUtils::allocateImage(width/2, height/2, 1, 0, DB_MEM_ALIGN);
+    quarterResRows = ImageUtils::imageTypeToRowPointers(imageQuarterRes, width/2, height/2);
+  }
 
   if (reg.Initialized())
     return ALIGN_RET_OK;
@@ -95,22 +147,119 @@ int Align::initialize(int width, int height, bool _quarter_res, float _thresh_st
     return ALIGN_RET_ERROR;
 }
 
+void Align::setTimeBudget(double ms_per_frame)
+{
+  timeBudget = ms_per_frame;
+  if (timeBudget <= 0.0)
+  {
+    timeBudget = 0.0;
+    budgetScale = 1.0;
+    applyBudgetScale();
+  }
+}
+
+void Align::applyBudgetScale()
+{
+  // Matching cost grows with both the corner count and the search area,
+  // so the disparity only shrinks with the square root of the scale. It
+  // must still cover the motion between frames or the matches are lost.
+  params.nr_corners = (int) (maxParams.nr_corners * budgetScale);
+  params.max_disparity = db_mind(maxParams.max_disparity,
+          db_maxd(maxParams.max_disparity * sqrt(budgetScale), minDisparity));
+  params.nr_samples = (int) (maxParams.nr_samples * budgetScale);
+  params.chunk_size = (int) (maxParams.chunk_size * budgetScale);
+
+  if (reg.Initialized())
+    reg.ResetAlignmentParams(params.nr_corners, params.max_disparity,
+            params.nr_samples, params.chunk_size);
+}
+
+// Record what the last frame used and took, and pick the parameters for
+// the next one from the per-stage timings. Corner detection is mostly
+// the Harris strength of the whole frame, so only the matching and
+// homography time is expected to follow the parameters.
+void Align::updateBudget()
+{
+  double corners_ms, matching_ms, homography_ms;
+  reg.GetStageTimes(corners_ms, matching_ms, homography_ms);
+
+  lastParams = params;
+  lastParams.align_ms = corners_ms + matching_ms + homography_ms;
+  lastParams.match_ms = matching_ms;
+  lastParams.nr_inliers = reg.GetNrInliers();
+
+  if (timeBudget == 0.0)
+    return;
+
+  minDisparity = BUDGET_DISPARITY_MARGIN *
+          db_maxd(fabs(Hcurr[2]) / width, fabs(Hcurr[5]) / height);
+
+  double scale = budgetScale;
+  if (lastParams.nr_inliers < BUDGET_SAFE_NR_INLIERS)
+  {
+    scale *= 1.5;
+  }
+  else if (lastParams.align_ms > timeBudget)
+  {
+    double variable_ms = matching_ms + homography_ms;
+    double ratio = (variable_ms > 0.0) ?
+            (timeBudget - corners_ms) / variable_ms : 1.0;
+    scale *= sqrt(db_maxd(ratio, 0.25));
+  }
+  else if (lastParams.align_ms < 0.8 * timeBudget)
+  {
+    scale *= 1.1;
+  }
+  budgetScale = db_mind(db_maxd(scale, MIN_BUDGET_SCALE), 1.0);
+  applyBudgetScale();
+}
+
 int Align::addFrameRGB(ImageType imageRGB)
 {
   ImageUtils::rgb2gray(imageGray, imageRGB, width, height);
   return addFrame(imageGray);
 }
 
-int Align::addFrame(ImageType imageGray_)
+// Convert the first level of the reduced luma pyramid to the 8-bit quarter
+// resolution image and hand it to dbreg, so it does not subsample the frame
+// again. The 1-4-6-4-1 reduction keeps the values within [0, 255 << 3].
+void Align::setQuarterResFromPyramid(PyramidShort *lumaPyr)
+{
+  int qw = width/2;
+  int qh = height/2;
+
+  for (int j = 0; j < qh; j++)
+  {
+    ImageTypeShort in = lumaPyr->ptr[j];
+    ImageType out = quarterResRows[j];
+    for (int i = 0; i < qw; i++)
+    {
+      out[i] = (unsigned char) ((in[i] + 4) >> 3);
+    }
+  }
+
+  reg.SetQuarterResImage(quarterResRows);
+}
+
+int Align::addFrame(ImageType imageGray_, PyramidShort *lumaPyr)
 {
   int ret_code = ALIGN_RET_OK;
 
  // Obtain a vector of pointers to rows in image and pass in to dbreg
   ImageType *m_rows = ImageUtils::imageTypeToRowPointers(imageGray_, width, height);
 
+  if (quarter_res && lumaPyr != NULL)
+  {
+    setQuarterResFromPyramid(lumaPyr);
+  }
+
   if (frame_number == 0)
   {
       reg.AddFrame(m_rows, Hcurr, true);    // Force this to be a reference frame
+      lastParams = params;
+      lastParams.align_ms = 0.0;
+      lastParams.match_ms = 0.0;
+      lastParams.nr_inliers = 0;
       int num_corner_ref = reg.GetNrRefCorners();
 
       if (num_corner_ref < MIN_NR_REF_CORNERS)
@@ -121,6 +270,7 @@ int Align::addFrame(ImageType imageGray_)
   else
   {
       reg.AddFrame(m_rows, Hcurr, false);
+      updateBudget();
   }
 
   // Average translation per frame =
@@ -178,6 +328,10 @@ int Align::addFrame(ImageType imageGray_)
     db_Identity3x3(Hcurr);
 
     // Update the reference frame to be the current frame
+    if (quarter_res && lumaPyr != NULL)
+    {
+      reg.SetQuarterResImage(quarterResRows);
+    }
     reg.UpdateReference(m_rows,quarter_res,false);
 
     // Update the reference frame index
@@ -28,6 +28,19 @@
 
 #include "ImageUtils.h"
 #include "MatrixUtils.h"
+#include "Pyramid.h"
+
+// Feature and RANSAC parameters used to align a frame, and the time it took
+class AlignParams {
+public:
+  int nr_corners;       // Target number of corners
+  double max_disparity; // Matcher search range (fraction of image width)
+  int nr_samples;       // RANSAC hypotheses
+  int chunk_size;       // Correspondences scored per hypothesis before pruning
+  double align_ms;      // Corner detection + matching + homography time
+  double match_ms;      // Corner matching time alone
+  int nr_inliers;
+};
 
 class Align {
 
@@ -45,6 +58,10 @@ public:
   // Number of features to use from corner detection
   static const int DEFAULT_NR_CORNERS=750;
   static const double DEFAULT_MAX_DISPARITY=0.1;//0.4;
+  // Number of threads for corner matching (the matches do not depend on it)
+  static const int DEFAULT_NR_MATCH_THREADS=2;
+  // Match candidates scored first per corner by the cascade matcher when on
+  static const int DEFAULT_CASCADE_TOP_K=DB_DEFAULT_CASCADE_TOP_K;
   // Type of homography to model
   static const int DEFAULT_MOTION_MODEL=DB_HOMOGRAPHY_TYPE_R_T;
 // static const int DEFAULT_MOTION_MODEL=DB_HOMOGRAPHY_TYPE_PROJECTIVE;
@@ -54,6 +71,14 @@ public:
   static const int MIN_NR_REF_CORNERS = 25;
   static const int MIN_NR_INLIERS = 10;
 
+  ///// Settings for the time budgeted mode
+  // Lower bounds on the parameters, as a fraction of the defaults
+  static const double MIN_BUDGET_SCALE=0.2;
+  // Raise the parameters back up below this many inliers
+  static const int BUDGET_SAFE_NR_INLIERS = 2*MIN_NR_INLIERS;
+  // Keep the disparity at least this multiple of the last frame motion
+  static const double BUDGET_DISPARITY_MARGIN=1.5;
+
   Align();
   ~Align();
 
@@ -61,14 +86,33 @@ public:
   int initialize(int width, int height, bool quarter_res, float thresh_still);
 
   // Add a frame.  Note: The alignment computation is performed
-  // in this function
+  // in this function.  For quarter resolution alignment, lumaPyr may
+  // hold the already reduced luma of the frame (Y << 3, first level at
+  // half width and height) to be used instead of subsampling again.
   int addFrameRGB(ImageType image);
-  int addFrame(ImageType image);
+  int addFrame(ImageType image, PyramidShort *lumaPyr = NULL);
 
   // Obtain the TRS matrix from the last two frames
   int getLastTRS(double trs[3][3]);
   char* getRegProfileString();
 
+  // Adapt the corner count, matcher disparity and RANSAC samples frame to
+  // frame so that aligning a frame takes about ms_per_frame, never going
+  // above the defaults. The parameters are raised again whenever the
+  // inlier count gets close to MIN_NR_INLIERS. 0 disables it (default).
+  void setTimeBudget(double ms_per_frame);
+
+  // Bound the score of match candidates on a 5x5 patch of block sums and
+  // compute the full correlation only where the bound can reach the best
+  // score, starting with the top_k highest bounds of each corner (see
+  // db_Matcher_u::Init). The matches are the same. 0 matches exhaustively
+  // (default). Resets the registration, so call it before adding the
+  // first frame.
+  void setMatchCascade(int top_k);
+
+  // Parameters used for, and alignment time of, the last frame added.
+  const AlignParams& getLastParams() const { return lastParams; }
+
 protected:
 
   db_FrameToReferenceRegistration reg;
@@ -87,6 +131,23 @@ protected:
   bool quarter_res;     // Whether to process at quarter resolution
   float thresh_still;   // Translation threshold in pixels to detect still camera
   ImageType imageGray;
+  ImageType imageQuarterRes;    // Quarter resolution image taken from lumaPyr
+  ImageType *quarterResRows;    // Row pointers into imageQuarterRes
+
+  void setQuarterResFromPyramid(PyramidShort *lumaPyr);
+
+  int cascadeTopK;          // Cascade candidates scored first, 0 if off
+  void initRegistration();
+
+  double timeBudget;        // Target ms per frame, 0 if not budgeted
+  double budgetScale;       // Current parameters as a fraction of maxParams
+  double minDisparity;      // Disparity needed for the last frame motion
+  AlignParams maxParams;    // Parameters given to dbreg at initialization
+  AlignParams params;       // Parameters for the next frame
+  AlignParams lastParams;   // Parameters and timing of the last frame
+
+  void updateBudget();
+  void applyBudgetScale();
 };
 
 
@@ -19,6 +19,10 @@
 // $Id: Blend.cpp,v 1.22 2011/06/24 04:22:14 mbansal Exp $
 
 #include <string.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "Interp.h"
 #include "Blend.h"
@@ -26,26 +30,54 @@
 #include "Geometry.h"
 #include "trsMatrix.h"
 
+#ifndef LINEAR_INTERP
+#define BLEND_INTERP_DEFAULT Blend::INTERP_BICUBIC
+#else
+#define BLEND_INTERP_DEFAULT Blend::INTERP_BILINEAR
+#endif
+
+// Interpolation, luma levels and chroma levels of each quality preset
+static const int qualityPresets[Blend::QUALITY_COUNT][3] = {
+    { BLEND_INTERP_DEFAULT,   BLEND_RANGE_DEFAULT,     BLEND_RANGE_DEFAULT },     // QUALITY_FINAL
+    { Blend::INTERP_BICUBIC,  BLEND_RANGE_DEFAULT - 1, BLEND_RANGE_DEFAULT - 3 }, // QUALITY_BALANCED
+    { Blend::INTERP_BILINEAR, BLEND_RANGE_DEFAULT - 2, BLEND_RANGE_DEFAULT - 4 }, // QUALITY_PREVIEW
+};
+
 Blend::Blend()
 {
   m_wb.blendingType = BLEND_TYPE_NONE;
+  m_ownerSpans = NULL;
+  m_ownerSpanStart = NULL;
+  m_rowReleased = NULL;
+  m_spanLeft = m_spanRight = NULL;
 }
 
 Blend::~Blend()
 {
-    if (m_pFrameVPyr) free(m_pFrameVPyr);
-    if (m_pFrameUPyr) free(m_pFrameUPyr);
-    if (m_pFrameYPyr) free(m_pFrameYPyr);
+    PyramidShort::freeImage(m_pFrameVPyr);
+    PyramidShort::freeImage(m_pFrameUPyr);
+    PyramidShort::freeImage(m_pFrameYPyr);
 }
 
-int Blend::initialize(int blendingType, int stripType, int frame_width, int frame_height)
+int Blend::initialize(int blendingType, int stripType, int frame_width, int frame_height, int quality)
 {
     this->width = frame_width;
     this->height = frame_height;
     this->m_wb.blendingType = blendingType;
     this->m_wb.stripType = stripType;
 
-    m_wb.blendRange = m_wb.blendRangeUV = BLEND_RANGE_DEFAULT;
+    m_pFrameYPyr = NULL;
+    m_pFrameUPyr = NULL;
+    m_pFrameVPyr = NULL;
+
+    if (quality < 0 || quality >= QUALITY_COUNT)
+    {
+        return BLEND_RET_ERROR;
+    }
+
+    m_wb.interp = qualityPresets[quality][0];
+    m_wb.blendRange = qualityPresets[quality][1];
+    m_wb.blendRangeUV = qualityPresets[quality][2];
     m_wb.nlevs = m_wb.blendRange;
     m_wb.nlevsC = m_wb.blendRangeUV;
 
@@ -54,10 +86,6 @@ int Blend::initialize(int blendingType, int stripType, int frame_width, int fram
 
     m_wb.roundoffOverlap = 1.5;
 
-    m_pFrameYPyr = NULL;
-    m_pFrameUPyr = NULL;
-    m_pFrameVPyr = NULL;
-
     m_pFrameYPyr = PyramidShort::allocatePyramidPacked(m_wb.nlevs, (unsigned short) width, (unsigned short) height, BORDER);
     m_pFrameUPyr = PyramidShort::allocatePyramidPacked(m_wb.nlevsC, (unsigned short) (width), (unsigned short) (height), BORDER);
     m_pFrameVPyr = PyramidShort::allocatePyramidPacked(m_wb.nlevsC, (unsigned short) (width), (unsigned short) (height), BORDER);
@@ -73,6 +101,59 @@ int Blend::initialize(int blendingType, int stripType, int frame_width, int fram
 inline double max(double a, double b) { return a > b ? a : b; }
 inline double min(double a, double b) { return a < b ? a : b; }
 
+template<int INTERP>
+inline double interpCalc(PyramidShort *img, int xi, int yi, double xfrac, double yfrac)
+{
+    if (INTERP == Blend::INTERP_BILINEAR)
+        return liCalc(img, xi, yi, xfrac, yfrac);
+    else
+        return ciCalc(img, xi, yi, xfrac, yfrac);
+}
+
+// Inverse of FrameToMosaic. WARP_AFFINE skips the homogeneous division,
+// which is exact when the last row of trs is [0 0 1].
+template<int WARP>
+inline void Blend::MosaicToFrameWarp(double trs[3][3], double x, double y, double &wx, double &wy)
+{
+    double X, Y, z;
+    if (m_wb.theta == 0.0)
+    {
+        X = x;
+        Y = y;
+    }
+    else if (m_wb.horizontal)
+    {
+        double alpha = x * m_wb.direction / m_wb.width;
+        double length = (y - alpha * m_wb.correction) * m_wb.direction + m_wb.radius;
+        double deltaTheta = m_wb.theta * alpha;
+        double sinTheta = sin(deltaTheta);
+        double cosTheta = sqrt(1.0 - sinTheta * sinTheta) * m_wb.direction;
+        X = length * sinTheta + m_wb.x;
+        Y = length * cosTheta + m_wb.y;
+    }
+    else
+    {
+        double alpha = y * m_wb.direction / m_wb.width;
+        double length = (x - alpha * m_wb.correction) * m_wb.direction + m_wb.radius;
+        double deltaTheta = m_wb.theta * alpha;
+        double sinTheta = sin(deltaTheta);
+        double cosTheta = sqrt(1.0 - sinTheta * sinTheta) * m_wb.direction;
+        Y = length * sinTheta + m_wb.y;
+        X = length * cosTheta + m_wb.x;
+    }
+    if (WARP == WARP_PROJECTIVE)
+    {
+        z = ProjZ(trs, X, Y, 1.0);
+        wx = ProjX(trs, X, Y, z, 1.0);
+        wy = ProjY(trs, X, Y, z, 1.0);
+    }
+    else
+    {
+        wx = trs[0][0] * X + trs[0][1] * Y + trs[0][2];
+        wy = trs[1][0] * X + trs[1][1] * Y + trs[1][2];
+    }
+}
+
 void Blend::AlignToMiddleFrame(MosaicFrame **frames, int frames_size)
 {
     // Unwarp this frame and Warp the others to match
@@ -126,6 +207,80 @@ int Blend::runBlend(MosaicFrame **oframes, MosaicFrame **rframes,
         return BLEND_RET_ERROR_MEMORY;
     }
 
+    // Bounding rectangle (int numbers) of the final mosaic computed by projecting
+    // each input frame into the mosaic coordinate system, and the largest
+    // rectangle within it that is covered by the frames.
+    MosaicRect fullRect, coveredRect;
+
+    ret = ComputeMosaicExtents(frames, frames_size, fullRect, coveredRect);
+    if (ret != BLEND_RET_OK)
+    {
+        return ret;
+    }
+
+    YUVinfo *imgMos = YUVinfo::allocateImage(Mwidth, Mheight);
+    if (imgMos == NULL)
+    {
+        return BLEND_RET_ERROR_MEMORY;
+    }
+
+    // Set the Y image to 255 so we can distinguish when frame idx are written to it
+    memset(imgMos->Y.ptr[0], 255, (imgMos->Y.width * imgMos->Y.height));
+    // Set the v and u images to black
+    memset(imgMos->V.ptr[0], 128, (imgMos->V.width * imgMos->V.height) << 1);
+
+    // Do the triangulation.  It returns a sorted list of edges
+    SEdgeVector *edge;
+    int n = m_Triangulator.triangulate(&edge, numCenters, width, height);
+    m_Triangulator.linkNeighbors(edge, n, numCenters);
+
+    // Bounding rectangle that determines the positioning of the rectangle that is
+    // cropped out of the computed mosaic to get rid of the gray borders.
+    MosaicRect cropping_rect;
+
+    if (m_wb.horizontal)
+    {
+        cropping_rect.left = coveredRect.left;
+        cropping_rect.right = coveredRect.right;
+    }
+    else
+    {
+        cropping_rect.top = coveredRect.top;
+        cropping_rect.bottom = coveredRect.bottom;
+    }
+
+    // Do merging and blending :
+    ret = DoMergeAndBlend(frames, numCenters, width, height, *imgMos, fullRect,
+            cropping_rect, progress, cancelComputation);
+
+    if (m_wb.blendingType == BLEND_TYPE_HORZ)
+        CropFinalMosaic(*imgMos, cropping_rect);
+
+
+    m_Triangulator.freeMemory();    // note: can be called even if delaunay_alloc() wasn't successful
+
+    imageMosaicYVU = imgMos->Y.ptr[0];
+
+
+    if (m_wb.blendingType == BLEND_TYPE_HORZ)
+    {
+        mosaicWidth = cropping_rect.right - cropping_rect.left + 1;
+        mosaicHeight = cropping_rect.bottom - cropping_rect.top + 1;
+    }
+    else
+    {
+        mosaicWidth = Mwidth;
+        mosaicHeight = Mheight;
+    }
+
+    return ret;
+}
+
+// Project each frame into the mosaic coordinate system, setting its brect and
+// the center of its site, and determine the size of the mosaic.
+int Blend::ComputeMosaicExtents(MosaicFrame **frames, int frames_size,
+        MosaicRect &fullRect, MosaicRect &coveredRect)
+{
     // Bounding rectangle (real numbers) of the final mosaic computed by projecting
     // each input frame into the mosaic coordinate system.
     BlendRect global_rect;
@@ -199,11 +354,6 @@ int Blend::runBlend(MosaicFrame **oframes, MosaicFrame **rframes,
     }
 
     // Get origin and sizes
-
-    // Bounding rectangle (int numbers) of the final mosaic computed by projecting
-    // each input frame into the mosaic coordinate system.
-    MosaicRect fullRect;
-
     fullRect.left = (int) floor(global_rect.lft); // min-x
     fullRect.top = (int) floor(global_rect.bot);  // min-y
     fullRect.right = (int) ceil(global_rect.rgt); // max-x
@@ -211,17 +361,14 @@ int Blend::runBlend(MosaicFrame **oframes, MosaicFrame **rframes,
     Mwidth = (unsigned short) (fullRect.right - fullRect.left + 1);
     Mheight = (unsigned short) (fullRect.bottom - fullRect.top + 1);
 
-    int xLeftMost, xRightMost;
-    int yTopMost, yBottomMost;
-
     // Rounding up, so that we don't include the gray border.
-    xLeftMost = max(0, max(xLeftCorners[0], xLeftCorners[1]) - fullRect.left + 1);
-    xRightMost = min(Mwidth - 1, min(xRightCorners[0], xRightCorners[1]) - fullRect.left - 1);
+    coveredRect.left = max(0, max(xLeftCorners[0], xLeftCorners[1]) - fullRect.left + 1);
+    coveredRect.right = min(Mwidth - 1, min(xRightCorners[0], xRightCorners[1]) - fullRect.left - 1);
 
-    yTopMost = max(0, max(yTopCorners[0], yTopCorners[1]) - fullRect.top + 1);
-    yBottomMost = min(Mheight - 1, min(yBottomCorners[0], yBottomCorners[1]) - fullRect.top - 1);
+    coveredRect.top = max(0, max(yTopCorners[0], yTopCorners[1]) - fullRect.top + 1);
+    coveredRect.bottom = min(Mheight - 1, min(yBottomCorners[0], yBottomCorners[1]) - fullRect.top - 1);
 
-    if (xRightMost <= xLeftMost || yBottomMost <= yTopMost)
+    if (coveredRect.right <= coveredRect.left || coveredRect.bottom <= coveredRect.top)
     {
         return BLEND_RET_ERROR;
     }
@@ -230,68 +377,157 @@ int Blend::runBlend(MosaicFrame **oframes, MosaicFrame **rframes,
     Mwidth = (unsigned short) ((Mwidth + 3) & ~3);
     Mheight = (unsigned short) ((Mheight + 3) & ~3);    // Round up.
 
-    ret = MosaicSizeCheck(LIMIT_SIZE_MULTIPLIER, LIMIT_HEIGHT_MULTIPLIER);
-    if (ret != BLEND_RET_OK)
+    return MosaicSizeCheck(LIMIT_SIZE_MULTIPLIER, LIMIT_HEIGHT_MULTIPLIER);
+}
+
+int Blend::runPreview(MosaicFrame **oframes, MosaicFrame **rframes,
+        int frames_size, int scaleLog2,
+        ImageType &imagePreviewYVU, int &previewWidth, int &previewHeight)
+{
+    MosaicFrame **frames;
+
+    // Use the same frames and mosaic geometry as runBlend
+    if (m_wb.stripType == STRIP_TYPE_THIN)
+    {
+        frames = oframes;
+    }
+    else
     {
-       return ret;
+        SelectRelevantFrames(oframes, frames_size, rframes, frames_size);
+        frames = rframes;
     }
 
-    YUVinfo *imgMos = YUVinfo::allocateImage(Mwidth, Mheight);
-    if (imgMos == NULL)
+    ComputeBlendParameters(frames, frames_size, true);
+
+    if (!(m_AllSites = m_Triangulator.allocMemory(frames_size)))
     {
         return BLEND_RET_ERROR_MEMORY;
     }
 
-    // Set the Y image to 255 so we can distinguish when frame idx are written to it
-    memset(imgMos->Y.ptr[0], 255, (imgMos->Y.width * imgMos->Y.height));
-    // Set the v and u images to black
-    memset(imgMos->V.ptr[0], 128, (imgMos->V.width * imgMos->V.height) << 1);
-
-    // Do the triangulation.  It returns a sorted list of edges
-    SEdgeVector *edge;
-    int n = m_Triangulator.triangulate(&edge, numCenters, width, height);
-    m_Triangulator.linkNeighbors(edge, n, numCenters);
+    MosaicRect fullRect, coveredRect;
+    int ret = ComputeMosaicExtents(frames, frames_size, fullRect, coveredRect);
+    if (ret != BLEND_RET_OK)
+    {
+        m_Triangulator.freeMemory();
+        return ret;
+    }
 
-    // Bounding rectangle that determines the positioning of the rectangle that is
-    // cropped out of the computed mosaic to get rid of the gray borders.
-    MosaicRect cropping_rect;
+    int scale = 1 << scaleLog2;
+    int pw = (coveredRect.right - coveredRect.left) / scale + 1;
+    int ph = (coveredRect.bottom - coveredRect.top) / scale + 1;
 
-    if (m_wb.horizontal)
+    ImageType preview = ImageUtils::allocateImage(pw, ph, ImageUtils::IMAGE_TYPE_NUM_CHANNELS,
+            0, DB_MEM_MOSAIC);
+    double (*inv_trs)[3][3] = new double[frames_size][3][3];
+    if (preview == NULL)
     {
-        cropping_rect.left = xLeftMost;
-        cropping_rect.right = xRightMost;
+        delete[] inv_trs;
+        m_Triangulator.freeMemory();
+        return BLEND_RET_ERROR_MEMORY;
     }
-    else
+
+    for (int k = 0; k < frames_size; k++)
     {
-        cropping_rect.top = yTopMost;
-        cropping_rect.bottom = yBottomMost;
+        inv33d(m_AllSites[k].getMb()->trs, inv_trs[k]);
     }
 
-    // Do merging and blending :
-    ret = DoMergeAndBlend(frames, numCenters, width, height, *imgMos, fullRect,
-            cropping_rect, progress, cancelComputation);
+    ImageType py = preview;
+    ImageType pv = preview + pw * ph;
+    ImageType pu = pv + pw * ph;
+    int area = scale * scale;
 
-    if (m_wb.blendingType == BLEND_TYPE_HORZ)
-        CropFinalMosaic(*imgMos, cropping_rect);
+    for (int j = 0; j < ph; j++)
+    {
+        double sj = fullRect.top + coveredRect.top + j * scale;
 
+        for (int i = 0; i < pw; i++, py++, pv++, pu++)
+        {
+            double si = fullRect.left + coveredRect.left + i * scale;
 
-    m_Triangulator.freeMemory();    // note: can be called even if delaunay_alloc() wasn't successful
+            // Take the pixel from the frame with the nearest center, as the
+            // Voronoi masks of the full blend do
+            int best = 0;
+            double bestd = 2e30;
+            for (int k = 0; k < frames_size; k++)
+            {
+                double d = hypotSq(m_AllSites[k].getVCenter().x - si,
+                        m_AllSites[k].getVCenter().y - sj);
+                if (d < bestd)
+                {
+                    best = k;
+                    bestd = d;
+                }
+            }
 
-    imageMosaicYVU = imgMos->Y.ptr[0];
+            double xx, yy;
+            MosaicToFrame(inv_trs[best], si, sj, xx, yy);
 
+            // Near the frame borders that frame may not cover this position,
+            // so fall back to the nearest one that does
+            if (xx < 0.0 || yy < 0.0 || xx > width - 1.0 || yy > height - 1.0)
+            {
+                best = -1;
+                bestd = 2e30;
+                for (int k = 0; k < frames_size; k++)
+                {
+                    double d = hypotSq(m_AllSites[k].getVCenter().x - si,
+                            m_AllSites[k].getVCenter().y - sj);
+                    if (d >= bestd)
+                        continue;
+
+                    double x, y;
+                    MosaicToFrame(inv_trs[k], si, sj, x, y);
+                    if (x < 0.0 || y < 0.0 || x > width - 1.0 || y > height - 1.0)
+                        continue;
+
+                    best = k;
+                    bestd = d;
+                    xx = x;
+                    yy = y;
+                }
+            }
 
-    if (m_wb.blendingType == BLEND_TYPE_HORZ)
-    {
-        mosaicWidth = cropping_rect.right - cropping_rect.left + 1;
-        mosaicHeight = cropping_rect.bottom - cropping_rect.top + 1;
-    }
-    else
-    {
-        mosaicWidth = Mwidth;
-        mosaicHeight = Mheight;
+            if (best < 0)
+            {
+                // Border color, as in PerformFinalBlending
+                *py = (unsigned char) 96;
+                *pu = (unsigned char) 128;
+                *pv = (unsigned char) 128;
+                continue;
+            }
+
+            // Average the scale x scale block of the frame at this position
+            MosaicFrame *mb = m_AllSites[best].getMb();
+            int x0 = max(0, min((int) xx, width - scale));
+            int y0 = max(0, min((int) yy, height - scale));
+
+            ImageType fy = mb->image + y0 * width + x0;
+            ImageType fv = mb->getV() + y0 * width + x0;
+            ImageType fu = mb->getU() + y0 * width + x0;
+            int sumY = 0, sumV = 0, sumU = 0;
+            for (int y = 0; y < scale; y++, fy += width, fv += width, fu += width)
+            {
+                for (int x = 0; x < scale; x++)
+                {
+                    sumY += fy[x];
+                    sumV += fv[x];
+                    sumU += fu[x];
+                }
+            }
+            *py = (unsigned char) ((sumY + (area >> 1)) >> (2 * scaleLog2));
+            *pv = (unsigned char) ((sumV + (area >> 1)) >> (2 * scaleLog2));
+            *pu = (unsigned char) ((sumU + (area >> 1)) >> (2 * scaleLog2));
+        }
     }
 
-    return ret;
+    delete[] inv_trs;
+    m_Triangulator.freeMemory();
+
+    imagePreviewYVU = preview;
+    previewWidth = pw;
+    previewHeight = ph;
+
+    return BLEND_RET_OK;
 }
 
 int Blend::MosaicSizeCheck(float sizeMultiplier, float heightMultiplier) {
@@ -315,7 +551,7 @@ int Blend::MosaicSizeCheck(float sizeMultiplier, float heightMultiplier) {
    return BLEND_RET_OK;
 }
 
-int Blend::FillFramePyramid(MosaicFrame *mb)
+int Blend::FillFramePyramid(MosaicFrame *mb, PyramidShort *yPyr, PyramidShort *uPyr, PyramidShort *vPyr)
 {
     ImageType mbY, mbU, mbV;
     // Lay this image, centered into the temporary buffer
@@ -327,9 +563,9 @@ int Blend::FillFramePyramid(MosaicFrame *mb)
 
     for(h=0; h<height; h++)
     {
-        ImageTypeShort yptr = m_pFrameYPyr->ptr[h];
-        ImageTypeShort uptr = m_pFrameUPyr->ptr[h];
-        ImageTypeShort vptr = m_pFrameVPyr->ptr[h];
+        ImageTypeShort yptr = yPyr->ptr[h];
+        ImageTypeShort uptr = uPyr->ptr[h];
+        ImageTypeShort vptr = vPyr->ptr[h];
 
         for(w=0; w<width; w++)
         {
@@ -340,14 +576,24 @@ int Blend::FillFramePyramid(MosaicFrame *mb)
     }
 
     // Spread the image through the border
-    PyramidShort::BorderSpread(m_pFrameYPyr, BORDER, BORDER, BORDER, BORDER);
-    PyramidShort::BorderSpread(m_pFrameUPyr, BORDER, BORDER, BORDER, BORDER);
-    PyramidShort::BorderSpread(m_pFrameVPyr, BORDER, BORDER, BORDER, BORDER);
+    PyramidShort::BorderSpread(yPyr, BORDER, BORDER, BORDER, BORDER);
+    PyramidShort::BorderSpread(uPyr, BORDER, BORDER, BORDER, BORDER);
+    PyramidShort::BorderSpread(vPyr, BORDER, BORDER, BORDER, BORDER);
+
+    // Reuse the luma levels reduced when the frame was captured, if any
+    if (mb->lumaPyr != NULL)
+    {
+        PyramidShort::copyPyramid(yPyr + 1, mb->lumaPyr, m_wb.nlevs - 1);
+    }
+    else if (!PyramidShort::BorderReduce(yPyr, m_wb.nlevs))
+    {
+        return BLEND_RET_ERROR;
+    }
 
     // Generate Laplacian pyramids
-    if (!PyramidShort::BorderReduce(m_pFrameYPyr, m_wb.nlevs) || !PyramidShort::BorderExpand(m_pFrameYPyr, m_wb.nlevs, -1) ||
-            !PyramidShort::BorderReduce(m_pFrameUPyr, m_wb.nlevsC) || !PyramidShort::BorderExpand(m_pFrameUPyr, m_wb.nlevsC, -1) ||
-            !PyramidShort::BorderReduce(m_pFrameVPyr, m_wb.nlevsC) || !PyramidShort::BorderExpand(m_pFrameVPyr, m_wb.nlevsC, -1))
+    if (!PyramidShort::BorderExpand(yPyr, m_wb.nlevs, -1) ||
+            !PyramidShort::BorderReduce(uPyr, m_wb.nlevsC) || !PyramidShort::BorderExpand(uPyr, m_wb.nlevsC, -1) ||
+            !PyramidShort::BorderReduce(vPyr, m_wb.nlevsC) || !PyramidShort::BorderExpand(vPyr, m_wb.nlevsC, -1))
     {
         return BLEND_RET_ERROR;
     }
@@ -357,6 +603,72 @@ int Blend::FillFramePyramid(MosaicFrame *mb)
     }
 }
 
+int Blend::FillLumaPyramid(MosaicFrame *mb)
+{
+    if (m_pFrameYPyr == NULL || m_wb.nlevs < 2)
+    {
+        return BLEND_RET_ERROR;
+    }
+
+    if (mb->lumaPyr == NULL)
+    {
+        mb->lumaPyr = PyramidShort::allocatePyramidPacked(m_wb.nlevs - 1,
+                (unsigned short) (width >> 1), (unsigned short) (height >> 1), BORDER);
+        if (mb->lumaPyr == NULL)
+        {
+            return BLEND_RET_ERROR_MEMORY;
+        }
+    }
+
+    // Build the Gaussian levels in the frame pyramid exactly as
+    // FillFramePyramid would, then keep everything above the base
+    ImageType mbY = mb->image;
+
+    for(int h=0; h<height; h++)
+    {
+        ImageTypeShort yptr = m_pFrameYPyr->ptr[h];
+
+        for(int w=0; w<width; w++)
+        {
+            yptr[w] = (short) ((*(mbY++)) << 3);
+        }
+    }
+
+    PyramidShort::BorderSpread(m_pFrameYPyr, BORDER, BORDER, BORDER, BORDER);
+
+    if (!PyramidShort::BorderReduce(m_pFrameYPyr, m_wb.nlevs))
+    {
+        PyramidShort::freeImage(mb->lumaPyr);
+        mb->lumaPyr = NULL;
+        return BLEND_RET_ERROR;
+    }
+
+    PyramidShort::copyPyramid(mb->lumaPyr, m_pFrameYPyr + 1, m_wb.nlevs - 1);
+
+    return BLEND_RET_OK;
+}
+
+int Blend::BuildFramePyramids(MosaicFrame *mb)
+{
+    if (mb->yPyr == NULL)
+    {
+        mb->yPyr = PyramidShort::allocatePyramidPacked(m_wb.nlevs, (unsigned short) width, (unsigned short) height, BORDER);
+        mb->uPyr = PyramidShort::allocatePyramidPacked(m_wb.nlevsC, (unsigned short) width, (unsigned short) height, BORDER);
+        mb->vPyr = PyramidShort::allocatePyramidPacked(m_wb.nlevsC, (unsigned short) width, (unsigned short) height, BORDER);
+
+        if (!mb->yPyr || !mb->uPyr || !mb->vPyr)
+        {
+            PyramidShort::freeImage(mb->yPyr);
+            PyramidShort::freeImage(mb->uPyr);
+            PyramidShort::freeImage(mb->vPyr);
+            mb->yPyr = mb->uPyr = mb->vPyr = NULL;
+            return BLEND_RET_ERROR_MEMORY;
+        }
+    }
+
+    return FillFramePyramid(mb, mb->yPyr, mb->uPyr, mb->vPyr);
+}
+
 int Blend::DoMergeAndBlend(MosaicFrame **frames, int nsite,
              int width, int height, YUVinfo &imgMos, MosaicRect &rect,
              MosaicRect &cropping_rect, float &progress, bool &cancelComputation)
@@ -384,9 +696,9 @@ int Blend::DoMergeAndBlend(MosaicFrame **frames, int nsite,
     {
         if(cancelComputation)
         {
-            if (m_pMosaicVPyr) free(m_pMosaicVPyr);
-            if (m_pMosaicUPyr) free(m_pMosaicUPyr);
-            if (m_pMosaicYPyr) free(m_pMosaicYPyr);
+            PyramidShort::freeImage(m_pMosaicVPyr);
+            PyramidShort::freeImage(m_pMosaicUPyr);
+            PyramidShort::freeImage(m_pMosaicYPyr);
             return BLEND_RET_CANCELLED;
         }
 
@@ -426,114 +738,11 @@ int Blend::DoMergeAndBlend(MosaicFrame **frames, int nsite,
     // between the images on either side of each seam:
     if (m_wb.stripType == STRIP_TYPE_WIDE)
     {
-        if(m_wb.horizontal)
-        {
-            // Set the number of pixels around the seam to cross-fade between
-            // the two component images,
-            int tw = STRIP_CROSS_FADE_WIDTH_PXLS;
-
-            // Proceed with the image index calculation for cross-fading
-            // only if the cross-fading width is larger than 0
-            if (tw > 0)
-            {
-                for(int y = 0; y < imgMos.Y.height; y++)
-                {
-                    // Since we compare two adjecant pixels to determine
-                    // whether there is a seam, the termination condition of x
-                    // is set to imgMos.Y.width - tw, so that x+1 below
-                    // won't exceed the imgMos' boundary.
-                    for(int x = tw; x < imgMos.Y.width - tw; )
-                    {
-                        // Determine where the seam is...
-                        if (imgMos.Y.ptr[y][x] != imgMos.Y.ptr[y][x+1] &&
-                                imgMos.Y.ptr[y][x] != 255 &&
-                                imgMos.Y.ptr[y][x+1] != 255)
-                        {
-                            // Find the image indices on both sides of the seam
-                            unsigned char idx1 = imgMos.Y.ptr[y][x];
-                            unsigned char idx2 = imgMos.Y.ptr[y][x+1];
-
-                            for (int o = tw; o >= 0; o--)
-                            {
-                                // Set the image index to use for cross-fading
-                                imgMos.V.ptr[y][x - o] = idx2;
-                                // Set the intensity weights to use for cross-fading
-                                imgMos.U.ptr[y][x - o] = 50 + (99 - 50) * o / tw;
-                            }
+        FindSeams(imgMos);
+    }
 
-                            for (int o = 1; o <= tw; o++)
-                            {
-                                // Set the image index to use for cross-fading
-                                imgMos.V.ptr[y][x + o] = idx1;
-                                // Set the intensity weights to use for cross-fading
-                                imgMos.U.ptr[y][x + o] = imgMos.U.ptr[y][x - o];
-                            }
-
-                            x += (tw + 1);
-                        }
-                        else
-                        {
-                            x++;
-                        }
-                    }
-                }
-            }
-        }
-        else
-        {
-            // Set the number of pixels around the seam to cross-fade between
-            // the two component images,
-            int tw = STRIP_CROSS_FADE_WIDTH_PXLS;
-
-            // Proceed with the image index calculation for cross-fading
-            // only if the cross-fading width is larger than 0
-            if (tw > 0)
-            {
-                for(int x = 0; x < imgMos.Y.width; x++)
-                {
-                    // Since we compare two adjecant pixels to determine
-                    // whether there is a seam, the termination condition of y
-                    // is set to imgMos.Y.height - tw, so that y+1 below
-                    // won't exceed the imgMos' boundary.
-                    for(int y = tw; y < imgMos.Y.height - tw; )
-                    {
-                        // Determine where the seam is...
-                        if (imgMos.Y.ptr[y][x] != imgMos.Y.ptr[y+1][x] &&
-                                imgMos.Y.ptr[y][x] != 255 &&
-                                imgMos.Y.ptr[y+1][x] != 255)
-                        {
-                            // Find the image indices on both sides of the seam
-                            unsigned char idx1 = imgMos.Y.ptr[y][x];
-                            unsigned char idx2 = imgMos.Y.ptr[y+1][x];
-
-                            for (int o = tw; o >= 0; o--)
-                            {
-                                // Set the image index to use for cross-fading
-                                imgMos.V.ptr[y - o][x] = idx2;
-                                // Set the intensity weights to use for cross-fading
-                                imgMos.U.ptr[y - o][x] = 50 + (99 - 50) * o / tw;
-                            }
-
-                            for (int o = 1; o <= tw; o++)
-                            {
-                                // Set the image index to use for cross-fading
-                                imgMos.V.ptr[y + o][x] = idx1;
-                                // Set the intensity weights to use for cross-fading
-                                imgMos.U.ptr[y + o][x] = imgMos.U.ptr[y - o][x];
-                            }
-
-                            y += (tw + 1);
-                        }
-                        else
-                        {
-                            y++;
-                        }
-                    }
-                }
-            }
-        }
-
-    }
+    // The masks are final now, so each frame only needs to visit its own spans
+    BuildOwnerSpans(imgMos);
 
     // Now perform the actual blending using the frame assignment determined above
     site_idx = 0;
@@ -541,17 +750,22 @@ int Blend::DoMergeAndBlend(MosaicFrame **frames, int nsite,
     {
         if(cancelComputation)
         {
-            if (m_pMosaicVPyr) free(m_pMosaicVPyr);
-            if (m_pMosaicUPyr) free(m_pMosaicUPyr);
-            if (m_pMosaicYPyr) free(m_pMosaicYPyr);
+            FreeOwnerSpans();
+            PyramidShort::freeImage(m_pMosaicVPyr);
+            PyramidShort::freeImage(m_pMosaicUPyr);
+            PyramidShort::freeImage(m_pMosaicYPyr);
             return BLEND_RET_CANCELLED;
         }
 
         mb = csite->getMb();
 
-
-        if(FillFramePyramid(mb)!=BLEND_RET_OK)
+        // Frames whose pyramids were built during capture only need warping
+        if(!mb->pyrReady &&
+                FillFramePyramid(mb, m_pFrameYPyr, m_pFrameUPyr, m_pFrameVPyr)!=BLEND_RET_OK)
+        {
+            FreeOwnerSpans();
             return BLEND_RET_ERROR;
+        }
 
         ProcessPyramidForThisFrame(csite, mb->vcrect, mb->brect, rect, imgMos, mb->trs, site_idx);
 
@@ -560,6 +774,8 @@ int Blend::DoMergeAndBlend(MosaicFrame **frames, int nsite,
         site_idx++;
     }
 
+    FreeOwnerSpans();
+
 
     // Blend
     PerformFinalBlending(imgMos, cropping_rect);
@@ -569,9 +785,9 @@ int Blend::DoMergeAndBlend(MosaicFrame **frames, int nsite,
         return BLEND_RET_ERROR;
     }
 
-    if (m_pMosaicVPyr) free(m_pMosaicVPyr);
-    if (m_pMosaicUPyr) free(m_pMosaicUPyr);
-    if (m_pMosaicYPyr) free(m_pMosaicYPyr);
+    PyramidShort::freeImage(m_pMosaicVPyr);
+    PyramidShort::freeImage(m_pMosaicUPyr);
+    PyramidShort::freeImage(m_pMosaicYPyr);
 
     progress += TIME_PERCENT_FINAL;
 
@@ -637,11 +853,11 @@ int Blend::PerformFinalBlending(YUVinfo &imgMos, MosaicRect &cropping_rect)
 
     // 2D boolean array that contains true wherever the mosaic image data is
     // invalid (i.e. in the gray border).
-    bool **b = new bool*[imgMos.Y.height];
+    bool **b = db_NewArray<bool *>(imgMos.Y.height, DB_MEM_MOSAIC);
 
     for(int j=0; j<imgMos.Y.height; j++)
     {
-        b[j] = new bool[imgMos.Y.width];
+        b[j] = db_NewArray<bool>(imgMos.Y.width, DB_MEM_MOSAIC);
     }
 
     // Copy the resulting image into the full image using the mask
@@ -781,10 +997,10 @@ int Blend::PerformFinalBlending(YUVinfo &imgMos, MosaicRect &cropping_rect)
 
     for(int j=0; j<imgMos.Y.height; j++)
     {
-        delete b[j];
+        db_Free(b[j]);
     }
 
-    delete b;
+    db_Free(b);
 
     return BLEND_RET_OK;
 }
@@ -799,6 +1015,363 @@ void Blend::RoundingCroppingSizeToMultipleOf8(MosaicRect &rect) {
     rect.right -= residue;
 }
 
+// First x in [x, end) where a[x] != b[x], or end. Reads a and b up to end.
+static inline int NextLabelChange(ImageType a, ImageType b, int x, int end)
+{
+#ifdef __SSE2__
+    for (; x + 16 <= end; x += 16)
+    {
+        __m128i va = _mm_loadu_si128((const __m128i *) (a + x));
+        __m128i vb = _mm_loadu_si128((const __m128i *) (b + x));
+        int same = _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+        if (same != 0xffff)
+            return x + __builtin_ctz(~same);
+    }
+#else
+    for (; x + 8 <= end; x += 8)
+    {
+        unsigned long long wa, wb;
+        memcpy(&wa, a + x, 8);
+        memcpy(&wb, b + x, 8);
+        if (wa != wb)
+            break;
+    }
+#endif
+    while (x < end && a[x] == b[x])
+        x++;
+    return x;
+}
+
+// Cross-fade between idx1 before the seam and idx2 after it: the pixels at
+// offsets -tw..tw around the seam (given as pointers spaced step apart) get
+// the index of the image on the other side and its weight, from 99% down to
+// 50% at the seam.
+static inline void MarkSeam(ImageType v, ImageType u, int step, int tw,
+        unsigned char idx1, unsigned char idx2)
+{
+    for (int o = tw; o >= 0; o--)
+    {
+        v[-o * step] = idx2;
+        u[-o * step] = 50 + (99 - 50) * o / tw;
+    }
+
+    for (int o = 1; o <= tw; o++)
+    {
+        v[o * step] = idx1;
+        u[o * step] = u[-o * step];
+    }
+}
+
+// Seams between horizontally adjacent pixels of rows [first, last)
+static void FindSeamsInRows(YUVinfo *imgMos, int first, int last)
+{
+    int tw = STRIP_CROSS_FADE_WIDTH_PXLS;
+
+    // Since we compare two adjacent pixels, x stops at width - tw so that
+    // neither x + 1 nor the cross-fade band leaves the mosaic
+    int end = imgMos->Y.width - tw;
+
+    for (int y = first; y < last; y++)
+    {
+        ImageType row = imgMos->Y.ptr[y];
+
+        for (int x = tw; ; )
+        {
+            // Only a change of label can be a seam
+            x = NextLabelChange(row, row + 1, x, end);
+            if (x >= end)
+                break;
+
+            if (row[x] != 255 && row[x + 1] != 255)
+            {
+                MarkSeam(imgMos->V.ptr[y] + x, imgMos->U.ptr[y] + x, 1, tw, row[x], row[x + 1]);
+                x += (tw + 1);
+            }
+            else
+            {
+                x++;
+            }
+        }
+    }
+}
+
+// Seams between vertically adjacent pixels of columns [first, last). The
+// columns are walked together row by row, so that the labels are read in
+// memory order; nextY keeps the place of each column's own walk.
+static void FindSeamsInColumns(YUVinfo *imgMos, int first, int last)
+{
+    int tw = STRIP_CROSS_FADE_WIDTH_PXLS;
+    int pitch = imgMos->V.pitch;
+    int *nextY = new int[last - first];
+
+    for (int x = first; x < last; x++)
+    {
+        nextY[x - first] = tw;
+    }
+
+    for (int y = tw; y < imgMos->Y.height - tw; y++)
+    {
+        ImageType row = imgMos->Y.ptr[y];
+        ImageType below = imgMos->Y.ptr[y + 1];
+
+        for (int x = first; ; x++)
+        {
+            x = NextLabelChange(row, below, x, last);
+            if (x >= last)
+                break;
+
+            if (y >= nextY[x - first] && row[x] != 255 && below[x] != 255)
+            {
+                MarkSeam(imgMos->V.ptr[y] + x, imgMos->U.ptr[y] + x, pitch, tw, row[x], below[x]);
+                nextY[x - first] = y + tw + 1;
+            }
+        }
+    }
+
+    delete[] nextY;
+}
+
+class SeamJob
+{
+public:
+    YUVinfo *imgMos;
+    bool horizontal;
+    int first, last;
+};
+
+static void *FindSeamsThread(void *arg)
+{
+    SeamJob *job = (SeamJob *) arg;
+
+    if (job->horizontal)
+        FindSeamsInRows(job->imgMos, job->first, job->last);
+    else
+        FindSeamsInColumns(job->imgMos, job->first, job->last);
+
+    return NULL;
+}
+
+void Blend::FindSeams(YUVinfo &imgMos)
+{
+    // Proceed with the image index calculation for cross-fading
+    // only if the cross-fading width is larger than 0
+    if (STRIP_CROSS_FADE_WIDTH_PXLS <= 0)
+        return;
+
+    // Seams of a horizontal mosaic run across its rows, so the rows are
+    // independent; a vertical mosaic is split into bands of columns instead,
+    // in multiples of 16 for the label comparison.
+    bool horizontal = m_wb.horizontal;
+    int size = horizontal ? imgMos.Y.height : imgMos.Y.width;
+    int align = horizontal ? 1 : 16;
+
+    SeamJob job[SEAM_THREADS];
+    pthread_t thread[SEAM_THREADS];
+    bool started[SEAM_THREADS];
+
+    int units = (size + align - 1) / align;
+    for (int t = 0; t < SEAM_THREADS; t++)
+    {
+        job[t].imgMos = &imgMos;
+        job[t].horizontal = horizontal;
+        job[t].first = min(units * t / SEAM_THREADS * align, size);
+        job[t].last = min(units * (t + 1) / SEAM_THREADS * align, size);
+    }
+
+    // The caller takes the first band
+    for (int t = 1; t < SEAM_THREADS; t++)
+    {
+        started[t] = (pthread_create(&thread[t], NULL, FindSeamsThread, &job[t]) == 0);
+    }
+
+    FindSeamsThread(&job[0]);
+
+    for (int t = 1; t < SEAM_THREADS; t++)
+    {
+        if (started[t])
+            pthread_join(thread[t], NULL);
+        else
+            FindSeamsThread(&job[t]);
+    }
+}
+
+void Blend::BuildOwnerSpans(YUVinfo &imgMos)
+{
+    int nidx = m_wb.nlevs * 256;
+
+    m_maskWidth = imgMos.Y.width;
+    m_maskHeight = imgMos.Y.height;
+
+    // Count the spans of every level and site, then fill them in
+    m_ownerSpanStart = db_NewArray<int>(nidx + 1, DB_MEM_MOSAIC);
+    memset(m_ownerSpanStart, 0, (nidx + 1) * sizeof(int));
+    ScanOwnerSpans(imgMos, NULL);
+
+    for (int k = 0; k < nidx; k++)
+    {
+        m_ownerSpanStart[k + 1] += m_ownerSpanStart[k];
+    }
+
+    int *next = new int[nidx];
+    memcpy(next, m_ownerSpanStart, nidx * sizeof(int));
+    m_ownerSpans = db_NewArray<BlendSpan>(m_ownerSpanStart[nidx], DB_MEM_MOSAIC);
+    ScanOwnerSpans(imgMos, next);
+    delete[] next;
+
+    m_rowReleased = db_NewArray<unsigned char>(m_maskHeight, DB_MEM_MOSAIC);
+    memset(m_rowReleased, 0, m_maskHeight);
+
+    // A row holds at most one span per pixel, including the border
+    m_spanLeft = db_NewArray<int>(m_maskWidth + 2 * BORDER + 1, DB_MEM_MOSAIC);
+    m_spanRight = db_NewArray<int>(m_maskWidth + 2 * BORDER + 1, DB_MEM_MOSAIC);
+}
+
+// With next == NULL, count the spans of each level and site into
+// m_ownerSpanStart[index + 1]; otherwise store them at m_ownerSpans[next[index]++].
+// Within a level and site the spans come out sorted by row and column.
+void Blend::ScanOwnerSpans(YUVinfo &imgMos, int *next)
+{
+    for (int dscale = 0; dscale < m_wb.nlevs; dscale++)
+    {
+        int w = ((m_maskWidth - 1) >> dscale) + 1;
+        int h = ((m_maskHeight - 1) >> dscale) + 1;
+        int *count = m_ownerSpanStart + dscale * 256 + 1;
+        int *pos = next ? next + dscale * 256 : NULL;
+
+        for (int j = 0; j < h; j++)
+        {
+            ImageType yrow = imgMos.Y.ptr[j << dscale];
+            ImageType vrow = imgMos.V.ptr[j << dscale];
+
+            // A pixel belongs to its imgMos.Y site, or to every site if that
+            // is 255, and also to its imgMos.V site when that differs
+            int runY = -1, startY = 0;
+            int runV = -1, startV = 0;
+
+            for (int i = 0; i <= w; i++)
+            {
+                int ownY = -1, ownV = -1;
+                if (i < w)
+                {
+                    ownY = yrow[i << dscale];
+                    if (ownY != 255 && vrow[i << dscale] != ownY)
+                        ownV = vrow[i << dscale];
+                }
+
+                if (ownY != runY)
+                {
+                    if (runY >= 0)
+                    {
+                        if (pos)
+                        {
+                            BlendSpan &span = m_ownerSpans[pos[runY]++];
+                            span.row = j;
+                            span.left = startY;
+                            span.right = i - 1;
+                        }
+                        else
+                        {
+                            count[runY]++;
+                        }
+                    }
+                    runY = ownY;
+                    startY = i;
+                }
+
+                if (ownV != runV)
+                {
+                    if (runV >= 0)
+                    {
+                        if (pos)
+                        {
+                            BlendSpan &span = m_ownerSpans[pos[runV]++];
+                            span.row = j;
+                            span.left = startV;
+                            span.right = i - 1;
+                        }
+                        else
+                        {
+                            count[runV]++;
+                        }
+                    }
+                    runV = ownV;
+                    startV = i;
+                }
+            }
+        }
+    }
+}
+
+void Blend::FreeOwnerSpans()
+{
+    db_Free(m_ownerSpans);
+    db_Free(m_ownerSpanStart);
+    db_Free(m_rowReleased);
+    db_Free(m_spanLeft);
+    db_Free(m_spanRight);
+    m_ownerSpans = NULL;
+    m_ownerSpanStart = NULL;
+    m_rowReleased = NULL;
+    m_spanLeft = m_spanRight = NULL;
+}
+
+// Collect into m_spanLeft/m_spanRight the spans of row j of a level, clipped
+// to [l, r], that the site owns (cs..es), that no site owns (cf..ef) or that
+// lie outside the mosaic, in column order. The span cursors are advanced to
+// row j. checkOwner is set if the row has to be checked pixel by pixel.
+int Blend::GetOwnedSpans(int dscale, int j, int l, int r, BlendSpan *&cs, BlendSpan *es,
+        BlendSpan *&cf, BlendSpan *ef, bool &checkOwner)
+{
+    int n = 0;
+
+    while (cs < es && cs->row < j) cs++;
+    while (cf < ef && cf->row < j) cf++;
+
+    checkOwner = false;
+    if (j < 0 || (j << dscale) >= m_maskHeight || m_rowReleased[j << dscale])
+    {
+        checkOwner = (j >= 0 && (j << dscale) < m_maskHeight);
+        m_spanLeft[n] = l;
+        m_spanRight[n++] = r;
+        return n;
+    }
+
+    int w = ((m_maskWidth - 1) >> dscale) + 1;
+    int lo = (l > 0) ? l : 0;
+    int hi = (r < w - 1) ? r : w - 1;
+
+    if (l < 0)
+    {
+        m_spanLeft[n] = l;
+        m_spanRight[n++] = (r < -1) ? r : -1;
+    }
+
+    while ((cs < es && cs->row == j) || (cf < ef && cf->row == j))
+    {
+        BlendSpan *span;
+        if (cf >= ef || cf->row != j || (cs < es && cs->row == j && cs->left < cf->left))
+            span = cs++;
+        else
+            span = cf++;
+
+        int left = (span->left > lo) ? span->left : lo;
+        int right = (span->right < hi) ? span->right : hi;
+        if (left <= right)
+        {
+            m_spanLeft[n] = left;
+            m_spanRight[n++] = right;
+        }
+    }
+
+    if (r >= w)
+    {
+        m_spanLeft[n] = (l > w) ? l : w;
+        m_spanRight[n++] = r;
+    }
+
+    return n;
+}
+
 void Blend::ComputeMask(CSite *csite, BlendRect &vcrect, BlendRect &brect, MosaicRect &rect, YUVinfo &imgMos, int site_idx)
 {
     PyramidShort *dptr = m_pMosaicYPyr;
@@ -875,10 +1448,41 @@ void Blend::ProcessPyramidForThisFrame(CSite *csite, BlendRect &vcrect, BlendRec
     double inv_trs[3][3];
     inv33d(trs, inv_trs);
 
+    // Choose the inverse warp and the interpolation once for the whole frame
+    int warp = WARP_AFFINE_FLAT;
+    if (inv_trs[2][0] != 0.0 || inv_trs[2][1] != 0.0 || inv_trs[2][2] != 1.0)
+        warp = WARP_PROJECTIVE;
+    else if (m_wb.theta != 0.0)
+        warp = WARP_AFFINE;
+
+    if (m_wb.interp == INTERP_BILINEAR)
+    {
+        if (warp == WARP_PROJECTIVE)
+            ProcessPyramidForThisFrameWarp<WARP_PROJECTIVE, INTERP_BILINEAR>(csite, vcrect, brect, rect, imgMos, inv_trs, site_idx);
+        else if (warp == WARP_AFFINE)
+            ProcessPyramidForThisFrameWarp<WARP_AFFINE, INTERP_BILINEAR>(csite, vcrect, brect, rect, imgMos, inv_trs, site_idx);
+        else
+            ProcessPyramidForThisFrameWarp<WARP_AFFINE_FLAT, INTERP_BILINEAR>(csite, vcrect, brect, rect, imgMos, inv_trs, site_idx);
+    }
+    else
+    {
+        if (warp == WARP_PROJECTIVE)
+            ProcessPyramidForThisFrameWarp<WARP_PROJECTIVE, INTERP_BICUBIC>(csite, vcrect, brect, rect, imgMos, inv_trs, site_idx);
+        else if (warp == WARP_AFFINE)
+            ProcessPyramidForThisFrameWarp<WARP_AFFINE, INTERP_BICUBIC>(csite, vcrect, brect, rect, imgMos, inv_trs, site_idx);
+        else
+            ProcessPyramidForThisFrameWarp<WARP_AFFINE_FLAT, INTERP_BICUBIC>(csite, vcrect, brect, rect, imgMos, inv_trs, site_idx);
+    }
+}
+
+template<int WARP, int INTERP>
+void Blend::ProcessPyramidForThisFrameWarp(CSite *csite, BlendRect &vcrect, BlendRect &brect, MosaicRect &rect, YUVinfo &imgMos, double inv_trs[3][3], int site_idx)
+{
     // Process each pyramid level
-    PyramidShort *sptr = m_pFrameYPyr;
-    PyramidShort *suptr = m_pFrameUPyr;
-    PyramidShort *svptr = m_pFrameVPyr;
+    MosaicFrame *mb = csite->getMb();
+    PyramidShort *sptr = mb->pyrReady ? mb->yPyr : m_pFrameYPyr;
+    PyramidShort *suptr = mb->pyrReady ? mb->uPyr : m_pFrameUPyr;
+    PyramidShort *svptr = mb->pyrReady ? mb->vPyr : m_pFrameVPyr;
 
     PyramidShort *dptr = m_pMosaicYPyr;
     PyramidShort *duptr = m_pMosaicUPyr;
@@ -913,137 +1517,160 @@ void Blend::ProcessPyramidForThisFrame(CSite *csite, BlendRect &vcrect, BlendRec
         else if (t >= dptr->height + BORDER)
             t = dptr->height + BORDER - 1;
 
+        // Spans of this level owned by this site and by no site. The masks
+        // hold 8 bit site indices, so a site past 254 owns no pixels itself.
+        BlendSpan *cs = m_ownerSpans + m_ownerSpanStart[dscale * 256 + 255];
+        BlendSpan *es = cs;
+        if (site_idx < 255)
+        {
+            cs = m_ownerSpans + m_ownerSpanStart[dscale * 256 + site_idx];
+            es = m_ownerSpans + m_ownerSpanStart[dscale * 256 + site_idx + 1];
+        }
+        BlendSpan *cf = m_ownerSpans + m_ownerSpanStart[dscale * 256 + 255];
+        BlendSpan *ef = m_ownerSpans + m_ownerSpanStart[dscale * 256 + 256];
+
         // Walk the Region of interest and populate the pyramid
         for (int j = b; j <= t; j++)
         {
             int jj = (j << dscale);
             double sj = jj + rect.top;
 
-            for (int i = l; i <= r; i++)
+            bool checkOwner;
+            int nspans = GetOwnedSpans(dscale, j, l, r, cs, es, cf, ef, checkOwner);
+
+            // Without the cylindrical unwarp, an affine warp is linear along
+            // the row, so it is walked with increments instead
+            double fx = 0.0, fy = 0.0, fdx = 0.0, fdy = 0.0;
+            if (WARP == WARP_AFFINE_FLAT)
             {
-                int ii = (i << dscale);
-                // project point and then triangulate to neighbors
-                double si = ii + rect.left;
+                double sl = (l << dscale) + rect.left;
+                fx = inv_trs[0][0] * sl + inv_trs[0][1] * sj + inv_trs[0][2];
+                fy = inv_trs[1][0] * sl + inv_trs[1][1] * sj + inv_trs[1][2];
+                fdx = inv_trs[0][0] * (1 << dscale);
+                fdy = inv_trs[1][0] * (1 << dscale);
+            }
 
-                int inMask = ((unsigned) ii < imgMos.Y.width &&
-                        (unsigned) jj < imgMos.Y.height) ? 1 : 0;
+            int i = l;
+            for (int k = 0; k < nspans; k++)
+            {
+                // Step the affine walk over the pixels between spans
+                if (WARP == WARP_AFFINE_FLAT)
+                {
+                    for (; i < m_spanLeft[k]; i++, fx += fdx, fy += fdy)
+                        ;
+                }
+                else
+                {
+                    i = m_spanLeft[k];
+                }
 
-                if(inMask && imgMos.Y.ptr[jj][ii] != site_idx &&
-                        imgMos.V.ptr[jj][ii] != site_idx &&
-                        imgMos.Y.ptr[jj][ii] != 255)
-                    continue;
+                for (; i <= m_spanRight[k]; i++, fx += fdx, fy += fdy)
+                {
+                    int ii = (i << dscale);
+                    // project point and then triangulate to neighbors
+                    double si = ii + rect.left;
 
-                // Setup weights for cross-fading
-                // Weight of the intensity already in the output pixel
-                double wt0 = 0.0;
-                // Weight of the intensity from the input pixel (current frame)
-                double wt1 = 1.0;
+                    int inMask = ((unsigned) ii < imgMos.Y.width &&
+                            (unsigned) jj < imgMos.Y.height) ? 1 : 0;
 
-                if (m_wb.stripType == STRIP_TYPE_WIDE)
-                {
-                    if(inMask && imgMos.Y.ptr[jj][ii] != 255)
+                    if(checkOwner && inMask && imgMos.Y.ptr[jj][ii] != site_idx &&
+                            imgMos.V.ptr[jj][ii] != site_idx &&
+                            imgMos.Y.ptr[jj][ii] != 255)
+                        continue;
+
+                    // Setup weights for cross-fading
+                    // Weight of the intensity already in the output pixel
+                    double wt0 = 0.0;
+                    // Weight of the intensity from the input pixel (current frame)
+                    double wt1 = 1.0;
+
+                    if (m_wb.stripType == STRIP_TYPE_WIDE)
                     {
-                        // If not on a seam OR pyramid level exceeds
-                        // maximum level for cross-fading.
-                        if((imgMos.V.ptr[jj][ii] == 128) ||
-                            (dscale > STRIP_CROSS_FADE_MAX_PYR_LEVEL))
+                        if(inMask && imgMos.Y.ptr[jj][ii] != 255)
                         {
-                            wt0 = 0.0;
-                            wt1 = 1.0;
-                        }
-                        else
-                        {
-                            wt0 = 1.0;
-                            wt1 = ((imgMos.Y.ptr[jj][ii] == site_idx) ?
-                                    (double)imgMos.U.ptr[jj][ii] / 100.0 :
-                                    1.0 - (double)imgMos.U.ptr[jj][ii] / 100.0);
+                            // If not on a seam OR pyramid level exceeds
+                            // maximum level for cross-fading.
+                            if((imgMos.V.ptr[jj][ii] == 128) ||
+                                (dscale > STRIP_CROSS_FADE_MAX_PYR_LEVEL))
+                            {
+                                wt0 = 0.0;
+                                wt1 = 1.0;
+                            }
+                            else
+                            {
+                                wt0 = 1.0;
+                                wt1 = ((imgMos.Y.ptr[jj][ii] == site_idx) ?
+                                        (double)imgMos.U.ptr[jj][ii] / 100.0 :
+                                        1.0 - (double)imgMos.U.ptr[jj][ii] / 100.0);
+                            }
                         }
                     }
-                }
 
-                // Project this mosaic point into the original frame coordinate space
-                double xx, yy;
+                    // Project this mosaic point into the original frame coordinate space
+                    double xx, yy;
 
-                MosaicToFrame(inv_trs, si, sj, xx, yy);
+                    if (WARP == WARP_AFFINE_FLAT)
+                    {
+                        xx = fx;
+                        yy = fy;
+                    }
+                    else
+                    {
+                        MosaicToFrameWarp<WARP>(inv_trs, si, sj, xx, yy);
+                    }
 
-                if (xx < 0.0 || yy < 0.0 || xx > width - 1.0 || yy > height - 1.0)
-                {
-                    if(inMask)
+                    if (xx < 0.0 || yy < 0.0 || xx > width - 1.0 || yy > height - 1.0)
                     {
-                        imgMos.Y.ptr[jj][ii] = 255;
-                        wt0 = 0.0f;
-                        wt1 = 1.0f;
+                        if(inMask)
+                        {
+                            // The later frames may fill this pixel now
+                            if (imgMos.Y.ptr[jj][ii] != 255)
+                                m_rowReleased[jj] = 1;
+                            imgMos.Y.ptr[jj][ii] = 255;
+                            wt0 = 0.0f;
+                            wt1 = 1.0f;
+                        }
                     }
-                }
 
-                xx /= (1 << dscale);
-                yy /= (1 << dscale);
+                    xx /= (1 << dscale);
+                    yy /= (1 << dscale);
 
 
-                int x1 = (xx >= 0.0) ? (int) xx : (int) floor(xx);
-                int y1 = (yy >= 0.0) ? (int) yy : (int) floor(yy);
+                    int x1 = (xx >= 0.0) ? (int) xx : (int) floor(xx);
+                    int y1 = (yy >= 0.0) ? (int) yy : (int) floor(yy);
 
-                // Final destination in extended pyramid
-#ifndef LINEAR_INTERP
-                if(inSegment(x1, sptr->width, BORDER-1) &&
-                        inSegment(y1, sptr->height, BORDER-1))
-                {
-                    double xfrac = xx - x1;
-                    double yfrac = yy - y1;
-                    dptr->ptr[j][i] = (short) (wt0 * dptr->ptr[j][i] + .5 +
-                            wt1 * ciCalc(sptr, x1, y1, xfrac, yfrac));
-                    if (dvptr >= m_pMosaicVPyr && nC > 0)
+                    // Final destination in extended pyramid
+                    // Bicubic interpolation reads one more pixel on each side
+                    int margin = (INTERP == INTERP_BILINEAR) ? BORDER : BORDER - 1;
+                    if(inSegment(x1, sptr->width, margin) &&
+                            inSegment(y1, sptr->height, margin))
                     {
-                        duptr->ptr[j][i] = (short) (wt0 * duptr->ptr[j][i] + .5 +
-                                wt1 * ciCalc(suptr, x1, y1, xfrac, yfrac));
-                        dvptr->ptr[j][i] = (short) (wt0 * dvptr->ptr[j][i] + .5 +
-                                wt1 * ciCalc(svptr, x1, y1, xfrac, yfrac));
+                        double xfrac = xx - x1;
+                        double yfrac = yy - y1;
+                        dptr->ptr[j][i] = (short) (wt0 * dptr->ptr[j][i] + .5 +
+                                wt1 * interpCalc<INTERP>(sptr, x1, y1, xfrac, yfrac));
+                        if (dvptr >= m_pMosaicVPyr && nC > 0)
+                        {
+                            duptr->ptr[j][i] = (short) (wt0 * duptr->ptr[j][i] + .5 +
+                                    wt1 * interpCalc<INTERP>(suptr, x1, y1, xfrac, yfrac));
+                            dvptr->ptr[j][i] = (short) (wt0 * dvptr->ptr[j][i] + .5 +
+                                    wt1 * interpCalc<INTERP>(svptr, x1, y1, xfrac, yfrac));
+                        }
                     }
-                }
-#else
-                if(inSegment(x1, sptr->width, BORDER) && inSegment(y1, sptr->height, BORDER))
-                {
-                    int x2 = x1 + 1;
-                    int y2 = y1 + 1;
-                    double xfrac = xx - x1;
-                    double yfrac = yy - y1;
-                    double y1val = sptr->ptr[y1][x1] +
-                        (sptr->ptr[y1][x2] - sptr->ptr[y1][x1]) * xfrac;
-                    double y2val = sptr->ptr[y2][x1] +
-                        (sptr->ptr[y2][x2] - sptr->ptr[y2][x1]) * xfrac;
-                    dptr->ptr[j][i] = (short) (y1val + yfrac * (y2val - y1val));
-
-                    if (dvptr >= m_pMosaicVPyr && nC > 0)
+                    else
                     {
-                        y1val = suptr->ptr[y1][x1] +
-                            (suptr->ptr[y1][x2] - suptr->ptr[y1][x1]) * xfrac;
-                        y2val = suptr->ptr[y2][x1] +
-                            (suptr->ptr[y2][x2] - suptr->ptr[y2][x1]) * xfrac;
+                        clipToSegment(x1, sptr->width, BORDER);
+                        clipToSegment(y1, sptr->height, BORDER);
 
-                        duptr->ptr[j][i] = (short) (y1val + yfrac * (y2val - y1val));
-
-                        y1val = svptr->ptr[y1][x1] +
-                            (svptr->ptr[y1][x2] - svptr->ptr[y1][x1]) * xfrac;
-                        y2val = svptr->ptr[y2][x1] +
-                            (svptr->ptr[y2][x2] - svptr->ptr[y2][x1]) * xfrac;
-
-                        dvptr->ptr[j][i] = (short) (y1val + yfrac * (y2val - y1val));
-                    }
-                }
-#endif
-                else
-                {
-                    clipToSegment(x1, sptr->width, BORDER);
-                    clipToSegment(y1, sptr->height, BORDER);
-
-                    dptr->ptr[j][i] = (short) (wt0 * dptr->ptr[j][i] + 0.5 +
-                            wt1 * sptr->ptr[y1][x1] );
-                    if (dvptr >= m_pMosaicVPyr && nC > 0)
-                    {
-                        dvptr->ptr[j][i] = (short) (wt0 * dvptr->ptr[j][i] +
-                                0.5 + wt1 * svptr->ptr[y1][x1] );
-                        duptr->ptr[j][i] = (short) (wt0 * duptr->ptr[j][i] +
-                                0.5 + wt1 * suptr->ptr[y1][x1] );
+                        dptr->ptr[j][i] = (short) (wt0 * dptr->ptr[j][i] + 0.5 +
+                                wt1 * sptr->ptr[y1][x1] );
+                        if (dvptr >= m_pMosaicVPyr && nC > 0)
+                        {
+                            dvptr->ptr[j][i] = (short) (wt0 * dvptr->ptr[j][i] +
+                                    0.5 + wt1 * svptr->ptr[y1][x1] );
+                            duptr->ptr[j][i] = (short) (wt0 * duptr->ptr[j][i] +
+                                    0.5 + wt1 * suptr->ptr[y1][x1] );
+                        }
                     }
                 }
             }
@@ -1053,35 +1680,7 @@ void Blend::ProcessPyramidForThisFrame(CSite *csite, BlendRect &vcrect, BlendRec
 
 void Blend::MosaicToFrame(double trs[3][3], double x, double y, double &wx, double &wy)
 {
-    double X, Y, z;
-    if (m_wb.theta == 0.0)
-    {
-        X = x;
-        Y = y;
-    }
-    else if (m_wb.horizontal)
-    {
-        double alpha = x * m_wb.direction / m_wb.width;
-        double length = (y - alpha * m_wb.correction) * m_wb.direction + m_wb.radius;
-        double deltaTheta = m_wb.theta * alpha;
-        double sinTheta = sin(deltaTheta);
-        double cosTheta = sqrt(1.0 - sinTheta * sinTheta) * m_wb.direction;
-        X = length * sinTheta + m_wb.x;
-        Y = length * cosTheta + m_wb.y;
-    }
-    else
-    {
-        double alpha = y * m_wb.direction / m_wb.width;
-        double length = (x - alpha * m_wb.correction) * m_wb.direction + m_wb.radius;
-        double deltaTheta = m_wb.theta * alpha;
-        double sinTheta = sin(deltaTheta);
-        double cosTheta = sqrt(1.0 - sinTheta * sinTheta) * m_wb.direction;
-        Y = length * sinTheta + m_wb.y;
-        X = length * cosTheta + m_wb.x;
-    }
-    z = ProjZ(trs, X, Y, 1.0);
-    wx = ProjX(trs, X, Y, z, 1.0);
-    wy = ProjY(trs, X, Y, z, 1.0);
+    MosaicToFrameWarp<WARP_PROJECTIVE>(trs, x, y, wx, wy);
 }
 
 void Blend::FrameToMosaic(double trs[3][3], double x, double y, double &wx, double &wy)
@@ -1191,6 +1790,33 @@ void Blend::FrameToMosaicRect(int width, int height, double trs[3][3], BlendRect
     }
 }
 
+void Blend::GetFrameCenter(MosaicFrame *mb, double &x, double &y)
+{
+    double midX = mb->width / 2.0;
+    double midY = mb->height / 2.0;
+    double z = ProjZ(mb->trs, midX, midY, 1.0);
+    x = ProjX(mb->trs, midX, midY, z, 1.0);
+    y = ProjY(mb->trs, midX, midY, z, 1.0);
+}
+
+bool Blend::IsRelevantFrame(MosaicFrame *mb, double &prevX, double &prevY)
+{
+    double currX, currY;
+    GetFrameCenter(mb, currX, currY);
+    double deltaX = currX - prevX;
+    double deltaY = currY - prevY;
+
+    if (fabs(deltaX) > STRIP_SEPARATION_THRESHOLD_PXLS ||
+            fabs(deltaY) > STRIP_SEPARATION_THRESHOLD_PXLS)
+    {
+        prevX = currX;
+        prevY = currY;
+        return true;
+    }
+
+    return false;
+}
+
 void Blend::SelectRelevantFrames(MosaicFrame **frames, int frames_size,
         MosaicFrame **relevant_frames, int &relevant_frames_size)
 {
@@ -1198,14 +1824,8 @@ void Blend::SelectRelevantFrames(MosaicFrame **frames, int frames_size,
     MosaicFrame *last = frames[frames_size-1];
     MosaicFrame *mb;
 
-    double fxpos = first->trs[0][2], fypos = first->trs[1][2];
-
-    double midX = last->width / 2.0;
-    double midY = last->height / 2.0;
-    double z = ProjZ(first->trs, midX, midY, 1.0);
-    double firstX, firstY;
-    double prevX = firstX = ProjX(first->trs, midX, midY, z, 1.0);
-    double prevY = firstY = ProjY(first->trs, midX, midY, z, 1.0);
+    double prevX, prevY;
+    GetFrameCenter(first, prevX, prevY);
 
     relevant_frames[0] = first; // Add first frame by default
     relevant_frames_size = 1;
@@ -1213,22 +1833,11 @@ void Blend::SelectRelevantFrames(MosaicFrame **frames, int frames_size,
     for (int i = 0; i < frames_size - 1; i++)
     {
         mb = frames[i];
-        double currX, currY;
-        z = ProjZ(mb->trs, midX, midY, 1.0);
-        currX = ProjX(mb->trs, midX, midY, z, 1.0);
-        currY = ProjY(mb->trs, midX, midY, z, 1.0);
-        double deltaX = currX - prevX;
-        double deltaY = currY - prevY;
-        double center2centerDist = sqrt(deltaY * deltaY + deltaX * deltaX);
 
-        if (fabs(deltaX) > STRIP_SEPARATION_THRESHOLD_PXLS ||
-                fabs(deltaY) > STRIP_SEPARATION_THRESHOLD_PXLS)
+        if (IsRelevantFrame(mb, prevX, prevY))
         {
             relevant_frames[relevant_frames_size] = mb;
             relevant_frames_size++;
-
-            prevX = currX;
-            prevY = currY;
         }
     }
 
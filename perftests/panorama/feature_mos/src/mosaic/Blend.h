@@ -47,6 +47,10 @@ const float STRIP_CROSS_FADE_WIDTH_PXLS = 2;
 // the blending algorithm.
 const int STRIP_CROSS_FADE_MAX_PYR_LEVEL = 2;
 
+// Number of threads that find the seams of a wide strip mosaic, each in its
+// own band of rows or columns.
+const int SEAM_THREADS = 4;
+
 /**
  *  Class for pyramid blending a mosaic.
  */
@@ -68,14 +72,55 @@ public:
   static const int BLEND_RET_ERROR_MEMORY = 1;
   static const int BLEND_RET_CANCELLED    = -2;
 
+  // Quality presets for initialize(), from the final render down to a
+  // fast preview: interpolation and the number of luma and chroma levels
+  static const int QUALITY_FINAL    = 0; // Bicubic, BLEND_RANGE_DEFAULT luma and chroma levels
+  static const int QUALITY_BALANCED = 1; // Bicubic, one luma level and half the chroma levels less
+  static const int QUALITY_PREVIEW  = 2; // Bilinear, fewer luma and chroma levels
+  static const int QUALITY_COUNT    = 3;
+
+  static const int INTERP_BICUBIC  = 0;
+  static const int INTERP_BILINEAR = 1;
+
+  // Inverse warps from the mosaic into a frame, selected once per frame
+  static const int WARP_PROJECTIVE  = 0;
+  static const int WARP_AFFINE      = 1; // Last row of the transformation is [0 0 1]
+  static const int WARP_AFFINE_FLAT = 2; // Affine, and no cylindrical unwarp (theta = 0)
+
   Blend();
   ~Blend();
 
-  int initialize(int blendingType, int stripType, int frame_width, int frame_height);
+  int initialize(int blendingType, int stripType, int frame_width, int frame_height, int quality = QUALITY_FINAL);
 
   int runBlend(MosaicFrame **frames, MosaicFrame **rframes, int frames_size, ImageType &imageMosaicYVU,
         int &mosaicWidth, int &mosaicHeight, float &progress, bool &cancelComputation);
 
+  // Render a preview of the mosaic, downscaled by 1 << scaleLog2, without
+  // pyramid blending: each pixel is a box average from the frame whose
+  // center is nearest. The returned YVU image is owned by the caller.
+  int runPreview(MosaicFrame **frames, MosaicFrame **rframes, int frames_size, int scaleLog2,
+        ImageType &imagePreviewYVU, int &previewWidth, int &previewHeight);
+
+  // Build the reduced luma levels of this frame into mb->lumaPyr at capture
+  // time, so FillFramePyramid does not reduce Y again. Level 1 of the full
+  // pyramid (lumaPyr[0]) also serves as the quarter resolution image.
+  int FillLumaPyramid(MosaicFrame *mb);
+
+  // Build the Y, U and V Laplacian pyramids of this frame into mb->yPyr,
+  // mb->uPyr and mb->vPyr, allocating them on first use, for DoMergeAndBlend
+  // to warp once mb->pyrReady is set. Uses none of the blender's scratch
+  // pyramids, so it may run on another thread while frames are captured.
+  int BuildFramePyramids(MosaicFrame *mb);
+
+  // Center of the frame in mosaic coordinates, as used to select the frames
+  // that make up a wide strip mosaic.
+  void GetFrameCenter(MosaicFrame *mb, double &x, double &y);
+
+  // Whether the center of this frame moved more than
+  // STRIP_SEPARATION_THRESHOLD_PXLS from (prevX, prevY), the center of the
+  // last relevant frame. If so, (prevX, prevY) is updated to this frame.
+  bool IsRelevantFrame(MosaicFrame *mb, double &prevX, double &prevY);
+
 protected:
 
   PyramidShort *m_pFrameYPyr;
@@ -100,15 +145,41 @@ protected:
   // Helper functions
   void FrameToMosaic(double trs[3][3], double x, double y, double &wx, double &wy);
   void MosaicToFrame(double trs[3][3], double x, double y, double &wx, double &wy);
+  template<int WARP> void MosaicToFrameWarp(double trs[3][3], double x, double y, double &wx, double &wy);
   void FrameToMosaicRect(int width, int height, double trs[3][3], BlendRect &brect);
   void ClipBlendRect(CSite *csite, BlendRect &brect);
   void AlignToMiddleFrame(MosaicFrame **frames, int frames_size);
 
+  int  ComputeMosaicExtents(MosaicFrame **frames, int frames_size, MosaicRect &fullRect, MosaicRect &coveredRect);
   int  DoMergeAndBlend(MosaicFrame **frames, int nsite,  int width, int height, YUVinfo &imgMos, MosaicRect &rect, MosaicRect &cropping_rect, float &progress, bool &cancelComputation);
   void ComputeMask(CSite *csite, BlendRect &vcrect, BlendRect &brect, MosaicRect &rect, YUVinfo &imgMos, int site_idx);
   void ProcessPyramidForThisFrame(CSite *csite, BlendRect &vcrect, BlendRect &brect, MosaicRect &rect, YUVinfo &imgMos, double trs[3][3], int site_idx);
-
-  int  FillFramePyramid(MosaicFrame *mb);
+  template<int WARP, int INTERP> void ProcessPyramidForThisFrameWarp(CSite *csite, BlendRect &vcrect, BlendRect &brect, MosaicRect &rect, YUVinfo &imgMos, double inv_trs[3][3], int site_idx);
+
+  int  FillFramePyramid(MosaicFrame *mb, PyramidShort *yPyr, PyramidShort *uPyr, PyramidShort *vPyr);
+
+  // Spans of each pyramid level of the mosaic that each site owns through
+  // imgMos.Y or imgMos.V, built once the masks and seams are final. The
+  // spans of level d and site s are m_ownerSpans[m_ownerSpanStart[d * 256 + s]]
+  // up to the start of the next entry; site 255 holds the pixels no site owns.
+  BlendSpan *m_ownerSpans;
+  int *m_ownerSpanStart;
+  int m_maskWidth, m_maskHeight;
+  // Rows of imgMos in which a frame released pixels to the later frames by
+  // setting them to 255 during the warp; these are checked pixel by pixel.
+  unsigned char *m_rowReleased;
+  // Spans of the current row to visit
+  int *m_spanLeft, *m_spanRight;
+
+  // Find the seams between the images in imgMos.Y and set up the
+  // cross-fading across each of them in imgMos.V and imgMos.U.
+  void FindSeams(YUVinfo &imgMos);
+
+  void BuildOwnerSpans(YUVinfo &imgMos);
+  void ScanOwnerSpans(YUVinfo &imgMos, int *next);
+  void FreeOwnerSpans();
+  int  GetOwnedSpans(int dscale, int j, int l, int r, BlendSpan *&cs, BlendSpan *es,
+          BlendSpan *&cf, BlendSpan *ef, bool &checkOwner);
 
   // TODO: need to add documentation about the parameters
   void ComputeBlendParameters(MosaicFrame **frames, int frames_size, int is360);
@@ -21,6 +21,7 @@
 #include <stdlib.h>
 #include <memory.h>
 #include "Delaunay.h"
+#include "db_utilities.h"
 
 #define QQ 9   // Optimal value as determined by testing
 #define DM 38  // 2^(1+DM/2) element sort capability. DM=38 for >10^6 elements
@@ -194,7 +195,7 @@ CSite *CDelaunay::allocMemory(int n)
   size = ((sizeof(CSite) + sizeof(SitePointer)) * n +
           (sizeof(SitePointer) + sizeof(EdgePointer)) * 12
           ) * n;
-  if (!(sa = (CSite*) malloc(size))) {
+  if (!(sa = (CSite*) db_Malloc(size, DB_MEM_TRIANGULATION))) {
     return NULL;
   }
   sp = (SitePointer *) (sa + n);
@@ -207,7 +208,7 @@ CSite *CDelaunay::allocMemory(int n)
 void CDelaunay::freeMemory()
 {
   if (sa) {
-    free(sa);
+    db_Free(sa);
     sa = (CSite*)NULL;
   }
 }
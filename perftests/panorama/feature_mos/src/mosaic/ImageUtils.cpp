@@ -330,16 +330,18 @@ void ImageUtils::writeBinaryPPM(ImageType image, const char *filename, int width
 
 }
 
-ImageType ImageUtils::allocateImage(int width, int height, int numChannels, short int border)
+ImageType ImageUtils::allocateImage(int width, int height, int numChannels, short int border,
+        int subsystem)
 {
   int overallocation = 256;
- return (ImageType) calloc(width*height*numChannels+overallocation, sizeof(ImageTypeBase));
+ return (ImageType) db_Calloc((width*height*numChannels+overallocation) * sizeof(ImageTypeBase),
+         subsystem);
 }
 
 
 void ImageUtils::freeImage(ImageType image)
 {
-  free(image);
+  db_Free(image);
 }
 
 
@@ -367,7 +369,7 @@ YUVinfo *YUVinfo::allocateImage(unsigned short width, unsigned short height)
     // the middle of a block.  So rearrange the memory layout so after
     // calling mapYUVInforToImage yuv->Y.ptr points to the begginning
     // of the calloc'ed block.
-    YUVinfo *yuv = (YUVinfo *) calloc(sizeof(YUVinfo), 1);
+    YUVinfo *yuv = (YUVinfo *) db_Calloc(sizeof(YUVinfo), DB_MEM_MOSAIC);
     if (yuv) {
         yuv->Y.width  = yuv->Y.pitch = width;
         yuv->Y.height = height;
@@ -375,9 +377,9 @@ YUVinfo *YUVinfo::allocateImage(unsigned short width, unsigned short height)
         yuv->U.width  = yuv->U.pitch = yuv->V.width = yuv->V.pitch = widthUV;
         yuv->U.height = yuv->V.height = heightUV;
 
-        unsigned char* block = (unsigned char*) calloc(
+        unsigned char* block = (unsigned char*) db_Calloc(
                 sizeof(unsigned char *) * (height + heightUV + heightUV) +
-                sizeof(unsigned char) * size, 1);
+                sizeof(unsigned char) * size, DB_MEM_MOSAIC);
 
         position = block;
         unsigned char **y = (unsigned char **) (block + size);
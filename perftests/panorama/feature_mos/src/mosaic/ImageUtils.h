@@ -23,6 +23,8 @@
 
 #include <stdlib.h>
 
+#include "db_utilities.h"
+
 /**
  *  Definition of basic image types
  */
@@ -102,9 +104,11 @@ public:
   static void writeBinaryPPM(ImageType image, const char *filename, int width, int height, int numChannels = IMAGE_TYPE_NUM_CHANNELS);
 
   /**
-   *  Allocate space for a standard image.
+   *  Allocate space for a standard image, charged to subsystem (one of the
+   *  DB_MEM_* subsystems in db_utilities.h).
    */
-  static ImageType allocateImage(int width, int height, int numChannels, short int border = 0);
+  static ImageType allocateImage(int width, int height, int numChannels, short int border = 0,
+          int subsystem = DB_MEM_FRAMES);
 
   /**
    *  Free memory of image
@@ -77,4 +77,15 @@ inline double ciCalc(PyramidShort *img, int xi, int yi, double xfrac, double yfr
           ciTable[40 - off] * tmpf[2] + ciTable[80 - off] * tmpf[3]);
 }
 
+inline double liCalc(PyramidShort *img, int xi, int yi, double xfrac, double yfrac)
+{
+  // Interpolate using 4 points
+  ImageTypeShortBase *in = img->ptr[yi] + xi;
+  double top = in[0] + (in[1] - in[0]) * xfrac;
+  in += img->pitch;
+  double bot = in[0] + (in[1] - in[0]) * xfrac;
+
+  return top + (bot - top) * yfrac;
+}
+
 #endif
@@ -30,23 +30,32 @@ Mosaic::Mosaic()
 {
     initialized = false;
     imageMosaicYVU = NULL;
+    imagePreviewYVU = NULL;
     frames_size = 0;
     max_frames = 200;
+    pyramidThreadStarted = false;
+    pyramidQueue = NULL;
 }
 
 Mosaic::~Mosaic()
 {
+    stopPyramidThread();
+    delete[] pyramidQueue;
+
     for (int i = 0; i < frames_size; i++)
     {
         if (frames[i])
             delete frames[i];
     }
-    delete frames;
-    delete rframes;
+    delete[] frames;
+    delete[] rframes;
 
     for (int j = 0; j < owned_size; j++)
-        delete owned_frames[j];
-    delete owned_frames;
+        ImageUtils::freeImage(owned_frames[j]);
+    delete[] owned_frames;
+
+    if (imagePreviewYVU != NULL)
+        ImageUtils::freeImage(imagePreviewYVU);
 
     if (aligner != NULL)
         delete aligner;
@@ -54,7 +63,7 @@ Mosaic::~Mosaic()
         delete blender;
 }
 
-int Mosaic::initialize(int blendingType, int stripType, int width, int height, int nframes, bool quarter_res, float thresh_still)
+int Mosaic::initialize(int blendingType, int stripType, int width, int height, int nframes, bool quarter_res, float thresh_still, int quality, bool capture_pyramids)
 {
     this->blendingType = blendingType;
 
@@ -66,6 +75,7 @@ int Mosaic::initialize(int blendingType, int stripType, int width, int height, i
     }
 
     this->stripType = stripType;
+    this->quarter_res = quarter_res;
     this->width = width;
     this->height = height;
 
@@ -102,12 +112,34 @@ int Mosaic::initialize(int blendingType, int stripType, int width, int height, i
             blendingType == Blend::BLEND_TYPE_CYLPAN ||
             blendingType == Blend::BLEND_TYPE_HORZ) {
         blender = new Blend();
-        blender->initialize(blendingType, stripType, width, height);
+        if (blender->initialize(blendingType, stripType, width, height, quality) != Blend::BLEND_RET_OK)
+        {
+            return MOSAIC_RET_ERROR;
+        }
     } else {
         blender = NULL;
         return MOSAIC_RET_ERROR;
     }
 
+    if (capture_pyramids)
+    {
+        pyramidQueue = new MosaicFrame *[max_frames];
+        pyramidQueueSize = 0;
+        pyramidBusy = NULL;
+        pyramidStop = false;
+        pthread_mutex_init(&pyramidLock, NULL);
+        pthread_cond_init(&pyramidCond, NULL);
+
+        // Without the thread, the blender reduces every frame itself
+        pyramidThreadStarted =
+                (pthread_create(&pyramidThread, NULL, pyramidThreadMain, this) == 0);
+        if (!pyramidThreadStarted)
+        {
+            pthread_mutex_destroy(&pyramidLock);
+            pthread_cond_destroy(&pyramidCond);
+        }
+    }
+
     initialized = true;
 
     return MOSAIC_RET_OK;
@@ -121,10 +153,21 @@ int Mosaic::addFrameRGB(ImageType imageRGB)
     ImageUtils::rgb2yvu(imageYVU, imageRGB, width, height);
 
     int existing_frames_size = frames_size;
+    ImageType previous = (frames_size > 0) ? frames[frames_size - 1]->image : NULL;
     int ret = addFrame(imageYVU);
 
     if (frames_size > existing_frames_size)
         owned_frames[owned_size++] = imageYVU;
+    else if (frames_size > 0 && frames[frames_size - 1]->image == imageYVU)
+    {
+        // The frame replaced a previous one that will not be blended
+        if (owned_size > 0 && owned_frames[owned_size - 1] == previous)
+        {
+            ImageUtils::freeImage(previous);
+            owned_size--;
+        }
+        owned_frames[owned_size++] = imageYVU;
+    }
     else
         ImageUtils::freeImage(imageYVU);
 
@@ -140,13 +183,23 @@ int Mosaic::addFrame(ImageType imageYVU)
 
     frame->image = imageYVU;
 
+    // For quarter resolution alignment, reduce the luma only once: the
+    // aligner takes its input from the first reduced level and the blender
+    // reuses all of them.
+    PyramidShort *lumaPyr = NULL;
+    if (quarter_res && blender != NULL &&
+            blender->FillLumaPyramid(frame) == Blend::BLEND_RET_OK)
+    {
+        lumaPyr = frame->lumaPyr;
+    }
+
     // Add frame to aligner
     int ret = MOSAIC_RET_ERROR;
     if (aligner != NULL)
     {
         // Note aligner takes in RGB images
         int align_flag = Align::ALIGN_RET_OK;
-        align_flag = aligner->addFrame(frame->image);
+        align_flag = aligner->addFrame(frame->image, lumaPyr);
         aligner->getLastTRS(frame->trs);
 
         if (frames_size >= max_frames)
@@ -157,11 +210,13 @@ int Mosaic::addFrame(ImageType imageYVU)
         switch (align_flag)
         {
             case Align::ALIGN_RET_OK:
-                frames_size++;
+                acceptFrame();
+                queuePyramids(frame);
                 ret = MOSAIC_RET_OK;
                 break;
             case Align::ALIGN_RET_FEW_INLIERS:
-                frames_size++;
+                acceptFrame();
+                queuePyramids(frame);
                 ret = MOSAIC_RET_FEW_INLIERS;
                 break;
             case Align::ALIGN_RET_LOW_TEXTURE:
@@ -179,6 +234,30 @@ int Mosaic::addFrame(ImageType imageYVU)
 }
 
 
+void Mosaic::acceptFrame()
+{
+    // For wide strips, decide right away whether the previous frame is one
+    // SelectRelevantFrames would keep; if not, the new frame takes its slot.
+    if (stripType == Blend::STRIP_TYPE_WIDE && blender != NULL)
+    {
+        if (frames_size == 0)
+        {
+            blender->GetFrameCenter(frames[0], relevantX, relevantY);
+        }
+        else if (frames_size > 1 &&
+                !blender->IsRelevantFrame(frames[frames_size - 1], relevantX, relevantY))
+        {
+            MosaicFrame *culled = frames[frames_size - 1];
+            dropPyramids(culled);
+            frames[frames_size - 1] = frames[frames_size];
+            frames[frames_size] = culled;
+            return;
+        }
+    }
+
+    frames_size++;
+}
+
 int Mosaic::createMosaic(float &progress, bool &cancelComputation)
 {
     if (frames_size <= 0)
@@ -196,6 +275,9 @@ int Mosaic::createMosaic(float &progress, bool &cancelComputation)
 
     }
 
+    // Frames the pyramid thread has not reached yet are reduced in the blend
+    stopPyramidThread();
+
     int ret = Blend::BLEND_RET_ERROR;
 
     // Blend the mosaic (alignment has already been done)
@@ -221,6 +303,51 @@ int Mosaic::createMosaic(float &progress, bool &cancelComputation)
     return ret;
 }
 
+ImageType Mosaic::createPreview(int scaleLog2, int &width, int &height)
+{
+    if (frames_size <= 0 || blender == NULL)
+    {
+        return NULL;
+    }
+
+    if (imagePreviewYVU != NULL)
+    {
+        ImageUtils::freeImage(imagePreviewYVU);
+        imagePreviewYVU = NULL;
+    }
+
+    if (blender->runPreview((MosaicFrame **) frames, (MosaicFrame **) rframes,
+            frames_size, scaleLog2, imagePreviewYVU,
+            previewWidth, previewHeight) != Blend::BLEND_RET_OK)
+    {
+        return NULL;
+    }
+
+    width = previewWidth;
+    height = previewHeight;
+
+    return imagePreviewYVU;
+}
+
+int Mosaic::createMosaicProgressive(int scaleLog2, MosaicReadyCallback callback,
+        void *cookie, float &progress, bool &cancelComputation)
+{
+    int width, height;
+    ImageType preview = createPreview(scaleLog2, width, height);
+    if (preview != NULL)
+    {
+        callback(preview, width, height, false, cookie);
+    }
+
+    int ret = createMosaic(progress, cancelComputation);
+    if (ret == MOSAIC_RET_OK && frames_size > 0)
+    {
+        callback(imageMosaicYVU, mosaicWidth, mosaicHeight, true, cookie);
+    }
+
+    return ret;
+}
+
 ImageType Mosaic::getMosaic(int &width, int &height)
 {
     width = mosaicWidth;
@@ -231,6 +358,91 @@ ImageType Mosaic::getMosaic(int &width, int &height)
 
 
 
+void *Mosaic::pyramidThreadMain(void *arg)
+{
+    ((Mosaic *) arg)->buildPyramids();
+    return NULL;
+}
+
+void Mosaic::buildPyramids()
+{
+    pthread_mutex_lock(&pyramidLock);
+
+    while (true)
+    {
+        while (pyramidQueueSize == 0 && !pyramidStop)
+            pthread_cond_wait(&pyramidCond, &pyramidLock);
+
+        if (pyramidStop)
+            break;
+
+        MosaicFrame *frame = pyramidQueue[0];
+        pyramidQueueSize--;
+        memmove(pyramidQueue, pyramidQueue + 1, pyramidQueueSize * sizeof(MosaicFrame *));
+        pyramidBusy = frame;
+        pthread_mutex_unlock(&pyramidLock);
+
+        bool ready = (blender->BuildFramePyramids(frame) == Blend::BLEND_RET_OK);
+
+        pthread_mutex_lock(&pyramidLock);
+        frame->pyrReady = ready;
+        pyramidBusy = NULL;
+        pthread_cond_broadcast(&pyramidCond);
+    }
+
+    pthread_mutex_unlock(&pyramidLock);
+}
+
+void Mosaic::queuePyramids(MosaicFrame *frame)
+{
+    if (!pyramidThreadStarted)
+        return;
+
+    pthread_mutex_lock(&pyramidLock);
+    pyramidQueue[pyramidQueueSize++] = frame;
+    pthread_cond_broadcast(&pyramidCond);
+    pthread_mutex_unlock(&pyramidLock);
+}
+
+void Mosaic::dropPyramids(MosaicFrame *frame)
+{
+    if (!pyramidThreadStarted)
+        return;
+
+    pthread_mutex_lock(&pyramidLock);
+    for (int i = 0; i < pyramidQueueSize; i++)
+    {
+        if (pyramidQueue[i] == frame)
+        {
+            pyramidQueueSize--;
+            memmove(pyramidQueue + i, pyramidQueue + i + 1,
+                    (pyramidQueueSize - i) * sizeof(MosaicFrame *));
+            break;
+        }
+    }
+    while (pyramidBusy == frame)
+        pthread_cond_wait(&pyramidCond, &pyramidLock);
+    frame->pyrReady = false;
+    pthread_mutex_unlock(&pyramidLock);
+}
+
+void Mosaic::stopPyramidThread()
+{
+    if (!pyramidThreadStarted)
+        return;
+
+    pthread_mutex_lock(&pyramidLock);
+    pyramidStop = true;
+    pyramidQueueSize = 0;
+    pthread_cond_broadcast(&pyramidCond);
+    pthread_mutex_unlock(&pyramidLock);
+
+    pthread_join(pyramidThread, NULL);
+    pthread_mutex_destroy(&pyramidLock);
+    pthread_cond_destroy(&pyramidCond);
+    pyramidThreadStarted = false;
+}
+
 int Mosaic::balanceRotations()
 {
     // Normalize to the mean angle of rotation (Smiley face)
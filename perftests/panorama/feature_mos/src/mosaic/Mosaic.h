@@ -23,6 +23,8 @@
 #ifndef MOSAIC_H
 #define MOSAIC_H
 
+#include <pthread.h>
+
 #include "ImageUtils.h"
 #include "AlignFeatures.h"
 #include "Blend.h"
@@ -71,6 +73,13 @@
     \endcode
 */
 
+/*!
+ *  Called by Mosaic::createMosaicProgressive with the preview (final = false)
+ *  and then with the full resolution mosaic (final = true).
+ */
+typedef void (*MosaicReadyCallback)(ImageType imageYVU, int width, int height,
+        bool final, void *cookie);
+
 /*!
  *  Main class that creates a mosaic by creating an aligner and blender.
  */
@@ -93,12 +102,16 @@ public:
     *   \param nframes      Number of frames to pre-allocate; default value -1 will allocate each frame as it comes
     *   \param quarter_res  Whether to compute alignment at quarter the input resolution (default = false)
     *   \param thresh_still Minimum number of pixels of translation detected between the new frame and the last frame before this frame is added to be mosaiced. For the low-res processing at 320x180 resolution input, we set this to 5 pixels. To reject no frames, set this to 0.0 (default value).
+    *   \param quality      Blend quality preset, Blend::QUALITY_FINAL (default) down to Blend::QUALITY_PREVIEW for a faster, lower quality mosaic.
+    *   \param capture_pyramids Whether a background thread builds the Laplacian pyramids of each frame as it is added, so that createMosaic only warps and collapses them. Costs the memory of three pyramids per kept frame (default = false).
     *   \return             Return code signifying success or failure.
     */
-  int initialize(int blendingType, int stripType, int width, int height, int nframes = -1, bool quarter_res = false, float thresh_still = 0.0);
+  int initialize(int blendingType, int stripType, int width, int height, int nframes = -1, bool quarter_res = false, float thresh_still = 0.0, int quality = Blend::QUALITY_FINAL, bool capture_pyramids = false);
 
    /*!
-    *   Adds a YVU frame to the mosaic.
+    *   Adds a YVU frame to the mosaic. For STRIP_TYPE_WIDE, the previously
+    *   added frame is dropped again here if it is too close to the last
+    *   relevant frame to ever be blended.
     *   \param imageYVU     Pointer to a YVU image.
     *   \return             Return code signifying success or failure.
     */
@@ -118,6 +131,30 @@ public:
     */
   int createMosaic(float &progress, bool &cancelComputation);
 
+    /*!
+    *   Quickly renders a reduced resolution preview from the frames added so
+    *   far, without pyramid blending. Its cost is a small fraction of
+    *   createMosaic, so it can be shown while the full mosaic is computed.
+    *   \param scaleLog2    Downscaling as a power of two: 2 for 1/4, 3 for 1/8.
+    *   \param width        Width of the preview (returned)
+    *   \param height       Height of the preview (returned)
+    *   \return             Pointer to the YVU preview, valid until the next
+    *                       call or until the Mosaic is destroyed, or NULL.
+    */
+  ImageType createPreview(int scaleLog2, int &width, int &height);
+
+    /*!
+    *   Delivers a preview as in createPreview, then performs the final
+    *   blending as in createMosaic and delivers the full resolution result.
+    *   \param scaleLog2    Downscaling of the preview as a power of two.
+    *   \param callback     Receives the preview and then the final mosaic.
+    *   \param cookie       Passed through to the callback.
+    *   \param progress     Variable to set the current progress in.
+    *   \return             Return code of the final blending.
+    */
+  int createMosaicProgressive(int scaleLog2, MosaicReadyCallback callback, void *cookie,
+        float &progress, bool &cancelComputation);
+
     /*!
     *   Obtains the resulting mosaic and its dimensions.
     *   \param width        Width of the resulting mosaic (returned)
@@ -168,6 +205,12 @@ protected:
 
   ImageType imageMosaicYVU;
 
+  /**
+   * Last preview rendered by createPreview, and its size.
+   */
+  ImageType imagePreviewYVU;
+  int previewWidth, previewHeight;
+
   /**
    * Collection of frames that will make up mosaic.
    */
@@ -202,6 +245,19 @@ protected:
     */
   int stripType;
 
+  /**
+    * Whether alignment is computed at quarter resolution. In that case the
+    * reduced luma pyramid of each frame is built once in addFrame and shared
+    * by the aligner and the blender.
+    */
+  bool quarter_res;
+
+  /**
+    * Center of the last relevant frame, for culling wide strip frames
+    * as they are added.
+    */
+  double relevantX, relevantY;
+
   /**
    *  Pointer to aligner.
    */
@@ -221,6 +277,47 @@ protected:
    */
   int balanceRotations();
 
+  /**
+   *  Keeps the frame just stored at frames[frames_size], and for wide
+   *  strips drops the previous frame if SelectRelevantFrames would.
+   */
+  void acceptFrame();
+
+  /**
+    * Background thread that builds the pyramids of the frames in
+    * pyramidQueue, oldest first, while more frames are captured.
+    * pyramidBusy is the frame it is building, if any.
+    */
+  bool pyramidThreadStarted;
+  pthread_t pyramidThread;
+  pthread_mutex_t pyramidLock;
+  pthread_cond_t pyramidCond;
+  MosaicFrame **pyramidQueue;
+  int pyramidQueueSize;
+  MosaicFrame *pyramidBusy;
+  bool pyramidStop;
+
+  static void *pyramidThreadMain(void *arg);
+  void buildPyramids();
+
+  /**
+    * Queues a frame accepted by addFrame for the pyramid thread.
+    */
+  void queuePyramids(MosaicFrame *frame);
+
+  /**
+    * Takes a frame back from the pyramid thread before it is reused:
+    * removes it from the queue or waits until it is built, and marks its
+    * pyramids as not ready.
+    */
+  void dropPyramids(MosaicFrame *frame);
+
+  /**
+    * Stops the pyramid thread. Frames still queued keep no pyramids and
+    * are reduced by the blender as before.
+    */
+  void stopPyramidThread();
+
 };
 
 #endif
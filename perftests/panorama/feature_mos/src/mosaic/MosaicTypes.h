@@ -25,6 +25,7 @@
 #define MOSAIC_TYPES_H
 
 #include "ImageUtils.h"
+#include "Pyramid.h"
 
 /**
  *  Definition of rectangle in a mosaic.
@@ -59,6 +60,15 @@ class BlendRect
     double lft, rgt, top, bot;
 };
 
+/**
+ *  A run of pixels [left, right] in one row of a mosaic pyramid level.
+ */
+class BlendSpan
+{
+    public:
+    unsigned short row, left, right;
+};
+
 /**
  *  A frame making up the mosaic.
  *  Note: Currently assumes a YVU image
@@ -73,12 +83,17 @@ public:
   BlendRect brect;  // This frame warped to the Mosaic coordinate system
   BlendRect vcrect; // brect clipped using the voronoi neighbors
   bool internal_allocation;
+  PyramidShort *lumaPyr; // Reduced luma levels (1..nlevs-1) if built at capture, else NULL
+  PyramidShort *yPyr, *uPyr, *vPyr; // Laplacian pyramids built at capture, valid if pyrReady
+  bool pyrReady;
 
-  MosaicFrame() { };
+  MosaicFrame() { lumaPyr = yPyr = uPyr = vPyr = NULL; pyrReady = false; };
   MosaicFrame(int _width, int _height, bool allocate=true)
   {
     width = _width;
     height = _height;
+    lumaPyr = yPyr = uPyr = vPyr = NULL;
+    pyrReady = false;
     internal_allocation = allocate;
     if(internal_allocation)
         image = ImageUtils::allocateImage(width, height, ImageUtils::IMAGE_TYPE_NUM_CHANNELS);
@@ -89,7 +104,11 @@ public:
   {
     if(internal_allocation)
         if (image)
-        free(image);
+        ImageUtils::freeImage(image);
+    PyramidShort::freeImage(lumaPyr);
+    PyramidShort::freeImage(yPyr);
+    PyramidShort::freeImage(uPyr);
+    PyramidShort::freeImage(vPyr);
   }
 
   /**
@@ -144,6 +163,7 @@ typedef struct {
   int blendRangeUV;
   int nlevs;
   int nlevsC;
+  int interp;
   int blendingType;
   int stripType;
   // Add an overlap to prevent a gap between pictures due to roundoffs
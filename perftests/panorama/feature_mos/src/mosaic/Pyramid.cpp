@@ -30,9 +30,9 @@ PyramidShort *PyramidShort::allocatePyramidPacked(real levels,
     real border2 = (real) (border << 1);
     int lines, size = calcStorage(width, height, border2, levels, &lines);
 
-    PyramidShort *img = (PyramidShort *) calloc(sizeof(PyramidShort) * levels
+    PyramidShort *img = (PyramidShort *) db_Calloc(sizeof(PyramidShort) * levels
             + sizeof(short *) * lines +
-            + sizeof(short) * size, 1);
+            + sizeof(short) * size, DB_MEM_PYRAMIDS);
 
     if (img) {
         PyramidShort *curr, *last;
@@ -63,8 +63,8 @@ PyramidShort *PyramidShort::allocateImage(real width, real height, real border)
 {
     real border2 = (real) (border << 1);
     PyramidShort *img = (PyramidShort *)
-        calloc(sizeof(PyramidShort) + sizeof(short *) * (height + border2) +
-                sizeof(short) * (width + border2) * (height + border2), 1);
+        db_Calloc(sizeof(PyramidShort) + sizeof(short *) * (height + border2) +
+                sizeof(short) * (width + border2) * (height + border2), DB_MEM_PYRAMIDS);
 
     if (img) {
         short **y = (short **) &img[1];
@@ -88,8 +88,19 @@ PyramidShort *PyramidShort::allocateImage(real width, real height, real border)
 // Free the images
 void PyramidShort::freeImage(PyramidShort *image)
 {
-    if (image != NULL)
-        free(image);
+    db_Free(image);
+}
+
+// Copy the levels of one pyramid, including their borders, into another
+// pyramid of the same dimensions
+void PyramidShort::copyPyramid(PyramidShort *out, PyramidShort *in, int levels)
+{
+    for (; levels--; in++, out++) {
+        for (int j = -in->border; j < in->height + in->border; j++) {
+            memcpy(out->ptr[j] - out->border, in->ptr[j] - in->border,
+                    in->pitch * sizeof(short));
+        }
+    }
 }
 
 // Calculate amount of storage needed taking into account the borders, etc.
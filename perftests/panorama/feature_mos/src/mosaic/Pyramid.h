@@ -41,6 +41,7 @@ public:
   static PyramidShort *allocateImage(real width, real height, real border);
   static void createPyramid(ImageType image, PyramidShort *pyramid, int last = 3 );
   static void freeImage(PyramidShort *image);
+  static void copyPyramid(PyramidShort *out, PyramidShort *in, int levels);
 
   static unsigned int calcStorage(real width, real height, real border2, int levels, int *lines);
 
@@ -43,14 +43,14 @@ float** db_AllocStrengthImage_f(float **im,int w,int h)
     aw=n*124+8;
     /*Allocate*/
     size=aw*h+16;
-    *im=new float [size];
+    *im=db_NewArray<float>(size,DB_MEM_ALIGN);
     /*Clean up*/
     p=(*im);
     for(c=0;c<size;c++) p[c]=0.0;
     /*Get a 16 byte aligned pointer*/
     aim=db_AlignPointer_f(*im,16);
     /*Allocate pointer table*/
-    img=new float* [h];
+    img=db_NewArray<float*>(h,DB_MEM_ALIGN);
     /*Initialize the pointer table*/
     for(i=0;i<h;i++)
     {
@@ -62,8 +62,8 @@ float** db_AllocStrengthImage_f(float **im,int w,int h)
 
 void db_FreeStrengthImage_f(float *im,float **img,int h)
 {
-    delete [] im;
-    delete [] img;
+    db_Free(im);
+    db_Free(img);
 }
 
 /*Compute derivatives Ix,Iy for a subrow of img with upper left (i,j) and width chunk_width
@@ -1575,8 +1575,8 @@ void db_CornerDetector_f::Clean()
 {
     if(m_w!=0)
     {
-        delete [] m_temp_f;
-        delete [] m_temp_d;
+        db_Free(m_temp_f);
+        db_Free(m_temp_d);
         db_FreeStrengthImage_f(m_strength_mem,m_strength,m_h);
     }
     m_w=0; m_h=0;
@@ -1619,8 +1619,8 @@ unsigned long db_CornerDetector_f::Start(int im_width,int im_height,
     m_a_thresh=absolute_threshold;
     m_max_nr=db_maxl(1,1+(m_w*m_h*m_area_factor)/10000);
 
-    m_temp_f=new float[13*(m_cw+4)];
-    m_temp_d=new double[5*m_bw*m_bh];
+    m_temp_f=db_NewArray<float>(13*(m_cw+4),DB_MEM_ALIGN);
+    m_temp_d=db_NewArray<double>(5*m_bw*m_bh,DB_MEM_ALIGN);
     m_strength=db_AllocStrengthImage_f(&m_strength_mem,m_w,m_h);
 
     return(m_max_nr);
@@ -1675,8 +1675,8 @@ void db_CornerDetector_u::Clean()
 {
     if(m_w!=0)
     {
-        delete [] m_temp_i;
-        delete [] m_temp_d;
+        db_Free(m_temp_i);
+        db_Free(m_temp_d);
         db_FreeStrengthImage_f(m_strength_mem,m_strength,m_h);
     }
     m_w=0; m_h=0;
@@ -1713,17 +1713,32 @@ unsigned long db_CornerDetector_u::Start(int im_width,int im_height,
     m_bw=block_width;
     m_bh=block_height;
     m_area_factor=area_factor;
+    m_max_area_factor=area_factor;
     m_r_thresh=relative_threshold;
     m_a_thresh=absolute_threshold;
     m_max_nr=db_maxl(1,1+(m_w*m_h*m_area_factor)/10000);
 
-    m_temp_i=new int[18*128];
-    m_temp_d=new double[5*m_bw*m_bh];
+    m_temp_i=db_NewArray<int>(18*128,DB_MEM_ALIGN);
+    m_temp_d=db_NewArray<double>(5*m_bw*m_bh,DB_MEM_ALIGN);
     m_strength=db_AllocStrengthImage_f(&m_strength_mem,m_w,m_h);
 
     return(m_max_nr);
 }
 
+void db_CornerDetector_u::SetTargetNrCorners(int target_nr_corners)
+{
+    int active_width,active_height;
+    unsigned long area_factor;
+
+    if(!m_w) return;
+
+    active_width=db_maxi(1,m_w-10);
+    active_height=db_maxi(1,m_h-10);
+    area_factor=db_minl(1000,db_maxl(1,(long)(10000.0*((double)target_nr_corners)/
+        (((double)active_width)*((double)active_height)))));
+    m_area_factor=db_minl(area_factor,m_max_area_factor);
+}
+
 void db_CornerDetector_u::DetectCorners(const unsigned char * const *img,double *x_coord,double *y_coord,int *nr_corners,
                                         const unsigned char * const *msk, unsigned char fgnd) const
 {
@@ -149,6 +149,11 @@ public:
      Set relative feature threshold
      */
     virtual void SetRelativeThreshold(double r_thresh) { m_r_thresh = r_thresh; };
+    /*!
+     Change the target number of corners without reallocating.
+     The target is capped at the one given to Init().
+     */
+    virtual void SetTargetNrCorners(int target_nr_corners);
 
     /*!
      Extract corners from a pre-computed strength image.
@@ -170,6 +175,8 @@ protected:
     /*Area factor holds the maximum number of corners to detect
     per 10000 pixels*/
     unsigned long m_area_factor,m_max_nr;
+    /*Area factor given to Start(), which sized m_max_nr*/
+    unsigned long m_max_area_factor;
     double m_a_thresh,m_r_thresh;
     int *m_temp_i;
     double *m_temp_d;
@@ -22,6 +22,7 @@
 
 #include "db_utilities.h"
 #include "db_feature_matching.h"
+#include <pthread.h>
 #ifdef _VERBOSE_
 #include <iostream>
 #endif
@@ -623,6 +624,54 @@ inline void db_SignedSquareNormCorr5x5_PreAlign_u(short *patch,const unsigned ch
     *recip= (float)((den!=0.0)?1.0/den:0.0);
 }
 
+/* Lay out the sums of the 2x2 blocks of the top left 10x10 of an 11x11 patch from
+db_SignedSquareNormCorr11x11_PreAlign_u in the 5x5 patch layout. Used as the coarse stage of the
+cascade matcher, which correlates the block means of two patches exactly and bounds the rest by
+Cauchy-Schwarz. For that, sum is set to the sum of the 100 pixels in the blocks, rest to the root
+of the squared deviations of those pixels from their block means and of the other 21 from the
+mean of the patch, and scale to the root of recip, the normalization of the 11x11 patch*/
+inline void db_SignedSquareNormCorr5x5Binned_PreAlign_u(short *patch,const short *fine,float recip,float *sum,float *rest,float *scale)
+{
+    int f2sum,fsum,b2sum,f2sum_out,fsum_out;
+    const short *pf;
+    short f,g;
+    double mean,dev;
+
+    f2sum=0;
+    fsum=0;
+    b2sum=0;
+    f2sum_out=0;
+    fsum_out=0;
+    for (int r=0;r<10;r+=2){
+        pf=fine+r*11;
+        for (int c=0;c<10;c+=2){
+            g=pf[c]+pf[c+1]+pf[c+11]+pf[c+12];
+            f2sum+=pf[c]*pf[c]+pf[c+1]*pf[c+1]+pf[c+11]*pf[c+11]+pf[c+12]*pf[c+12];
+            fsum+=g;
+            b2sum+=g*g;
+            (*patch++)=g;
+        }
+        /*The last column*/
+        f=pf[10]; f2sum_out+=f*f; fsum_out+=f;
+        f=pf[21]; f2sum_out+=f*f; fsum_out+=f;
+    }
+    (*patch++)=0; (*patch++)=0; (*patch++)=0; (*patch++)=0; (*patch++)=0;
+    (*patch++)=0; (*patch++)=0;
+
+    /*The last row*/
+    pf=fine+110;
+    for (int c=0;c<11;c++){
+        f=pf[c]; f2sum_out+=f*f; fsum_out+=f;
+    }
+
+    mean=(fsum+fsum_out)/121.0;
+    dev=(f2sum-b2sum/4.0)+(f2sum_out-2.0*mean*fsum_out+21.0*mean*mean);
+
+    *sum= (float) fsum;
+    *rest= (float) db_SafeSqrt(dev);
+    *scale= (float) db_SafeSqrt(recip);
+}
+
 inline void db_SignedSquareNormCorr21x21_PreAlign_u(short *patch,const unsigned char * const *f_img,int x_f,int y_f,float *sum,float *recip)
 {
     float den;
@@ -2623,15 +2672,15 @@ db_Bucket_f** db_AllocBuckets_f(int nr_h,int nr_v,int bd)
     int i,j;
     db_Bucket_f **bp,*b;
 
-    b=new db_Bucket_f [(nr_h+2)*(nr_v+2)];
-    bp=new db_Bucket_f* [(nr_v+2)];
+    b=db_NewArray<db_Bucket_f>((nr_h+2)*(nr_v+2),DB_MEM_ALIGN);
+    bp=db_NewArray<db_Bucket_f*>(nr_v+2,DB_MEM_ALIGN);
     bp=bp+1;
     for(i= -1;i<=nr_v;i++)
     {
         bp[i]=b+1+(nr_h+2)*(i+1);
         for(j= -1;j<=nr_h;j++)
         {
-            bp[i][j].ptr=new db_PointInfo_f [bd];
+            bp[i][j].ptr=db_NewArray<db_PointInfo_f>(bd,DB_MEM_ALIGN);
         }
     }
 
@@ -2643,15 +2692,15 @@ db_Bucket_u** db_AllocBuckets_u(int nr_h,int nr_v,int bd)
     int i,j;
     db_Bucket_u **bp,*b;
 
-    b=new db_Bucket_u [(nr_h+2)*(nr_v+2)];
-    bp=new db_Bucket_u* [(nr_v+2)];
+    b=db_NewArray<db_Bucket_u>((nr_h+2)*(nr_v+2),DB_MEM_ALIGN);
+    bp=db_NewArray<db_Bucket_u*>(nr_v+2,DB_MEM_ALIGN);
     bp=bp+1;
     for(i= -1;i<=nr_v;i++)
     {
         bp[i]=b+1+(nr_h+2)*(i+1);
         for(j= -1;j<=nr_h;j++)
         {
-            bp[i][j].ptr=new db_PointInfo_u [bd];
+            bp[i][j].ptr=db_NewArray<db_PointInfo_u>(bd,DB_MEM_ALIGN);
         }
     }
 
@@ -2664,10 +2713,10 @@ void db_FreeBuckets_f(db_Bucket_f **bp,int nr_h,int nr_v)
 
     for(i= -1;i<=nr_v;i++) for(j= -1;j<=nr_h;j++)
     {
-        delete [] bp[i][j].ptr;
+        db_Free(bp[i][j].ptr);
     }
-    delete [] (bp[-1]-1);
-    delete [] (bp-1);
+    db_Free(bp[-1]-1);
+    db_Free(bp-1);
 }
 
 void db_FreeBuckets_u(db_Bucket_u **bp,int nr_h,int nr_v)
@@ -2676,10 +2725,10 @@ void db_FreeBuckets_u(db_Bucket_u **bp,int nr_h,int nr_v)
 
     for(i= -1;i<=nr_v;i++) for(j= -1;j<=nr_h;j++)
     {
-        delete [] bp[i][j].ptr;
+        db_Free(bp[i][j].ptr);
     }
-    delete [] (bp[-1]-1);
-    delete [] (bp-1);
+    db_Free(bp[-1]-1);
+    db_Free(bp-1);
 }
 
 void db_EmptyBuckets_f(db_Bucket_f **bp,int nr_h,int nr_v)
@@ -2729,7 +2778,7 @@ float* db_FillBuckets_f(float *patch_space,const float * const *f_img,db_Bucket_
     return(patch_space);
 }
 
-short* db_FillBuckets_u(short *patch_space,const unsigned char * const *f_img,db_Bucket_u **bp,int bw,int bh,int nr_h,int nr_v,int bd,const double *x,const double *y,int nr_corners,int use_smaller_matching_window, int use_21)
+short* db_FillBuckets_u(short *patch_space,const unsigned char * const *f_img,db_Bucket_u **bp,int bw,int bh,int nr_h,int nr_v,int bd,const double *x,const double *y,int nr_corners,int use_smaller_matching_window, int use_21, int cascade)
 {
     int i,xi,yi,xpos,ypos,nr;
     db_Bucket_u *br;
@@ -2767,6 +2816,14 @@ short* db_FillBuckets_u(short *patch_space,const unsigned char * const *f_img,db
                 {
                     db_SignedSquareNormCorr11x11_PreAlign_u(patch_space,f_img,xi,yi,&(pir->sum),&(pir->recip));
                     patch_space+=128;
+                    if(cascade)
+                    {
+                        pir->coarse_patch=patch_space;
+                        pir->pruned= -2.0;
+                        db_SignedSquareNormCorr5x5Binned_PreAlign_u(patch_space,pir->patch,pir->recip,
+                            &(pir->coarse_sum),&(pir->coarse_rest),&(pir->coarse_scale));
+                        patch_space+=32;
+                    }
                 }
                 else
                 {
@@ -2826,7 +2883,7 @@ float* db_FillBucketsPrewarped_f(float *patch_space,const float *const *f_img,db
 
 short* db_FillBucketsPrewarped_u(short *patch_space,const unsigned char * const *f_img,db_Bucket_u **bp,
                                  int bw,int bh,int nr_h,int nr_v,int bd,const double *x,const double *y,
-                                 int nr_corners,const double H[9])
+                                 int nr_corners,const double H[9],int cascade)
 {
     int i,xi,yi,xpos,ypos,nr,wxi,wyi;
     db_Bucket_u *br;
@@ -2862,6 +2919,14 @@ short* db_FillBucketsPrewarped_u(short *patch_space,const unsigned char * const
 
                 db_SignedSquareNormCorr11x11_PreAlign_u(patch_space,f_img,xi,yi,&(pir->sum),&(pir->recip));
                 patch_space+=128;
+                if(cascade)
+                {
+                    pir->coarse_patch=patch_space;
+                    pir->pruned= -2.0;
+                    db_SignedSquareNormCorr5x5Binned_PreAlign_u(patch_space,pir->patch,pir->recip,
+                        &(pir->coarse_sum),&(pir->coarse_rest),&(pir->coarse_scale));
+                    patch_space+=32;
+                }
             }
         }
     }
@@ -2961,27 +3026,57 @@ inline void db_MatchPointPair_f(db_PointInfo_f *pir_l,db_PointInfo_f *pir_r,
     }
 }
 
-inline void db_MatchPointPair_u(db_PointInfo_u *pir_l,db_PointInfo_u *pir_r,
-                            unsigned long kA,unsigned long kB, unsigned int rect_window,bool use_smaller_matching_window, int use_21)
+/*Check if the pair is within the maximum disparity*/
+inline bool db_WithinDisparity_u(const db_PointInfo_u *pir_l,const db_PointInfo_u *pir_r,
+                            unsigned long kA,unsigned long kB, unsigned int rect_window)
 {
     int xm,ym;
-    double score;
-    bool compute_score;
-
 
     if( rect_window )
-        compute_score = ((unsigned)db_absi(pir_l->x - pir_r->x)<kA && (unsigned)db_absi(pir_l->y - pir_r->y)<kB);
-    else
-    {   /*Check if disparity is within the maximum disparity
-        with the formula xm^2*256+ym^2*kA<kB
-        where kA=256*w^2/h^2
-        and   kB=256*max_disp^2*w^2*/
-        xm= pir_l->x - pir_r->x;
-        ym= pir_l->y - pir_r->y;
-        compute_score = ((xm*xm)<<8)+ym*ym*kA < kB;
+        return ((unsigned)db_absi(pir_l->x - pir_r->x)<kA && (unsigned)db_absi(pir_l->y - pir_r->y)<kB);
+
+    /*Check if disparity is within the maximum disparity
+    with the formula xm^2*256+ym^2*kA<kB
+    where kA=256*w^2/h^2
+    and   kB=256*max_disp^2*w^2*/
+    xm= pir_l->x - pir_r->x;
+    ym= pir_l->y - pir_r->y;
+    return ((xm*xm)<<8)+ym*ym*kA < kB;
+}
+
+/*If rec_r is not NULL, the best match of the right
+corner is kept there instead of in the corner itself*/
+inline void db_UpdateBestMatch_u(db_PointInfo_u *pir_l,db_PointInfo_u *pir_r,double score,db_MatchRecord_u *rec_r)
+{
+    if((!(pir_l->pir)) || (score>pir_l->s))
+    {
+        /*Update left corner*/
+        pir_l->s=score;
+        pir_l->pir=pir_r;
+    }
+    if(rec_r)
+    {
+        if((!(rec_r->pir)) || (score>rec_r->s))
+        {
+            rec_r->s=score;
+            rec_r->pir=pir_l;
+        }
     }
+    else if((!(pir_r->pir)) || (score>pir_r->s))
+    {
+        /*Update right corner*/
+        pir_r->s=score;
+        pir_r->pir=pir_l;
+    }
+}
 
-    if ( compute_score )
+inline void db_MatchPointPair_u(db_PointInfo_u *pir_l,db_PointInfo_u *pir_r,
+                            unsigned long kA,unsigned long kB, unsigned int rect_window,bool use_smaller_matching_window, int use_21,
+                            db_MatchRecord_u *rec_r)
+{
+    double score;
+
+    if ( db_WithinDisparity_u(pir_l,pir_r,kA,kB,rect_window) )
     {
         if(use_21)
         {
@@ -3006,17 +3101,187 @@ inline void db_MatchPointPair_u(db_PointInfo_u *pir_l,db_PointInfo_u *pir_r,
         }
         }
 
-        if((!(pir_l->pir)) || (score>pir_l->s))
+        db_UpdateBestMatch_u(pir_l,pir_r,score,rec_r);
+    }
+}
+
+/*Records of the points in right bucket (a,b), or NULL if rec is NULL*/
+inline db_MatchRecord_u *db_BucketRecords_u(db_MatchRecord_u *rec,int a,int b,int nr_h,int bd)
+{
+    return(rec ? rec+((a+1)*(nr_h+2)+b+1)*bd : 0);
+}
+
+/*Upper bound on the signed square 11x11 correlation of a pair, from the 5x5 patches of block
+sums of the cascade matcher: the block means are correlated exactly, and the deviations from
+them are bounded by Cauchy-Schwarz. The bound is raised by a margin that covers the rounding
+error of db_SignedSquareNormCorr11x11Aligned_Post_s, so a pair whose bound is below a score
+cannot score as high*/
+inline double db_CascadeBound_u(const db_PointInfo_u *pir_l,const db_PointInfo_u *pir_r)
+{
+    double mf,mg,fg,c,scale;
+
+    mf=pir_l->sum/121.0;
+    mg=pir_r->sum/121.0;
+    fg=db_ScalarProduct32_s(pir_l->coarse_patch,pir_r->coarse_patch)/4.0-mg*pir_l->coarse_sum-mf*pir_r->coarse_sum+100.0*mf*mg;
+    scale=((double)pir_l->coarse_scale)*pir_r->coarse_scale;
+    c=121.0*(fg+((double)pir_l->coarse_rest)*pir_r->coarse_rest)*scale;
+    return(((c>=0.0)?c*c:-c*c)+DB_CASCADE_ROUNDING_ERROR*scale);
+}
+
+/*Keep the highest bound of a pair that was not scored in full with a right point*/
+inline void db_UpdatePruned_u(db_PointInfo_u *pir_r,double bound,db_MatchRecord_u *rec_r)
+{
+    if(rec_r)
+    {
+        if(bound>rec_r->pruned) rec_r->pruned=bound;
+    }
+    else if(bound>pir_r->pruned) pir_r->pruned=bound;
+}
+
+/*Match a left corner against the 3x3 bucket neighbourhood (i,j) in two stages. Every candidate
+within the disparity range gets an upper bound on its score from the 5x5 patch of block sums.
+Up to top_k are scored with the full 11x11 correlation in decreasing order of their bounds, and
+any other candidate only if its bound reaches the best score so far, so the best match of the
+left corner is that of the exhaustive matcher. The scores are applied in bucket order so that ties
+resolve the same way. The right points keep the bounds of the pairs that were not scored for
+db_VerifyCascadeMatches_u. With no more than top_k candidates, or more than
+DB_MAX_CASCADE_CANDIDATES, the corner is matched exhaustively*/
+inline void db_MatchPointCascade_u(db_PointInfo_u *pir_l,db_Bucket_u **bp_r,int i,int j,
+                            unsigned long kA,unsigned long kB,int rect_window,int top_k,
+                            db_MatchRecord_u *rec,int nr_h,int bd)
+{
+    db_PointInfo_u *cand[DB_MAX_CASCADE_CANDIDATES];
+    db_MatchRecord_u *cand_rec[DB_MAX_CASCADE_CANDIDATES];
+    double cand_bound[DB_MAX_CASCADE_CANDIDATES];
+    double cand_s[DB_MAX_CASCADE_CANDIDATES];
+    bool cand_scored[DB_MAX_CASCADE_CANDIDATES];
+    int a,b,p_r,nr,c,t,top,nr_cand;
+    db_PointInfo_u *pir_r;
+    db_MatchRecord_u *rec_b;
+    double best;
+
+    /*Gather the candidates in bucket order*/
+    nr_cand=0;
+    for(a=i-1;a<=i+1;a++) for(b=j-1;b<=j+1;b++)
+    {
+        nr=bp_r[a][b].nr;
+        pir_r=bp_r[a][b].ptr;
+        rec_b=db_BucketRecords_u(rec,a,b,nr_h,bd);
+        for(p_r=0;p_r<nr;p_r++)
         {
-            /*Update left corner*/
-            pir_l->s=score;
-            pir_l->pir=pir_r;
+            if(!db_WithinDisparity_u(pir_l,pir_r+p_r,kA,kB,rect_window)) continue;
+            if(nr_cand==DB_MAX_CASCADE_CANDIDATES)
+            {
+                nr_cand++;
+                break;
+            }
+            cand[nr_cand]=pir_r+p_r;
+            cand_rec[nr_cand]=rec_b ? rec_b+p_r : 0;
+            nr_cand++;
         }
-        if((!(pir_r->pir)) || (score>pir_r->s))
+    }
+
+    if(nr_cand<=top_k || nr_cand>DB_MAX_CASCADE_CANDIDATES)
+    {
+        for(a=i-1;a<=i+1;a++) for(b=j-1;b<=j+1;b++)
         {
-            /*Update right corner*/
-            pir_r->s=score;
-            pir_r->pir=pir_l;
+            nr=bp_r[a][b].nr;
+            pir_r=bp_r[a][b].ptr;
+            rec_b=db_BucketRecords_u(rec,a,b,nr_h,bd);
+            for(p_r=0;p_r<nr;p_r++)
+                db_MatchPointPair_u(pir_l,pir_r+p_r,kA,kB,rect_window,false,0,rec_b ? rec_b+p_r : 0);
+        }
+        return;
+    }
+
+    /*Bound every candidate*/
+    for(c=0;c<nr_cand;c++)
+    {
+        cand_bound[c]=db_CascadeBound_u(pir_l,cand[c]);
+        cand_scored[c]=false;
+    }
+
+    /*Score up to top_k in decreasing order of their bounds, while they can reach the best score*/
+    best= -2.0;
+    for(t=0;t<top_k;t++)
+    {
+        top=0;
+        for(c=1;c<nr_cand;c++) if(!cand_scored[c] && (cand_scored[top] || cand_bound[c]>cand_bound[top])) top=c;
+        if(cand_scored[top] || cand_bound[top]<best) break;
+        pir_r=cand[top];
+        cand_s[top]=db_SignedSquareNormCorr11x11Aligned_Post_s(pir_l->patch,pir_r->patch,
+            (pir_l->sum)*(pir_r->sum),(pir_l->recip)*(pir_r->recip));
+        cand_scored[top]=true;
+        if(cand_s[top]>best) best=cand_s[top];
+    }
+
+    /*Score the rest only if they can reach the best score, and apply the scores in bucket order*/
+    for(c=0;c<nr_cand;c++)
+    {
+        pir_r=cand[c];
+        if(!cand_scored[c])
+        {
+            if(cand_bound[c]<best)
+            {
+                db_UpdatePruned_u(pir_r,cand_bound[c],cand_rec[c]);
+                continue;
+            }
+            cand_s[c]=db_SignedSquareNormCorr11x11Aligned_Post_s(pir_l->patch,pir_r->patch,
+                (pir_l->sum)*(pir_r->sum),(pir_l->recip)*(pir_r->recip));
+            if(cand_s[c]>best) best=cand_s[c];
+        }
+        db_UpdateBestMatch_u(pir_l,pir_r,cand_s[c],cand_rec[c]);
+    }
+}
+
+/*The cascade scores every pair that could be the best match of its left point, but not every
+pair that could be the best match of its right point. So a right point may have settled for a
+left point that the exhaustive matcher would not have kept. For each mutually consistent match
+whose right point pruned a pair with a bound reaching the match score, score those pairs in full
+and keep the best, the first in bucket order on a tie, as the exhaustive matcher does*/
+void db_VerifyCascadeMatches_u(db_Bucket_u **bp_l,int nr_h,int nr_v,int bw,int bh,
+                     unsigned long kA,unsigned long kB,int rect_window)
+{
+    int i,j,k,a,b,p,ri,rj,br_nr,nr,best_a,best_b,best_p;
+    db_PointInfo_u *pir_l,*pir_r,*pir;
+    double score;
+
+    for(i=0;i<nr_v;i++) for(j=0;j<nr_h;j++)
+    {
+        br_nr=bp_l[i][j].nr;
+        for(k=0;k<br_nr;k++)
+        {
+            pir_l=bp_l[i][j].ptr+k;
+            pir_r=pir_l->pir;
+            if(!pir_r || pir_r->pir!=pir_l || pir_r->pruned<pir_r->s) continue;
+
+            /*The left points that were matched against this right point*/
+            ri=((pir_r->y+bh)/bh)-1;
+            rj=((pir_r->x+bw)/bw)-1;
+            best_a=i;
+            best_b=j;
+            best_p=k;
+            for(a=db_maxi(ri-1,0);a<=db_mini(ri+1,nr_v-1);a++) for(b=db_maxi(rj-1,0);b<=db_mini(rj+1,nr_h-1);b++)
+            {
+                nr=bp_l[a][b].nr;
+                pir=bp_l[a][b].ptr;
+                for(p=0;p<nr;p++,pir++)
+                {
+                    if(pir==pir_r->pir || !db_WithinDisparity_u(pir,pir_r,kA,kB,rect_window)) continue;
+                    if(db_CascadeBound_u(pir,pir_r)<pir_r->s) continue;
+                    score=db_SignedSquareNormCorr11x11Aligned_Post_s(pir->patch,pir_r->patch,
+                        (pir->sum)*(pir_r->sum),(pir->recip)*(pir_r->recip));
+                    if(score>pir_r->s || (score==pir_r->s &&
+                        (a<best_a || (a==best_a && (b<best_b || (b==best_b && p<best_p))))))
+                    {
+                        pir_r->s=score;
+                        pir_r->pir=pir;
+                        best_a=a;
+                        best_b=b;
+                        best_p=p;
+                    }
+                }
+            }
         }
     }
 }
@@ -3033,7 +3298,8 @@ inline void db_MatchPointAgainstBucket_f(db_PointInfo_f *pir_l,db_Bucket_f *b_r,
 }
 
 inline void db_MatchPointAgainstBucket_u(db_PointInfo_u *pir_l,db_Bucket_u *b_r,
-                                       unsigned long kA,unsigned long kB,int rect_window, bool use_smaller_matching_window, int use_21)
+                                       unsigned long kA,unsigned long kB,int rect_window, bool use_smaller_matching_window, int use_21,
+                                       db_MatchRecord_u *rec_b)
 {
     int p_r,nr;
     db_PointInfo_u *pir_r;
@@ -3041,7 +3307,10 @@ inline void db_MatchPointAgainstBucket_u(db_PointInfo_u *pir_l,db_Bucket_u *b_r,
     nr=b_r->nr;
     pir_r=b_r->ptr;
 
-    for(p_r=0;p_r<nr;p_r++) db_MatchPointPair_u(pir_l,pir_r+p_r,kA,kB, rect_window, use_smaller_matching_window, use_21);
+    if(rec_b)
+        for(p_r=0;p_r<nr;p_r++) db_MatchPointPair_u(pir_l,pir_r+p_r,kA,kB, rect_window, use_smaller_matching_window, use_21, rec_b+p_r);
+    else
+        for(p_r=0;p_r<nr;p_r++) db_MatchPointPair_u(pir_l,pir_r+p_r,kA,kB, rect_window, use_smaller_matching_window, use_21, 0);
 
 }
 
@@ -3072,15 +3341,18 @@ void db_MatchBuckets_f(db_Bucket_f **bp_l,db_Bucket_f **bp_r,int nr_h,int nr_v,
     }
 }
 
-void db_MatchBuckets_u(db_Bucket_u **bp_l,db_Bucket_u **bp_r,int nr_h,int nr_v,
-                     unsigned long kA,unsigned long kB,int rect_window,bool use_smaller_matching_window, int use_21)
+/*Match the left points in bucket rows first_row..last_row. If rec is not NULL,
+the best matches of the right points are kept there instead of in the points*/
+void db_MatchBucketRows_u(db_Bucket_u **bp_l,db_Bucket_u **bp_r,int nr_h,int first_row,int last_row,
+                     unsigned long kA,unsigned long kB,int rect_window,bool use_smaller_matching_window, int use_21,
+                     int cascade_top_k,db_MatchRecord_u *rec,int bd)
 {
     int i,j,k,a,b,br_nr;
     db_Bucket_u *br;
     db_PointInfo_u *pir_l;
 
     /*For all buckets*/
-    for(i=0;i<nr_v;i++) for(j=0;j<nr_h;j++)
+    for(i=first_row;i<=last_row;i++) for(j=0;j<nr_h;j++)
     {
         br=&bp_l[i][j];
         br_nr=br->nr;
@@ -3088,12 +3360,128 @@ void db_MatchBuckets_u(db_Bucket_u **bp_l,db_Bucket_u **bp_r,int nr_h,int nr_v,
         for(k=0;k<br_nr;k++)
         {
             pir_l=br->ptr+k;
+            if(cascade_top_k)
+            {
+                db_MatchPointCascade_u(pir_l,bp_r,i,j,kA,kB,rect_window,cascade_top_k,rec,nr_h,bd);
+                continue;
+            }
             for(a=i-1;a<=i+1;a++)
             {
                 for(b=j-1;b<=j+1;b++)
                 {
-                    db_MatchPointAgainstBucket_u(pir_l,&bp_r[a][b],kA,kB,rect_window,use_smaller_matching_window, use_21);
+                    db_MatchPointAgainstBucket_u(pir_l,&bp_r[a][b],kA,kB,rect_window,use_smaller_matching_window, use_21,
+                        db_BucketRecords_u(rec,a,b,nr_h,bd));
+                }
+            }
+        }
+    }
+}
+
+void db_MatchBuckets_u(db_Bucket_u **bp_l,db_Bucket_u **bp_r,int nr_h,int nr_v,
+                     unsigned long kA,unsigned long kB,int rect_window,bool use_smaller_matching_window, int use_21,
+                     int cascade_top_k)
+{
+    db_MatchBucketRows_u(bp_l,bp_r,nr_h,0,nr_v-1,kA,kB,rect_window,use_smaller_matching_window,use_21,cascade_top_k,0,0);
+}
+
+class db_MatchBandJob_u
+{
+public:
+    db_Bucket_u **bp_l,**bp_r;
+    int nr_h,nr_v,bd,first_row,last_row;
+    unsigned long kA,kB;
+    int rect_window;
+    bool use_smaller_matching_window;
+    int use_21,cascade_top_k;
+    db_MatchRecord_u *rec;
+};
+
+void *db_MatchBandThread_u(void *arg)
+{
+    db_MatchBandJob_u *job=(db_MatchBandJob_u*) arg;
+    int i,nr_rec;
+
+    if(job->rec)
+    {
+        /*Start from the same empty state as the serial matcher*/
+        nr_rec=(job->nr_h+2)*(job->nr_v+2)*job->bd;
+        for(i=0;i<nr_rec;i++)
+        {
+            job->rec[i].pir=0;
+            job->rec[i].pruned= -2.0;
+        }
+    }
+    db_MatchBucketRows_u(job->bp_l,job->bp_r,job->nr_h,job->first_row,job->last_row,
+        job->kA,job->kB,job->rect_window,job->use_smaller_matching_window,job->use_21,
+        job->cascade_top_k,job->rec,job->bd);
+    return(0);
+}
+
+/*Match bands of left bucket rows in nr_threads threads. Each left point belongs to
+exactly one band, so its best match is found as in the serial matcher. The first band
+updates the right points directly, the others keep the best match of every right point
+in their own records. Folding the records into the right points in band order then gives
+the same result as visiting the bands serially, since a right point takes a new match only
+if it scores strictly higher and so keeps the earliest of equally good matches.
+rec must hold (nr_threads-1)*(nr_h+2)*(nr_v+2)*bd records*/
+void db_MatchBucketsParallel_u(db_Bucket_u **bp_l,db_Bucket_u **bp_r,int nr_h,int nr_v,int bd,
+                     unsigned long kA,unsigned long kB,int rect_window,bool use_smaller_matching_window, int use_21,
+                     int cascade_top_k,int nr_threads,db_MatchRecord_u *rec)
+{
+    db_MatchBandJob_u job[DB_MAX_MATCH_THREADS];
+    pthread_t thread[DB_MAX_MATCH_THREADS];
+    bool started[DB_MAX_MATCH_THREADS];
+    int t,a,b,p,nr,nr_rec;
+    db_PointInfo_u *pir_r;
+    db_MatchRecord_u *rec_b;
+
+    nr_threads=db_mini(nr_threads,nr_v);
+    if(nr_threads<=1)
+    {
+        db_MatchBuckets_u(bp_l,bp_r,nr_h,nr_v,kA,kB,rect_window,use_smaller_matching_window,use_21,cascade_top_k);
+        return;
+    }
+
+    nr_rec=(nr_h+2)*(nr_v+2)*bd;
+    for(t=0;t<nr_threads;t++)
+    {
+        job[t].bp_l=bp_l; job[t].bp_r=bp_r;
+        job[t].nr_h=nr_h; job[t].nr_v=nr_v; job[t].bd=bd;
+        job[t].first_row=(t*nr_v)/nr_threads;
+        job[t].last_row=((t+1)*nr_v)/nr_threads-1;
+        job[t].kA=kA; job[t].kB=kB;
+        job[t].rect_window=rect_window;
+        job[t].use_smaller_matching_window=use_smaller_matching_window;
+        job[t].use_21=use_21;
+        job[t].cascade_top_k=cascade_top_k;
+        job[t].rec=t ? rec+(t-1)*nr_rec : 0;
+    }
+
+    /*Run the first band on this thread, and any band whose thread could not be started too*/
+    for(t=1;t<nr_threads;t++) started[t]=(pthread_create(&thread[t],0,db_MatchBandThread_u,&job[t])==0);
+    db_MatchBandThread_u(&job[0]);
+    for(t=1;t<nr_threads;t++)
+    {
+        if(started[t]) pthread_join(thread[t],0);
+        else db_MatchBandThread_u(&job[t]);
+    }
+
+    /*Reduce the records in band order*/
+    for(t=1;t<nr_threads;t++)
+    {
+        for(a= -1;a<=nr_v;a++) for(b= -1;b<=nr_h;b++)
+        {
+            nr=bp_r[a][b].nr;
+            pir_r=bp_r[a][b].ptr;
+            rec_b=db_BucketRecords_u(job[t].rec,a,b,nr_h,bd);
+            for(p=0;p<nr;p++,pir_r++,rec_b++)
+            {
+                if(rec_b->pir && ((!(pir_r->pir)) || (rec_b->s>pir_r->s)))
+                {
+                    pir_r->s=rec_b->s;
+                    pir_r->pir=rec_b->pir;
                 }
+                if(cascade_top_k && rec_b->pruned>pir_r->pruned) pir_r->pruned=rec_b->pruned;
             }
         }
     }
@@ -3191,7 +3579,7 @@ void db_Matcher_f::Clean()
         db_FreeBuckets_f(m_bp_l,m_nr_h,m_nr_v);
         db_FreeBuckets_f(m_bp_r,m_nr_h,m_nr_v);
         /*Free space for patch layouts*/
-        delete [] m_patch_space;
+        db_Free(m_patch_space);
     }
     m_w=0; m_h=0;
 }
@@ -3216,7 +3604,7 @@ unsigned long db_Matcher_f::Init(int im_width,int im_height,double max_disparity
     m_bp_r=db_AllocBuckets_f(m_nr_h,m_nr_v,m_bd);
 
     /*Alloc 16byte-aligned space for patch layouts*/
-    m_patch_space=new float [2*(m_nr_h+2)*(m_nr_v+2)*m_bd*128+16];
+    m_patch_space=db_NewArray<float>(2*(m_nr_h+2)*(m_nr_v+2)*m_bd*128+16,DB_MEM_ALIGN);
     m_aligned_patch_space=db_AlignPointer_f(m_patch_space,16);
 
     return(m_target);
@@ -3247,6 +3635,9 @@ db_Matcher_u::db_Matcher_u()
     m_bw=m_bh=m_nr_h=m_nr_v=m_bd=m_target=0;
     m_bp_l=m_bp_r=0;
     m_patch_space=m_aligned_patch_space=0;
+    m_cascade_top_k=0;
+    m_nr_threads=1;
+    m_records=0;
 }
 
 db_Matcher_u::db_Matcher_u(const db_Matcher_u& cm)
@@ -3275,14 +3666,18 @@ void db_Matcher_u::Clean()
         db_FreeBuckets_u(m_bp_l,m_nr_h,m_nr_v);
         db_FreeBuckets_u(m_bp_r,m_nr_h,m_nr_v);
         /*Free space for patch layouts*/
-        delete [] m_patch_space;
+        db_Free(m_patch_space);
+        /*Free thread records*/
+        db_Free(m_records);
+        m_records=0;
     }
     m_w=0; m_h=0;
 }
 
 
 unsigned long db_Matcher_u::Init(int im_width,int im_height,double max_disparity,int target_nr_corners,
-                                 double max_disparity_v, bool use_smaller_matching_window, int use_21)
+                                 double max_disparity_v, bool use_smaller_matching_window, int use_21,
+                                 int cascade_top_k, int nr_threads)
 {
     Clean();
     m_w=im_width;
@@ -3325,24 +3720,35 @@ unsigned long db_Matcher_u::Init(int im_width,int im_height,double max_disparity
     m_use_smaller_matching_window = use_smaller_matching_window;
     m_use_21 = use_21;
 
+    /*The cascade only applies to the 11x11 window*/
+    m_cascade_top_k = (m_use_21 || m_use_smaller_matching_window) ? 0 :
+        db_mini(db_maxi(cascade_top_k,0),DB_MAX_CASCADE_TOP_K);
+
+    /*Alloc right point records for all threads but the first*/
+    m_nr_threads=db_mini(db_maxi(nr_threads,1),db_mini(m_nr_v,DB_MAX_MATCH_THREADS));
+    if(m_nr_threads>1)
+        m_records=db_NewArray<db_MatchRecord_u>((m_nr_threads-1)*(m_nr_h+2)*(m_nr_v+2)*m_bd,DB_MEM_ALIGN);
+
     if(m_use_21)
     {
         /*Alloc 64byte-aligned space for patch layouts*/
-        m_patch_space=new short [2*(m_nr_h+2)*(m_nr_v+2)*m_bd*512+64];
+        m_patch_space=db_NewArray<short>(2*(m_nr_h+2)*(m_nr_v+2)*m_bd*512+64,DB_MEM_ALIGN);
         m_aligned_patch_space=db_AlignPointer_s(m_patch_space,64);
     }
     else
     {
     if(!m_use_smaller_matching_window)
     {
-        /*Alloc 16byte-aligned space for patch layouts*/
-        m_patch_space=new short [2*(m_nr_h+2)*(m_nr_v+2)*m_bd*128+16];
+        /*Alloc 16byte-aligned space for patch layouts, followed
+        by the coarse layouts if the cascade is used*/
+        int patch_size=m_cascade_top_k ? 128+32 : 128;
+        m_patch_space=db_NewArray<short>(2*(m_nr_h+2)*(m_nr_v+2)*m_bd*patch_size+16,DB_MEM_ALIGN);
         m_aligned_patch_space=db_AlignPointer_s(m_patch_space,16);
     }
     else
     {
         /*Alloc 4byte-aligned space for patch layouts*/
-        m_patch_space=new short [2*(m_nr_h+2)*(m_nr_v+2)*m_bd*32+4];
+        m_patch_space=db_NewArray<short>(2*(m_nr_h+2)*(m_nr_v+2)*m_bd*32+4,DB_MEM_ALIGN);
         m_aligned_patch_space=db_AlignPointer_s(m_patch_space,4);
     }
     }
@@ -3356,10 +3762,13 @@ void db_Matcher_u::Match(const unsigned char * const *l_img,const unsigned char
 {
     short *ps;
 
+    /*Affinely warped patches have no coarse layout; match those exhaustively*/
+    int cascade_top_k=(H!=0 && affine) ? 0 : m_cascade_top_k;
+
     /*Insert the corners into bucket structure*/
-    ps=db_FillBuckets_u(m_aligned_patch_space,l_img,m_bp_l,m_bw,m_bh,m_nr_h,m_nr_v,m_bd,x_l,y_l,nr_l,m_use_smaller_matching_window,m_use_21);
+    ps=db_FillBuckets_u(m_aligned_patch_space,l_img,m_bp_l,m_bw,m_bh,m_nr_h,m_nr_v,m_bd,x_l,y_l,nr_l,m_use_smaller_matching_window,m_use_21,cascade_top_k);
     if(H==0)
-        db_FillBuckets_u(ps,r_img,m_bp_r,m_bw,m_bh,m_nr_h,m_nr_v,m_bd,x_r,y_r,nr_r,m_use_smaller_matching_window,m_use_21);
+        db_FillBuckets_u(ps,r_img,m_bp_r,m_bw,m_bh,m_nr_h,m_nr_v,m_bd,x_r,y_r,nr_r,m_use_smaller_matching_window,m_use_21,cascade_top_k);
     else
     {
         if (affine)
@@ -3393,17 +3802,35 @@ void db_Matcher_u::Match(const unsigned char * const *l_img,const unsigned char
                 x_r,y_r,nr_r,H,Hinv,warpbounds,affine);
         }
         else
-            db_FillBucketsPrewarped_u(ps,r_img,m_bp_r,m_bw,m_bh,m_nr_h,m_nr_v,m_bd,x_r,y_r,nr_r,H);
+            db_FillBucketsPrewarped_u(ps,r_img,m_bp_r,m_bw,m_bh,m_nr_h,m_nr_v,m_bd,x_r,y_r,nr_r,H,cascade_top_k);
     }
 
 
     /*Compute all the necessary match scores*/
-    db_MatchBuckets_u(m_bp_l,m_bp_r,m_nr_h,m_nr_v,m_kA,m_kB, m_rect_window,m_use_smaller_matching_window,m_use_21);
+    if(m_nr_threads>1)
+        db_MatchBucketsParallel_u(m_bp_l,m_bp_r,m_nr_h,m_nr_v,m_bd,m_kA,m_kB,m_rect_window,m_use_smaller_matching_window,m_use_21,
+            cascade_top_k,m_nr_threads,m_records);
+    else
+        db_MatchBuckets_u(m_bp_l,m_bp_r,m_nr_h,m_nr_v,m_kA,m_kB, m_rect_window,m_use_smaller_matching_window,m_use_21,cascade_top_k);
+
+    if(cascade_top_k)
+        db_VerifyCascadeMatches_u(m_bp_l,m_nr_h,m_nr_v,m_bw,m_bh,m_kA,m_kB,m_rect_window);
 
     /*Collect the correspondences*/
     db_CollectMatches_u(m_bp_l,m_nr_h,m_nr_v,m_target,id_l,id_r,nr_matches);
 }
 
+void db_Matcher_u::SetMaxDisparity(double max_disparity)
+{
+    if(!m_w) return;
+
+    max_disparity=db_mind(max_disparity,m_max_disparity);
+    if(m_rect_window)
+        m_kA=(int)(max_disparity*m_w);
+    else
+        m_kB=(long)(256.0*max_disparity*max_disparity*((double)(m_w*m_w)));
+}
+
 int db_Matcher_u::IsAllocated()
 {
     return (int)(m_w != 0);
@@ -78,6 +78,21 @@ public:
     float recip;
     /*Pointer to patch layout*/
     const short *patch;
+    /*Precomputed coefficients and layout
+    of the 5x5 patch of 2x2 block sums
+    used by the cascade matcher: the sum
+    of the blocks, the root of the squared
+    deviations from the block means and of
+    the other 21 pixels from the mean of
+    the 11x11 patch, and the root of recip*/
+    float coarse_sum;
+    float coarse_rest;
+    float coarse_scale;
+    const short *coarse_patch;
+    /*Highest bound on the score of a
+    pair that the cascade matcher did not
+    score in full with this right point*/
+    double pruned;
 };
 
 class db_Bucket_u
@@ -86,6 +101,17 @@ public:
     db_PointInfo_u *ptr;
     int nr;
 };
+
+/*Best match of a right point, and its highest
+pruned cascade bound, as seen by one thread of
+the parallel matcher*/
+class db_MatchRecord_u
+{
+public:
+    double s;
+    db_PointInfo_u *pir;
+    double pruned;
+};
 /*!
  * \class db_Matcher_f
  * \ingroup FeatureMatching
@@ -197,13 +223,21 @@ public:
      * \param target_nr_corners maximum number of matches
      * \param max_disparity_v   maximum vertical disparity (distance between matches)
      * \param use_smaller_matching_window   if set to true, uses a correlation window of 5x5 instead of the default 11x11
+     * \param use_21            if set, uses a correlation window of 21x21 instead of the default 11x11
+     * \param cascade_top_k     if larger than 0, every candidate first gets an upper bound on its score from a 5x5 patch of
+     *                          2x2 block sums. Up to cascade_top_k are scored with the full 11x11 correlation in decreasing
+     *                          order of their bounds, and the others only if their bound reaches the best score. The matches
+     *                          are identical to those of the exhaustive matcher. Ignored for the 5x5 and 21x21 windows.
+     * \param nr_threads        number of threads (at most DB_MAX_MATCH_THREADS) to match bands of bucket rows with.
+     *                          The matches are identical to those of the single threaded matcher.
      * \return maximum number of matches
      */
     virtual unsigned long Init(int im_width,int im_height,
         double max_disparity=DB_DEFAULT_MAX_DISPARITY,
         int target_nr_corners=DB_DEFAULT_TARGET_NR_CORNERS,
         double max_disparity_v=DB_DEFAULT_NO_DISPARITY,
-        bool use_smaller_matching_window=false, int use_21=0);
+        bool use_smaller_matching_window=false, int use_21=0,
+        int cascade_top_k=0, int nr_threads=1);
 
     /*!
      * Match two sets of features.
@@ -233,6 +267,14 @@ public:
         const double *x_l,const double *y_l,int nr_l,const double *x_r,const double *y_r,int nr_r,
         int *id_l,int *id_r,int *nr_matches,const double H[9]=0,int affine=0);
 
+    /*!
+     * Change the maximum disparity without reallocating. The disparity is capped at the
+     * one given to Init(), since that sets the bucket size.
+     * \param max_disparity     maximum horizontal (and vertical, unless a max_disparity_v
+     *                          was given to Init()) distance between matches
+     */
+    void SetMaxDisparity(double max_disparity);
+
     /*!
      * Checks if Init() was called.
      * \return 1 if Init() was called, 0 otherwise.
@@ -253,6 +295,10 @@ protected:
     int m_rect_window;
     bool m_use_smaller_matching_window;
     int m_use_21;
+    int m_cascade_top_k;
+    int m_nr_threads;
+    /*Right point records of threads 1..m_nr_threads-1*/
+    db_MatchRecord_u *m_records;
 };
 
 
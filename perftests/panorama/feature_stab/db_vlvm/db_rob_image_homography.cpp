@@ -33,41 +33,105 @@
 using namespace std;
 #endif /*VERBOSE*/
 
-inline double db_RobImageHomography_Cost(double H[9],int point_count,double *x_i,double *xp_i,double one_over_scale2)
+/*Reprojection error kernels specialized on the form of H. The form is
+checked once per homography instead of evaluating the general projective
+error for every point. For H of the given form, the results are
+bit-identical to db_ExpCauchyInhomogenousHomographyError()*/
+#define DB_H_KERNEL_PROJECTIVE  0
+#define DB_H_KERNEL_AFFINE      1 /*last row is [0 0 1]*/
+#define DB_H_KERNEL_TRANSLATION 2 /*[1 0 tx;0 1 ty;0 0 1]*/
+
+inline int db_HomographyKernel(const double H[9])
+{
+    if(H[6]!=0.0 || H[7]!=0.0 || H[8]!=1.0) return(DB_H_KERNEL_PROJECTIVE);
+    if(H[0]!=1.0 || H[1]!=0.0 || H[3]!=0.0 || H[4]!=1.0) return(DB_H_KERNEL_AFFINE);
+    return(DB_H_KERNEL_TRANSLATION);
+}
+
+template<int kernel>
+inline double db_ExpCauchyInhomogenousHomographyErrorK(const double y[2],const double H[9],const double x[2],double one_over_scale2)
+{
+    return(db_ExpCauchyInhomogenousHomographyError(y,H,x,one_over_scale2));
+}
+
+template<>
+inline double db_ExpCauchyInhomogenousHomographyErrorK<DB_H_KERNEL_AFFINE>(const double y[2],const double H[9],const double x[2],double one_over_scale2)
+{
+    double d0,d1;
+    d0=y[0]-(H[0]*x[0]+H[1]*x[1]+H[2]);
+    d1=y[1]-(H[3]*x[0]+H[4]*x[1]+H[5]);
+    return(1.0+(db_sqr(d0)+db_sqr(d1))*one_over_scale2);
+}
+
+template<>
+inline double db_ExpCauchyInhomogenousHomographyErrorK<DB_H_KERNEL_TRANSLATION>(const double y[2],const double H[9],const double x[2],double one_over_scale2)
+{
+    double d0,d1;
+    d0=y[0]-(x[0]+H[2]);
+    d1=y[1]-(x[1]+H[5]);
+    return(1.0+(db_sqr(d0)+db_sqr(d1))*one_over_scale2);
+}
+
+/*Add the robust cost of points first..last under H to *cost*/
+template<int kernel>
+inline void db_RobImageHomography_AccumulateCost(double *cost,const double H[9],int first,int last,double *x_i,double *xp_i,double one_over_scale2)
 {
     int c;
-    double back,acc,*x_i_temp,*xp_i_temp;
+    double acc,*x_i_temp,*xp_i_temp;
 
-    for(back=0.0,c=0;c<point_count;)
+    for(c=first;c<=last;)
     {
         /*Take log of product of ten reprojection
         errors to reduce nr of expensive log operations*/
-        if(c+9<point_count)
+        if(c+9<=last)
         {
             x_i_temp=x_i+(c<<1);
             xp_i_temp=xp_i+(c<<1);
 
-            acc=db_ExpCauchyInhomogenousHomographyError(xp_i_temp,H,x_i_temp,one_over_scale2);
-            acc*=db_ExpCauchyInhomogenousHomographyError(xp_i_temp+2,H,x_i_temp+2,one_over_scale2);
-            acc*=db_ExpCauchyInhomogenousHomographyError(xp_i_temp+4,H,x_i_temp+4,one_over_scale2);
-            acc*=db_ExpCauchyInhomogenousHomographyError(xp_i_temp+6,H,x_i_temp+6,one_over_scale2);
-            acc*=db_ExpCauchyInhomogenousHomographyError(xp_i_temp+8,H,x_i_temp+8,one_over_scale2);
-            acc*=db_ExpCauchyInhomogenousHomographyError(xp_i_temp+10,H,x_i_temp+10,one_over_scale2);
-            acc*=db_ExpCauchyInhomogenousHomographyError(xp_i_temp+12,H,x_i_temp+12,one_over_scale2);
-            acc*=db_ExpCauchyInhomogenousHomographyError(xp_i_temp+14,H,x_i_temp+14,one_over_scale2);
-            acc*=db_ExpCauchyInhomogenousHomographyError(xp_i_temp+16,H,x_i_temp+16,one_over_scale2);
-            acc*=db_ExpCauchyInhomogenousHomographyError(xp_i_temp+18,H,x_i_temp+18,one_over_scale2);
+            acc=db_ExpCauchyInhomogenousHomographyErrorK<kernel>(xp_i_temp,H,x_i_temp,one_over_scale2);
+            acc*=db_ExpCauchyInhomogenousHomographyErrorK<kernel>(xp_i_temp+2,H,x_i_temp+2,one_over_scale2);
+            acc*=db_ExpCauchyInhomogenousHomographyErrorK<kernel>(xp_i_temp+4,H,x_i_temp+4,one_over_scale2);
+            acc*=db_ExpCauchyInhomogenousHomographyErrorK<kernel>(xp_i_temp+6,H,x_i_temp+6,one_over_scale2);
+            acc*=db_ExpCauchyInhomogenousHomographyErrorK<kernel>(xp_i_temp+8,H,x_i_temp+8,one_over_scale2);
+            acc*=db_ExpCauchyInhomogenousHomographyErrorK<kernel>(xp_i_temp+10,H,x_i_temp+10,one_over_scale2);
+            acc*=db_ExpCauchyInhomogenousHomographyErrorK<kernel>(xp_i_temp+12,H,x_i_temp+12,one_over_scale2);
+            acc*=db_ExpCauchyInhomogenousHomographyErrorK<kernel>(xp_i_temp+14,H,x_i_temp+14,one_over_scale2);
+            acc*=db_ExpCauchyInhomogenousHomographyErrorK<kernel>(xp_i_temp+16,H,x_i_temp+16,one_over_scale2);
+            acc*=db_ExpCauchyInhomogenousHomographyErrorK<kernel>(xp_i_temp+18,H,x_i_temp+18,one_over_scale2);
             c+=10;
         }
         else
         {
-            for(acc=1.0;c<point_count;c++)
+            for(acc=1.0;c<=last;c++)
             {
-                acc*=db_ExpCauchyInhomogenousHomographyError(xp_i+(c<<1),H,x_i+(c<<1),one_over_scale2);
+                acc*=db_ExpCauchyInhomogenousHomographyErrorK<kernel>(xp_i+(c<<1),H,x_i+(c<<1),one_over_scale2);
             }
         }
-        back+=log(acc);
+        *cost+=log(acc);
     }
+}
+
+inline void db_RobImageHomography_AccumulateCost(double *cost,const double H[9],int first,int last,double *x_i,double *xp_i,double one_over_scale2)
+{
+    switch(db_HomographyKernel(H))
+    {
+    case DB_H_KERNEL_TRANSLATION:
+        db_RobImageHomography_AccumulateCost<DB_H_KERNEL_TRANSLATION>(cost,H,first,last,x_i,xp_i,one_over_scale2);
+        break;
+    case DB_H_KERNEL_AFFINE:
+        db_RobImageHomography_AccumulateCost<DB_H_KERNEL_AFFINE>(cost,H,first,last,x_i,xp_i,one_over_scale2);
+        break;
+    default:
+        db_RobImageHomography_AccumulateCost<DB_H_KERNEL_PROJECTIVE>(cost,H,first,last,x_i,xp_i,one_over_scale2);
+        break;
+    }
+}
+
+inline double db_RobImageHomography_Cost(double H[9],int point_count,double *x_i,double *xp_i,double one_over_scale2)
+{
+    double back=0.0;
+
+    db_RobImageHomography_AccumulateCost(&back,H,0,point_count-1,x_i,xp_i,one_over_scale2);
     return(back);
 }
 
@@ -674,8 +738,6 @@ void db_RobImageHomography(
     int i,j,c,point_count,hyp_count;
     int last_hyp,new_last_hyp,last_corr;
     int pos,point_pos,last_point;
-    /*Accumulator*/
-    double acc;
     /*Hypothesis pointer*/
     double *hyp_point;
     /*Random sample*/
@@ -689,8 +751,6 @@ void db_RobImageHomography(
     /*One over the squared scale of
     Cauchy distribution*/
     double one_over_scale2;
-    /*temporary pointers*/
-    double *x_i_temp,*xp_i_temp;
     /*Temporary space for inverse calibration matrices*/
     double K_inv[9];
     double Kp_inv[9];
@@ -943,36 +1003,7 @@ void db_RobImageHomography(
             for(j=0;j<=last_hyp;j++)
             {
                 hyp_point=hyp_H_array+9*hyp_perm[j];
-                for(c=i;c<=last_corr;)
-                {
-                    /*Take log of product of ten reprojection
-                    errors to reduce nr of expensive log operations*/
-                    if(c+9<=last_corr)
-                    {
-                        x_i_temp=x_i+(c<<1);
-                        xp_i_temp=xp_i+(c<<1);
-
-                        acc=db_ExpCauchyInhomogenousHomographyError(xp_i_temp,hyp_point,x_i_temp,one_over_scale2);
-                        acc*=db_ExpCauchyInhomogenousHomographyError(xp_i_temp+2,hyp_point,x_i_temp+2,one_over_scale2);
-                        acc*=db_ExpCauchyInhomogenousHomographyError(xp_i_temp+4,hyp_point,x_i_temp+4,one_over_scale2);
-                        acc*=db_ExpCauchyInhomogenousHomographyError(xp_i_temp+6,hyp_point,x_i_temp+6,one_over_scale2);
-                        acc*=db_ExpCauchyInhomogenousHomographyError(xp_i_temp+8,hyp_point,x_i_temp+8,one_over_scale2);
-                        acc*=db_ExpCauchyInhomogenousHomographyError(xp_i_temp+10,hyp_point,x_i_temp+10,one_over_scale2);
-                        acc*=db_ExpCauchyInhomogenousHomographyError(xp_i_temp+12,hyp_point,x_i_temp+12,one_over_scale2);
-                        acc*=db_ExpCauchyInhomogenousHomographyError(xp_i_temp+14,hyp_point,x_i_temp+14,one_over_scale2);
-                        acc*=db_ExpCauchyInhomogenousHomographyError(xp_i_temp+16,hyp_point,x_i_temp+16,one_over_scale2);
-                        acc*=db_ExpCauchyInhomogenousHomographyError(xp_i_temp+18,hyp_point,x_i_temp+18,one_over_scale2);
-                        c+=10;
-                    }
-                    else
-                    {
-                        for(acc=1.0;c<=last_corr;c++)
-                        {
-                            acc*=db_ExpCauchyInhomogenousHomographyError(xp_i+(c<<1),hyp_point,x_i+(c<<1),one_over_scale2);
-                        }
-                    }
-                    hyp_cost_array[j]+=log(acc);
-                }
+                db_RobImageHomography_AccumulateCost(&hyp_cost_array[j],hyp_point,i,last_corr,x_i,xp_i,one_over_scale2);
             }
             if (chunk_size<point_count){
                 /*Prune out half of the hypotheses*/
@@ -19,13 +19,126 @@
 #include "db_utilities.h"
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*Each block starts with this header, padded to keep the block aligned*/
+typedef union
+{
+    struct
+    {
+        size_t size;
+        int subsystem;
+    } info;
+    double align[2];
+} db_MemoryHeader;
+
+static db_AllocFunc db_alloc_func=NULL;
+static db_FreeFunc db_free_func=NULL;
+static void *db_alloc_cookie=NULL;
+
+/*Updated atomically, allocations may come from several threads*/
+static long long db_mem_current[DB_MEM_NR_SUBSYSTEMS+1];
+static long long db_mem_peak[DB_MEM_NR_SUBSYSTEMS+1];
+
+inline void db_RaisePeak(long long *peak,long long value)
+{
+    long long old=*peak;
+    while(value>old)
+    {
+        long long seen=__sync_val_compare_and_swap(peak,old,value);
+        if(seen==old) break;
+        old=seen;
+    }
+}
+
+inline void db_ChargeMemory(int subsystem,long long bytes)
+{
+    long long held;
+
+    held=__sync_add_and_fetch(&db_mem_current[subsystem],bytes);
+    if(bytes>0) db_RaisePeak(&db_mem_peak[subsystem],held);
+
+    held=__sync_add_and_fetch(&db_mem_current[DB_MEM_NR_SUBSYSTEMS],bytes);
+    if(bytes>0) db_RaisePeak(&db_mem_peak[DB_MEM_NR_SUBSYSTEMS],held);
+}
+
+void db_SetAllocator(db_AllocFunc alloc,db_FreeFunc free,void *cookie)
+{
+    db_alloc_func=alloc;
+    db_free_func=free;
+    db_alloc_cookie=cookie;
+}
+
+void* db_Malloc(size_t size,int subsystem)
+{
+    db_MemoryHeader *header;
+    size_t total=size+sizeof(db_MemoryHeader);
+
+    assert(subsystem>=0 && subsystem<DB_MEM_NR_SUBSYSTEMS);
+    if(total<size) return(NULL);
+
+    if(db_alloc_func) header=(db_MemoryHeader*) db_alloc_func(total,db_alloc_cookie);
+    else header=(db_MemoryHeader*) malloc(total);
+    if(!header) return(NULL);
+
+    header->info.size=size;
+    header->info.subsystem=subsystem;
+    db_ChargeMemory(subsystem,(long long) size);
+
+    return((void*) (header+1));
+}
+
+void* db_Calloc(size_t size,int subsystem)
+{
+    void *ptr=db_Malloc(size,subsystem);
+    if(ptr) memset(ptr,0,size);
+    return(ptr);
+}
+
+void db_Free(void *ptr)
+{
+    db_MemoryHeader *header;
+
+    if(!ptr) return;
+    header=((db_MemoryHeader*) ptr)-1;
+    db_ChargeMemory(header->info.subsystem,-(long long) header->info.size);
+
+    if(db_free_func) db_free_func((void*) header,db_alloc_cookie);
+    else free(header);
+}
+
+void db_GetMemoryStats(db_MemoryStats *stats)
+{
+    int i;
+    for(i=0;i<DB_MEM_NR_SUBSYSTEMS;i++)
+    {
+        stats->current[i]=__sync_add_and_fetch(&db_mem_current[i],0);
+        stats->peak[i]=__sync_add_and_fetch(&db_mem_peak[i],0);
+    }
+    stats->total_current=__sync_add_and_fetch(&db_mem_current[DB_MEM_NR_SUBSYSTEMS],0);
+    stats->total_peak=__sync_add_and_fetch(&db_mem_peak[DB_MEM_NR_SUBSYSTEMS],0);
+}
+
+void db_ResetMemoryPeaks()
+{
+    int i;
+    for(i=0;i<=DB_MEM_NR_SUBSYSTEMS;i++)
+    {
+        long long held=__sync_add_and_fetch(&db_mem_current[i],0);
+        __sync_lock_test_and_set(&db_mem_peak[i],held);
+    }
+}
 
 float** db_SetupImageReferences_f(float *im,int w,int h)
 {
     int i;
     float **img;
     assert(im);
-    img=new float* [h];
+    img=db_NewArray<float*>(h,DB_MEM_ALIGN);
     for(i=0;i<h;i++)
     {
         img[i]=im+w*i;
@@ -40,7 +153,7 @@ unsigned char** db_SetupImageReferences_u(unsigned char *im,int w,int h)
 
     assert(im);
 
-    img=new unsigned char* [h];
+    img=db_NewArray<unsigned char*>(h,DB_MEM_ALIGN);
     for(i=0;i<h;i++)
     {
         img[i]=im+w*i;
@@ -51,7 +164,7 @@ float** db_AllocImage_f(int w,int h,int over_allocation)
 {
     float **img,*im;
 
-    im=new float [w*h+over_allocation];
+    im=db_NewArray<float>(w*h+over_allocation,DB_MEM_ALIGN);
     img=db_SetupImageReferences_f(im,w,h);
 
     return(img);
@@ -61,7 +174,7 @@ unsigned char** db_AllocImage_u(int w,int h,int over_allocation)
 {
     unsigned char **img,*im;
 
-    im=new unsigned char [w*h+over_allocation];
+    im=db_NewArray<unsigned char>(w*h+over_allocation,DB_MEM_ALIGN);
     img=db_SetupImageReferences_u(im,w,h);
 
     return(img);
@@ -69,14 +182,14 @@ unsigned char** db_AllocImage_u(int w,int h,int over_allocation)
 
 void db_FreeImage_f(float **img,int h)
 {
-    delete [] (img[0]);
-    delete [] img;
+    db_Free(img[0]);
+    db_Free(img);
 }
 
 void db_FreeImage_u(unsigned char **img,int h)
 {
-    delete [] (img[0]);
-    delete [] img;
+    db_Free(img[0]);
+    db_Free(img);
 }
 
 // ----------------------------------------------------------------------------------------------------------- ;
@@ -105,8 +218,8 @@ inline void db_WarpImageLutFast_u(const unsigned char * const * src, unsigned ch
     assert(src && dst);
     int xd=0, yd=0;
 
-    for ( int i = 0; i < w; ++i )
-        for ( int j = 0; j < h; ++j )
+    for ( int j = 0; j < h; ++j )
+        for ( int i = 0; i < w; ++i )
         {
             //xd = static_cast<unsigned int>(lut_x[j][i]);
             //yd = static_cast<unsigned int>(lut_y[j][i]);
@@ -126,12 +239,12 @@ inline void db_WarpImageLutBilinear_u(const unsigned char * const * src, unsigne
     assert(src && dst);
     double xd=0.0, yd=0.0;
 
-    for ( int i = 0; i < w; ++i )
-        for ( int j = 0; j < h; ++j )
+    for ( int j = 0; j < h; ++j )
+        for ( int i = 0; i < w; ++i )
         {
             xd = static_cast<double>(lut_x[j][i]);
             yd = static_cast<double>(lut_y[j][i]);
-            if ( xd > w   || yd > h ||
+            if ( xd > w-2 || yd > h-2 ||
                  xd < 0.0 || yd < 0.0)
                 dst[j][i] = 0;
             else
@@ -156,6 +269,145 @@ void db_WarpImageLut_u(const unsigned char * const * src, unsigned char ** dst,
     }
 }
 
+db_LutEntry_s** db_AllocLutFixed(int w,int h)
+{
+    db_LutEntry_s **lut,*mem;
+    int j;
+
+    mem=db_NewArray<db_LutEntry_s>(w*h,DB_MEM_ALIGN);
+    lut=db_NewArray<db_LutEntry_s*>(h,DB_MEM_ALIGN);
+    for(j=0;j<h;j++) lut[j]=mem+j*w;
+
+    return(lut);
+}
+
+void db_FreeLutFixed(db_LutEntry_s **lut,int h)
+{
+    db_Free(lut[0]);
+    db_Free(lut);
+}
+
+/*Bilinear sample of a fixed point LUT entry, rounded to nearest*/
+inline unsigned char db_BilinearInterpolationFixed(const db_LutEntry_s *e,const unsigned char * const * src)
+{
+    const unsigned char *p0,*p1;
+    int fx,fy,top,bottom;
+
+    if(e->x<0) return(0);
+
+    p0=src[e->y]+e->x;
+    p1=src[e->y+1]+e->x;
+    fx=e->fx;
+    fy=e->fy;
+    top=p0[0]*(DB_LUT_FRAC_ONE-fx)+p0[1]*fx;
+    bottom=p1[0]*(DB_LUT_FRAC_ONE-fx)+p1[1]*fx;
+
+    return((unsigned char)((top*(DB_LUT_FRAC_ONE-fy)+bottom*fy+(1<<(2*DB_LUT_FRAC_BITS-1)))>>(2*DB_LUT_FRAC_BITS)));
+}
+
+void db_WarpImageLutFixedRows_u(const unsigned char * const * src, unsigned char ** dst, int w,
+                                int first_row, int last_row, const db_LutEntry_s * const * lut)
+{
+    int i,j;
+
+    for(j=first_row;j<=last_row;j++)
+    {
+        const db_LutEntry_s *e=lut[j];
+        unsigned char *d=dst[j];
+
+        i=0;
+#ifdef __SSE2__
+        /*Four pixels at a time. The 2x2 neighbourhoods are gathered as pairs of
+        horizontal neighbours, so that pmaddwd does each interpolation step
+        with the exact integer arithmetic of db_BilinearInterpolationFixed()*/
+        const __m128i zero=_mm_setzero_si128();
+        const __m128i one=_mm_set1_epi32(DB_LUT_FRAC_ONE);
+        const __m128i round=_mm_set1_epi32(1<<(2*DB_LUT_FRAC_BITS-1));
+        for(;i+3<w;i+=4,e+=4)
+        {
+            int top[4],bottom[4],fx[4],fy[4];
+            for(int k=0;k<4;k++)
+            {
+                if(e[k].x<0)
+                {
+                    top[k]=bottom[k]=0;
+                }
+                else
+                {
+                    const unsigned char *p0=src[e[k].y]+e[k].x;
+                    const unsigned char *p1=src[e[k].y+1]+e[k].x;
+                    top[k]=p0[0]|(p0[1]<<16);
+                    bottom[k]=p1[0]|(p1[1]<<16);
+                }
+                fx[k]=e[k].fx;
+                fy[k]=e[k].fy;
+            }
+            __m128i vfx=_mm_loadu_si128((const __m128i*)fx);
+            __m128i vfy=_mm_loadu_si128((const __m128i*)fy);
+            /*Weight pairs (1-f,f) in the low and high 16 bits*/
+            __m128i wx=_mm_or_si128(_mm_sub_epi32(one,vfx),_mm_slli_epi32(vfx,16));
+            __m128i wy=_mm_or_si128(_mm_sub_epi32(one,vfy),_mm_slli_epi32(vfy,16));
+
+            __m128i t=_mm_madd_epi16(_mm_loadu_si128((const __m128i*)top),wx);
+            __m128i b=_mm_madd_epi16(_mm_loadu_si128((const __m128i*)bottom),wx);
+            /*Both are below 2^15, so they pair up as 16 bit values again*/
+            __m128i v=_mm_madd_epi16(_mm_or_si128(t,_mm_slli_epi32(b,16)),wy);
+            v=_mm_srai_epi32(_mm_add_epi32(v,round),2*DB_LUT_FRAC_BITS);
+            v=_mm_packs_epi32(v,zero);
+            v=_mm_packus_epi16(v,zero);
+            *(int*)(d+i)=_mm_cvtsi128_si32(v);
+        }
+#endif
+        for(;i<w;i++,e++) d[i]=db_BilinearInterpolationFixed(e,src);
+    }
+}
+
+class db_WarpBandJob_u
+{
+public:
+    const unsigned char * const * src;
+    unsigned char ** dst;
+    int w,first_row,last_row;
+    const db_LutEntry_s * const * lut;
+};
+
+void *db_WarpBandThread_u(void *arg)
+{
+    db_WarpBandJob_u *job=(db_WarpBandJob_u*) arg;
+    db_WarpImageLutFixedRows_u(job->src,job->dst,job->w,job->first_row,job->last_row,job->lut);
+    return(0);
+}
+
+void db_WarpImageLutFixed_u(const unsigned char * const * src, unsigned char ** dst, int w, int h,
+                            const db_LutEntry_s * const * lut, int nr_threads)
+{
+    db_WarpBandJob_u job[DB_MAX_WARP_THREADS];
+    pthread_t thread[DB_MAX_WARP_THREADS];
+    bool started[DB_MAX_WARP_THREADS];
+    int t;
+
+    assert(src && dst && lut);
+    nr_threads=db_mini(db_mini(db_maxi(nr_threads,1),DB_MAX_WARP_THREADS),db_maxi(h,1));
+
+    for(t=0;t<nr_threads;t++)
+    {
+        job[t].src=src;
+        job[t].dst=dst;
+        job[t].w=w;
+        job[t].first_row=(t*h)/nr_threads;
+        job[t].last_row=((t+1)*h)/nr_threads-1;
+        job[t].lut=lut;
+    }
+
+    /*The bands do not overlap, so any thread that cannot be started just runs here*/
+    for(t=1;t<nr_threads;t++) started[t]=(pthread_create(&thread[t],0,db_WarpBandThread_u,&job[t])==0);
+    db_WarpBandThread_u(&job[0]);
+    for(t=1;t<nr_threads;t++)
+    {
+        if(started[t]) pthread_join(thread[t],0);
+        else db_WarpBandThread_u(&job[t]);
+    }
+}
 
 void db_PrintDoubleVector(double *a,long size)
 {
@@ -47,6 +47,7 @@
 #endif
 
 #include <math.h>
+#include <stddef.h>
 
 #include <assert.h>
 #include "db_utilities_constants.h"
@@ -389,6 +390,79 @@ inline void db_MultiplyScalarCopy9(double *A,const double *B,double mult)
     (*A++)=(*B++)*mult; (*A++)=(*B++)*mult; (*A++)=(*B++)*mult; (*A++)=(*B++)*mult;
 }
 
+/*!
+ * \defgroup LMMemory (LM) Memory Accounting
+
+ The large buffers of the panorama library are allocated through db_Malloc()
+and db_Calloc() and released with db_Free(). Each block is charged to a
+subsystem, and the bytes currently held and their peak are kept per
+subsystem and in total. The memory itself comes from malloc() and free(),
+or from the functions passed to db_SetAllocator().
+
+ */
+/*\{*/
+/*!
+ * Subsystems that allocations are charged to.
+ */
+enum
+{
+    DB_MEM_ALIGN,         /*!< feature detection, matching and registration */
+    DB_MEM_FRAMES,        /*!< captured frames */
+    DB_MEM_PYRAMIDS,      /*!< image pyramids */
+    DB_MEM_MOSAIC,        /*!< mosaic being blended and its masks */
+    DB_MEM_TRIANGULATION, /*!< Delaunay triangulation of the frame centers */
+    DB_MEM_NR_SUBSYSTEMS
+};
+/*!
+ * Bytes held per subsystem and in total, now and at their peak since the
+ * last db_ResetMemoryPeaks().
+ */
+typedef struct
+{
+    long long current[DB_MEM_NR_SUBSYSTEMS];
+    long long peak[DB_MEM_NR_SUBSYSTEMS];
+    long long total_current;
+    long long total_peak;
+} db_MemoryStats;
+typedef void* (*db_AllocFunc)(size_t size,void *cookie);
+typedef void (*db_FreeFunc)(void *ptr,void *cookie);
+/*!
+ * Take the memory from alloc and return it to free, each called with cookie,
+ * instead of malloc() and free(). alloc may return NULL to refuse a block.
+ * Must be called while nothing allocated through db_Malloc() is held.
+ * NULL functions restore malloc() and free().
+ */
+DB_API void db_SetAllocator(db_AllocFunc alloc,db_FreeFunc free,void *cookie);
+/*!
+ * Allocate size bytes charged to subsystem, aligned as malloc() would.
+ * \return pointer to the block or NULL
+ */
+DB_API void* db_Malloc(size_t size,int subsystem);
+/*!
+ * Allocate size zeroed bytes charged to subsystem.
+ */
+DB_API void* db_Calloc(size_t size,int subsystem);
+/*!
+ * Free a block from db_Malloc() or db_Calloc(). NULL is ignored.
+ */
+DB_API void db_Free(void *ptr);
+/*!
+ * Allocate an array of n elements of a plain type, to be freed with db_Free().
+ */
+template<class T> inline T* db_NewArray(size_t n,int subsystem)
+{
+    return((T*) db_Malloc(n*sizeof(T),subsystem));
+}
+/*!
+ * Get the bytes held now and at the peak.
+ */
+DB_API void db_GetMemoryStats(db_MemoryStats *stats);
+/*!
+ * Restart the peaks from the bytes held now, to measure the peak of a phase.
+ */
+DB_API void db_ResetMemoryPeaks();
+/*\}*/
+
 /*!
  * \defgroup LMImageBasicUtilities (LM) Basic Image Utility Functions
 
@@ -552,6 +626,42 @@ void inline db_Zero9(double x[9])
 DB_API void db_WarpImageLut_u(const unsigned char * const * src,unsigned char ** dst, int w, int h,
                                const float * const * lut_x, const float * const * lut_y, int type=DB_WARP_BILINEAR);
 
+#define DB_LUT_FRAC_BITS    7
+#define DB_LUT_FRAC_ONE     (1<<DB_LUT_FRAC_BITS)
+
+/*!
+ * Fixed point look-up table entry: the integer part of the source coordinates and
+ * their fractions in units of 1/DB_LUT_FRAC_ONE, in 6 bytes instead of the 8 of
+ * two float LUTs. x<0 marks a destination pixel outside the source image.
+ */
+class db_LutEntry_s
+{
+public:
+    short x,y;
+    unsigned char fx,fy;
+};
+
+/*!
+ * Allocate a w by h fixed point LUT, accessed as lut[y][x].
+ */
+DB_API db_LutEntry_s** db_AllocLutFixed(int w,int h);
+DB_API void db_FreeLutFixed(db_LutEntry_s **lut,int h);
+
+/*!
+ * Perform a bilinear look-up table warp with a fixed point LUT, such as one made by
+ * db_GenerateHomographyLutFixed(). Every entry that is not marked as outside must have
+ * its 2x2 neighbourhood inside the source image. The result is the same whether SSE2
+ * is used or not, and for any number of threads.
+ * \param src           source image
+ * \param dst           destination image
+ * \param w             destination width
+ * \param h             destination height
+ * \param lut           w by h fixed point LUT
+ * \param nr_threads    number of threads to warp bands of rows with
+ */
+DB_API void db_WarpImageLutFixed_u(const unsigned char * const * src,unsigned char ** dst, int w, int h,
+                               const db_LutEntry_s * const * lut, int nr_threads=1);
+
 DB_API void db_PrintDoubleVector(double *a,long size);
 DB_API void db_PrintDoubleMatrix(double *a,long rows,long cols);
 
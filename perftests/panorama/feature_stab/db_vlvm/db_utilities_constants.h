@@ -65,6 +65,12 @@
 #define DB_DEFAULT_REL_CORNER_THRESHOLD 0.00005
 #define DB_DEFAULT_MAX_DISPARITY 0.1
 #define DB_DEFAULT_NO_DISPARITY -1.0
+#define DB_DEFAULT_CASCADE_TOP_K 1
+#define DB_MAX_CASCADE_TOP_K 16
+#define DB_MAX_CASCADE_CANDIDATES 64
+#define DB_CASCADE_ROUNDING_ERROR 1024.0
+#define DB_MAX_MATCH_THREADS 8
+#define DB_MAX_WARP_THREADS 16
 #define DB_DEFAULT_MAX_TRACK_LENGTH 300
 
 #define DB_DEFAULT_MAX_NR_CAMERAS 1000
@@ -121,6 +127,31 @@
  * \def DB_DEFAULT_NO_DISPARITY
  * \ingroup FeatureMatching
  * \brief Indicates that vertical disparity is the same as horizontal disparity.
+*/
+ /*!
+ * \def DB_DEFAULT_CASCADE_TOP_K
+ * \ingroup FeatureMatching
+ * \brief Number of candidates per left corner that the cascade matcher scores with the
+ * full 11x11 correlation first, in decreasing order of their coarse bound. Any other
+ * candidate is only scored in full if its bound reaches the best score.
+*/
+ /*!
+ * \def DB_MAX_CASCADE_TOP_K
+ * \ingroup FeatureMatching
+ * \brief Upper limit on the cascade_top_k of the cascade matcher.
+*/
+ /*!
+ * \def DB_MAX_CASCADE_CANDIDATES
+ * \ingroup FeatureMatching
+ * \brief Left corners with more candidates than this are matched exhaustively by the
+ * cascade matcher.
+*/
+ /*!
+ * \def DB_CASCADE_ROUNDING_ERROR
+ * \ingroup FeatureMatching
+ * \brief Bound on the rounding error of the unnormalized 11x11 correlation. Scaled by
+ * the normalization of a pair, it is the margin the cascade matcher leaves between a
+ * coarse bound and a score before pruning the pair.
 */
 ///////////////////////////////////////////////////////////////////////////////////
  /*!
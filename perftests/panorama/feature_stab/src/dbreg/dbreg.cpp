@@ -33,6 +33,7 @@ db_FrameToReferenceRegistration::db_FrameToReferenceRegistration() :
 
   m_quarter_res_image = NULL;
   m_horz_smooth_subsample_image = NULL;
+  m_quarter_res_supplied = NULL;
 
   m_x_corners_ref = NULL;
   m_y_corners_ref = NULL;
@@ -58,6 +59,8 @@ db_FrameToReferenceRegistration::db_FrameToReferenceRegistration() :
 
   profile_string = NULL;
 
+  m_corners_ms = m_matching_ms = m_homography_ms = 0.0;
+
   db_Identity3x3(m_K);
   db_Identity3x3(m_H_ref_to_ins);
   db_Identity3x3(m_H_dref_to_ref);
@@ -94,34 +97,35 @@ void db_FrameToReferenceRegistration::Clean()
     db_FreeImage_u(m_horz_smooth_subsample_image, m_im_height*2);
   }
 
-  delete [] m_x_corners_ref;
-  delete [] m_y_corners_ref;
+  db_Free(m_x_corners_ref);
+  db_Free(m_y_corners_ref);
 
-  delete [] m_x_corners_ins;
-  delete [] m_y_corners_ins;
+  db_Free(m_x_corners_ins);
+  db_Free(m_y_corners_ins);
 
-  delete [] m_match_index_ref;
-  delete [] m_match_index_ins;
+  db_Free(m_match_index_ref);
+  db_Free(m_match_index_ins);
 
-  delete [] m_temp_double;
-  delete [] m_temp_int;
+  db_Free(m_temp_double);
+  db_Free(m_temp_int);
 
-  delete [] m_corners_ref;
-  delete [] m_corners_ins;
+  db_Free(m_corners_ref);
+  db_Free(m_corners_ins);
 
-  delete [] m_sq_cost;
-  delete [] m_cost_histogram;
+  db_Free(m_sq_cost);
+  db_Free(m_cost_histogram);
 
-  delete [] m_inlier_indices;
+  db_Free(m_inlier_indices);
 
   if(profile_string)
-    delete [] profile_string;
+    db_Free(profile_string);
 
   m_reference_image = NULL;
   m_aligned_ins_image = NULL;
 
   m_quarter_res_image = NULL;
   m_horz_smooth_subsample_image = NULL;
+  m_quarter_res_supplied = NULL;
 
   m_x_corners_ref = NULL;
   m_y_corners_ref = NULL;
@@ -159,7 +163,9 @@ void db_FrameToReferenceRegistration::Init(int width, int height,
                        double cm_max_disparity,
                            bool   cm_use_smaller_matching_window,
                        int    cd_nr_horz_blocks,
-                       int    cd_nr_vert_blocks
+                       int    cd_nr_vert_blocks,
+                       int    cm_cascade_top_k,
+                       int    cm_nr_threads
                        )
 {
   Clean();
@@ -174,7 +180,7 @@ void db_FrameToReferenceRegistration::Init(int width, int height,
 
   m_quarter_resolution = quarter_resolution;
 
-  profile_string = new char[10240];
+  profile_string = db_NewArray<char>(10240,DB_MEM_ALIGN);
 
   if (m_quarter_resolution == true)
   {
@@ -213,33 +219,33 @@ void db_FrameToReferenceRegistration::Init(int width, int height,
   m_max_nr_corners = m_cd.Init(m_im_width,m_im_height,cd_target_nr_corners,cd_nr_horz_blocks,cd_nr_vert_blocks,DB_DEFAULT_ABS_CORNER_THRESHOLD/500.0,0.0);
 
     int use_21 = 0;
-  m_max_nr_matches = m_cm.Init(m_im_width,m_im_height,cm_max_disparity,m_max_nr_corners,DB_DEFAULT_NO_DISPARITY,cm_use_smaller_matching_window,use_21);
+  m_max_nr_matches = m_cm.Init(m_im_width,m_im_height,cm_max_disparity,m_max_nr_corners,DB_DEFAULT_NO_DISPARITY,cm_use_smaller_matching_window,use_21,cm_cascade_top_k,cm_nr_threads);
 
   // allocate space for corner feature locations for reference and inspection images:
-  m_x_corners_ref = new double [m_max_nr_corners];
-  m_y_corners_ref = new double [m_max_nr_corners];
+  m_x_corners_ref = db_NewArray<double>(m_max_nr_corners,DB_MEM_ALIGN);
+  m_y_corners_ref = db_NewArray<double>(m_max_nr_corners,DB_MEM_ALIGN);
 
-  m_x_corners_ins = new double [m_max_nr_corners];
-  m_y_corners_ins = new double [m_max_nr_corners];
+  m_x_corners_ins = db_NewArray<double>(m_max_nr_corners,DB_MEM_ALIGN);
+  m_y_corners_ins = db_NewArray<double>(m_max_nr_corners,DB_MEM_ALIGN);
 
   // allocate space for match indices:
-  m_match_index_ref = new int [m_max_nr_matches];
-  m_match_index_ins = new int [m_max_nr_matches];
+  m_match_index_ref = db_NewArray<int>(m_max_nr_matches,DB_MEM_ALIGN);
+  m_match_index_ins = db_NewArray<int>(m_max_nr_matches,DB_MEM_ALIGN);
 
-  m_temp_double = new double [12*DB_DEFAULT_NR_SAMPLES+10*m_max_nr_matches];
-  m_temp_int = new int [db_maxi(DB_DEFAULT_NR_SAMPLES,m_max_nr_matches)];
+  m_temp_double = db_NewArray<double>(12*DB_DEFAULT_NR_SAMPLES+10*m_max_nr_matches,DB_MEM_ALIGN);
+  m_temp_int = db_NewArray<int>(db_maxi(DB_DEFAULT_NR_SAMPLES,m_max_nr_matches),DB_MEM_ALIGN);
 
   // allocate space for homogenous image points:
-  m_corners_ref = new double [3*m_max_nr_corners];
-  m_corners_ins = new double [3*m_max_nr_corners];
+  m_corners_ref = db_NewArray<double>(3*m_max_nr_corners,DB_MEM_ALIGN);
+  m_corners_ins = db_NewArray<double>(3*m_max_nr_corners,DB_MEM_ALIGN);
 
   // allocate cost array and histogram:
-  m_sq_cost = new double [m_max_nr_matches];
-  m_cost_histogram = new int [m_nr_bins];
+  m_sq_cost = db_NewArray<double>(m_max_nr_matches,DB_MEM_ALIGN);
+  m_cost_histogram = db_NewArray<int>(m_nr_bins,DB_MEM_ALIGN);
 
   // reserve array:
   //m_inlier_indices.reserve(m_max_nr_matches);
-  m_inlier_indices = new int[m_max_nr_matches];
+  m_inlier_indices = db_NewArray<int>(m_max_nr_matches,DB_MEM_ALIGN);
 
   m_initialized = true;
 
@@ -259,8 +265,16 @@ int db_FrameToReferenceRegistration::UpdateReference(const unsigned char * const
 
   if (m_quarter_resolution && subsample)
   {
-    GenerateQuarterResImage(im);
-    imptr = m_quarter_res_image;
+    if (m_quarter_res_supplied)
+    {
+      imptr = m_quarter_res_supplied;
+    }
+    else
+    {
+      GenerateQuarterResImage(im);
+      imptr = m_quarter_res_image;
+    }
+    m_quarter_res_supplied = NULL;
   }
 
   // save the reference image, detect features and quit
@@ -332,6 +346,15 @@ void db_FrameToReferenceRegistration::ResetDisplayReference()
   db_Identity3x3(m_H_dref_to_ref);
 }
 
+void db_FrameToReferenceRegistration::ResetAlignmentParams(int cd_target_nr_corners, double cm_max_disparity,
+                                                          int nr_samples, int chunk_size)
+{
+  m_cd.SetTargetNrCorners(cd_target_nr_corners);
+  m_cm.SetMaxDisparity(cm_max_disparity);
+  m_nr_samples = db_mini(db_maxi(nr_samples,1),DB_DEFAULT_NR_SAMPLES);
+  m_chunk_size = db_maxi(chunk_size,1);
+}
+
 bool db_FrameToReferenceRegistration::NeedReferenceUpdate()
 {
   // If less than 50% of the starting number of inliers left, then its time to update the reference.
@@ -357,12 +380,17 @@ int db_FrameToReferenceRegistration::AddFrame(const unsigned char * const * im,
 
   if (m_quarter_resolution)
   {
-    if (m_quarter_res_image)
+    if (m_quarter_res_supplied)
     {
-      GenerateQuarterResImage(im);
+      imptr = m_quarter_res_supplied;
     }
-
-    imptr = (const unsigned char * const* )m_quarter_res_image;
+    else
+    {
+      if (m_quarter_res_image)
+        GenerateQuarterResImage(im);
+      imptr = (const unsigned char * const* )m_quarter_res_image;
+    }
+    m_quarter_res_supplied = NULL;
   }
 
   double H_last[9];
@@ -382,11 +410,15 @@ int db_FrameToReferenceRegistration::AddFrame(const unsigned char * const * im,
   strcat(profile_string, str);
 #endif
 
+  double stage_start = now_ms();
   // @jke - Adding code to time the functions.  TODO: Remove after test
 #if PROFILE
   iTimer1 = now_ms();
 #endif
   m_cd.DetectCorners(imptr, m_x_corners_ins,m_y_corners_ins,&m_nr_corners_ins);
+  double stage_end = now_ms();
+  m_corners_ms = stage_end - stage_start;
+  stage_start = stage_end;
   // @jke - Adding code to time the functions.  TODO: Remove after test
 # if PROFILE
   iTimer2 = now_ms();
@@ -407,6 +439,8 @@ int db_FrameToReferenceRegistration::AddFrame(const unsigned char * const * im,
   m_cm.Match(m_reference_image,imptr,m_x_corners_ref,m_y_corners_ref,m_nr_corners_ref,
          m_x_corners_ins,m_y_corners_ins,m_nr_corners_ins,
          m_match_index_ref,m_match_index_ins,&m_nr_matches);
+  stage_end = now_ms();
+  m_matching_ms = stage_end - stage_start;
   // @jke - Adding code to time the functions.  TODO: Remove after test
 # if PROFILE
   iTimer2 = now_ms();
@@ -434,9 +468,11 @@ int db_FrameToReferenceRegistration::AddFrame(const unsigned char * const * im,
   iTimer1 = now_ms();
 #endif
   // perform the alignment:
+  stage_start = now_ms();
   db_RobImageHomography(m_H_ref_to_ins, m_corners_ref, m_corners_ins, m_nr_matches, m_K, m_K, m_temp_double, m_temp_int,
             m_homography_type,NULL,m_max_iterations,m_max_nr_matches,m_scale,
             m_nr_samples, m_chunk_size);
+  m_homography_ms = now_ms() - stage_start;
   // @jke - Adding code to time the functions.  TODO: Remove after test
 # if PROFILE
   iTimer2 = now_ms();
@@ -742,6 +778,12 @@ void db_FrameToReferenceRegistration::SmoothMotion(void)
     Set_H_dref_to_ins(H);
 }
 
+void db_FrameToReferenceRegistration::SetQuarterResImage(const unsigned char * const * im_quarter)
+{
+  if (m_quarter_res_image)
+    m_quarter_res_supplied = im_quarter;
+}
+
 void db_FrameToReferenceRegistration::GenerateQuarterResImage(const unsigned char* const* im)
 {
   int input_h = m_im_height*2;
@@ -36,9 +36,7 @@
 #include <db_feature_matching.h>
 #include <db_rob_image_homography.h>
 
-#if PROFILE
-    #include <sys/time.h>
-#endif
+#include <sys/time.h>
 
 /*! \mainpage db_FrameToReferenceRegistration
 
@@ -150,6 +148,8 @@ public:
      * \param cm_use_smaller_matching_window    if set to true, uses a correlation window of 5x5 instead of the default 11x11
      * \param cd_nr_horz_blocks     the number of horizontal blocks for the corner detector to partition the image
      * \param cd_nr_vert_blocks     the number of vertical blocks for the corner detector to partition the image
+     * \param cm_cascade_top_k      if larger than 0, the corner matcher bounds the score of each candidate on a 5x5 patch of block sums and computes the full correlation only where the bound can reach the best score, starting with the cm_cascade_top_k highest bounds per reference corner; the matches do not depend on it (see db_Matcher_u::Init())
+     * \param cm_nr_threads         number of threads for the corner matcher; the matches do not depend on it
     */
     void Init(int width, int height,
           int       homography_type = DB_HOMOGRAPHY_TYPE_DEFAULT,
@@ -166,7 +166,9 @@ public:
           double cm_max_disparity = 0.2,
           bool   cm_use_smaller_matching_window = false,
           int    cd_nr_horz_blocks = 5,
-          int    cd_nr_vert_blocks = 5);
+          int    cd_nr_vert_blocks = 5,
+          int    cm_cascade_top_k = 0,
+          int    cm_nr_threads = 1);
 
     /*!
      * Reset the transformation type that is being use to perform alignment. Use this to change the alignment type at run time.
@@ -180,6 +182,26 @@ public:
     */
     void ResetSmoothing(bool enable) { m_do_motion_smoothing = enable; }
 
+    /*!
+     * Change the feature and RANSAC parameters at run time, e.g. to keep the alignment within a time budget.
+     * The corner target and disparity are capped at their Init() values and nr_samples at DB_DEFAULT_NR_SAMPLES,
+     * since those sized the buffers.
+     * \param cd_target_nr_corners  target number of corners for corner detector
+     * \param cm_max_disparity      maximum disparity search range for corner matcher (in units of ratio of image width)
+     * \param nr_samples            number of random hypotheses for RANSAC
+     * \param chunk_size            number of correspondences scored per hypothesis before pruning
+    */
+    void ResetAlignmentParams(int cd_target_nr_corners, double cm_max_disparity, int nr_samples, int chunk_size);
+
+    /*!
+     * Returns the time in ms spent on corner detection, matching and homography estimation in the last AddFrame()
+     * that aligned an inspection image.
+    */
+    void GetStageTimes(double &corners_ms, double &matching_ms, double &homography_ms) const
+    {
+        corners_ms = m_corners_ms; matching_ms = m_matching_ms; homography_ms = m_homography_ms;
+    }
+
     /*!
      * Align an inspection image to an existing reference image, update the reference image if due and perform motion smoothing if enabled.
      * \param im                new inspection image
@@ -188,6 +210,14 @@ public:
      */
     int AddFrame(const unsigned char * const * im, double H[9], bool force_reference=false, bool prewarp=false);
 
+    /*!
+     * Supply the quarter resolution version of the next image passed to AddFrame() or UpdateReference(),
+     * so that it is not subsampled again internally. Only valid if Init() was called with quarter_resolution set.
+     * The image is not copied, so it must stay unchanged until that call returns.
+     * \param im_quarter  quarter resolution image, half the Init() width and height
+     */
+    void SetQuarterResImage(const unsigned char * const * im_quarter);
+
     /*!
      * Returns true if Init() was run.
      */
@@ -305,6 +335,11 @@ protected:
     int     m_chunk_size;
     double  m_outlier_t2;
 
+    // Stage timings of the last aligned frame, in ms:
+    double m_corners_ms;
+    double m_matching_ms;
+    double m_homography_ms;
+
     // Whether to fit a linear model to just the inliers at the end
     bool   m_linear_polish;
     double m_polish_C[36];
@@ -355,6 +390,9 @@ protected:
     // temporary storage for the quarter resolution image processing
     unsigned char** m_horz_smooth_subsample_image;
 
+    // quarter resolution image supplied by SetQuarterResImage() for the next frame, NULL if none
+    const unsigned char * const * m_quarter_res_supplied;
+
     // temporary space for homography computation:
     double * m_temp_double;
     int * m_temp_int;
@@ -432,7 +470,6 @@ private:
 inline void db_GenerateHomographyLut(float ** lut_x,float ** lut_y,int w,int h,const double H[9])
 {
     assert(lut_x && lut_y);
-    double x[3] = {0.0,0.0,1.0};
     double xb[3];
 
 /*
@@ -446,18 +483,82 @@ inline void db_GenerateHomographyLut(float ** lut_x,float ** lut_y,int w,int h,c
     xl[1] = db_SafeDivision(xl[1],xl[2]);
 */
 
-    for ( int i = 0; i < w; ++i )
-        for ( int j = 0; j < h; ++j )
+    // Walk the LUT rows in memory order, with the y terms of H*(i,j,1)
+    // computed once per row. Same summation order as db_Multiply3x3_3x1().
+    for ( int j = 0; j < h; ++j )
+    {
+        float *row_x = lut_x[j];
+        float *row_y = lut_y[j];
+        double xr = H[1]*j;
+        double yr = H[4]*j;
+        double zr = H[7]*j;
+
+        for ( int i = 0; i < w; ++i )
         {
-            x[0] = double(i);
-            x[1] = double(j);
-            db_Multiply3x3_3x1(xb, H, x);
-            xb[0] = db_SafeDivision(xb[0],xb[2]);
-            xb[1] = db_SafeDivision(xb[1],xb[2]);
-
-            lut_x[j][i] = float(xb[0]);
-            lut_y[j][i] = float(xb[1]);
+            xb[0] = H[0]*i + xr + H[2];
+            xb[1] = H[3]*i + yr + H[5];
+            xb[2] = H[6]*i + zr + H[8];
+            row_x[i] = float(db_SafeDivision(xb[0],xb[2]));
+            row_y[i] = float(db_SafeDivision(xb[1],xb[2]));
         }
+    }
+}
+
+/*!
+ Create a fixed point look-up table for db_WarpImageLutFixed_u(), equivalent to
+ db_GenerateHomographyLut() followed by bilinear sampling. Destination pixels whose
+ 2x2 source neighbourhood is not inside the src_w by src_h source image are marked
+ as outside and warp to 0.
+ \param lut    pre-allocated w by h table (see db_AllocLutFixed())
+ \param w      width
+ \param h      height
+ \param H      image homography from source to destination
+ \param src_w  source image width
+ \param src_h  source image height
+ */
+inline void db_GenerateHomographyLutFixed(db_LutEntry_s ** lut,int w,int h,const double H[9],int src_w,int src_h)
+{
+    assert(lut);
+    const bool affine = (H[6] == 0.0 && H[7] == 0.0);
+    const double max_x = src_w-2;
+    const double max_y = src_h-2;
+
+    for ( int j = 0; j < h; ++j )
+    {
+        db_LutEntry_s *row = lut[j];
+        double xr = H[1]*j + H[2];
+        double yr = H[4]*j + H[5];
+        double zr = H[7]*j + H[8];
+        double inv_z = (zr != 0.0) ? 1.0/zr : 1.0;
+
+        for ( int i = 0; i < w; ++i )
+        {
+            double xs = xr + H[0]*i;
+            double ys = yr + H[3]*i;
+            if ( !affine )
+            {
+                double zs = zr + H[6]*i;
+                inv_z = (zs != 0.0) ? 1.0/zs : 1.0;
+            }
+            xs *= inv_z;
+            ys *= inv_z;
+
+            // Keep the neighbourhood x+1,y+1 inside the source, which also keeps x,y in range of a short
+            if ( xs < 0.0 || ys < 0.0 || xs >= max_x || ys >= max_y )
+            {
+                row[i].x = -1;
+                row[i].y = 0;
+                row[i].fx = row[i].fy = 0;
+                continue;
+            }
+            int xf = int(xs*DB_LUT_FRAC_ONE + 0.5);
+            int yf = int(ys*DB_LUT_FRAC_ONE + 0.5);
+            row[i].x = (short)(xf >> DB_LUT_FRAC_BITS);
+            row[i].y = (short)(yf >> DB_LUT_FRAC_BITS);
+            row[i].fx = (unsigned char)(xf & (DB_LUT_FRAC_ONE-1));
+            row[i].fy = (unsigned char)(yf & (DB_LUT_FRAC_ONE-1));
+        }
+    }
 }
 
 /*!
@@ -483,8 +584,8 @@ inline void db_WarpImageLutFast_rgb(const unsigned char * const * src, unsigned
     assert(src && dst);
     int xd=0, yd=0;
 
-    for ( int i = 0; i < w; ++i )
-        for ( int j = 0; j < h; ++j )
+    for ( int j = 0; j < h; ++j )
+        for ( int i = 0; i < w; ++i )
         {
             xd = static_cast<unsigned int>(lut_x[j][i]);
             yd = static_cast<unsigned int>(lut_y[j][i]);
@@ -529,8 +630,8 @@ inline void db_WarpImageLutBilinear_rgb(const unsigned char * const * src, unsig
     assert(src && dst);
     double xd=0.0, yd=0.0;
 
-    for ( int i = 0; i < w; ++i )
-        for ( int j = 0; j < h; ++j )
+    for ( int j = 0; j < h; ++j )
+        for ( int i = 0; i < w; ++i )
         {
             xd = static_cast<double>(lut_x[j][i]);
             yd = static_cast<double>(lut_y[j][i]);
@@ -565,10 +666,9 @@ inline double SquaredInhomogenousHomographyError(double y[3],double H[9],double
 
 
 // functions related to profiling
-#if PROFILE
 
 /* return current time in milliseconds */
-static double
+static inline double
 now_ms(void)
 {
     //struct timespec res;
@@ -578,4 +678,3 @@ now_ms(void)
     return 1000.0*res.tv_sec + (double)res.tv_usec/1e3;
 }
 
-#endif
@@ -23,6 +23,9 @@
 
 #include <iostream>
 #include <iomanip>
+#include <vector>
+#include <math.h>
+#include <pthread.h>
 
 #if PROFILE
     #include <sys/time.h>
@@ -42,6 +45,11 @@ const bool DEFAULT_DO_MOTION_SMOOTHING = false;
 const double DEFAULT_MOTION_SMOOTHING_GAIN = 0.75;
 const bool DEFAULT_LINEAR_POLISH = false;
 const int DEFAULT_MAX_ITERATIONS = 10;
+const int DEFAULT_NR_SEGMENTS = 1;
+const int DEFAULT_SEGMENT_OVERLAP = 1;
+const double DEFAULT_VERIFY_TOLERANCE = 0.0;
+const int MAX_NR_SEGMENTS = 64;
+const int DEFAULT_FIXED_WARP_THREADS = 0;
 
 void usage(string name) {
 
@@ -54,6 +62,11 @@ void usage(string name) {
     "  -r <int>   : the period (in nr of frames) for reference frame updates (default = 5)",
     "  -s <0/1>   : motion smoothing (1 activates motion smoothing, 0 turns it off - default value = 1)",
     "  -g <double>: motion smoothing gain, only used if smoothing is on (default value =0.75)",
+    "  -p <int>   : register the list offline in this many parallel segments (default 1 = frame by frame)",
+    "  -o <int>   : minimum number of frames shared by consecutive segments (default 1)",
+    "  -v <double>: also register serially and fail if any frame corner moves by more than this many pixels",
+    "  -x <int>   : warp grayscale with the fixed point LUT on this many threads, check it against one thread",
+    "               and compare it with the float bilinear LUT warp (default 0 = float LUT only)",
     NULL
   };
 
@@ -77,9 +90,468 @@ void parse_cmd_line(stringstream& cmdline,
             bool& quarter_resolution,
             unsigned int& reference_update_period,
             bool& do_motion_smoothing,
-            double& motion_smoothing_gain
+            double& motion_smoothing_gain,
+            int& nr_segments,
+            int& segment_overlap,
+            double& verify_tolerance,
+            int& fixed_warp_threads
             );
 
+/*
+ * Registration parameters that every segment of register_segments() is initialized with.
+ */
+class RegParams
+{
+public:
+  int nr_corners;
+  double max_disparity;
+  int motion_model_type;
+  bool quarter_resolution;
+  unsigned int reference_update_period;
+  int nr_samples;
+  bool use_smaller_matching_window;
+  bool linear_polish;
+};
+
+/*
+ * Fixed point LUT warp (-x) of grayscale frames. Each frame is also warped on one thread, which must
+ * give the same image whatever the thread count and whether SSE2 is used, and with the float bilinear
+ * LUT, to time the two and count the pixels where they are more than 1 apart.
+ */
+class FixedWarpStats
+{
+public:
+  FixedWarpStats() : frames(0), fixed_ms(0.0), float_ms(0.0), thread_mismatches(0), off_by_more(0), max_diff(0) {}
+  void add(const FixedWarpStats& o)
+  {
+    frames += o.frames;
+    fixed_ms += o.fixed_ms;
+    float_ms += o.float_ms;
+    thread_mismatches += o.thread_mismatches;
+    off_by_more += o.off_by_more;
+    max_diff = db_maxi(max_diff,o.max_diff);
+  }
+  void print(int nr_threads) const;
+
+  int frames;
+  double fixed_ms;          // LUT generation and warp
+  double float_ms;
+  long thread_mismatches;   // pixels that differ from the single thread warp
+  long off_by_more;         // pixels inside the source that are more than 1 from the float warp
+  int max_diff;
+};
+
+void FixedWarpStats::print(int nr_threads) const
+{
+  int n = db_maxi(frames,1);
+  printf("Fixed point warp: %.2f ms/frame on %d threads, float bilinear %.2f ms/frame\n",
+         fixed_ms/n,nr_threads,float_ms/n);
+  printf("Fixed point warp: %ld pixels differ from one thread, %ld pixels more than 1 from float (max %d)\n",
+         thread_mismatches,off_by_more,max_diff);
+}
+
+void warp_fixed(PgmImage& gray, PgmImage& warped, const double H[9], int nr_threads, FixedWarpStats *stats)
+{
+  int w = gray.GetWidth();
+  int h = gray.GetHeight();
+  db_LutEntry_s **lut = db_AllocLutFixed(w,h);
+  float **lut_x = db_AllocImage_f(w,h);
+  float **lut_y = db_AllocImage_f(w,h);
+  PgmImage single(w,h);
+  PgmImage reference(w,h);
+  const unsigned char * const *src = gray.GetRowPointers();
+
+  double t = now_ms();
+  db_GenerateHomographyLutFixed(lut,w,h,H,w,h);
+  db_WarpImageLutFixed_u(src,warped.GetRowPointers(),w,h,lut,nr_threads);
+  stats->fixed_ms += now_ms()-t;
+
+  t = now_ms();
+  db_GenerateHomographyLut(lut_x,lut_y,w,h,H);
+  db_WarpImageLut_u(src,reference.GetRowPointers(),w,h,lut_x,lut_y,DB_WARP_BILINEAR);
+  stats->float_ms += now_ms()-t;
+
+  db_WarpImageLutFixed_u(src,single.GetRowPointers(),w,h,lut,1);
+
+  for (int j = 0; j < h; j++)
+  {
+    const unsigned char *a = warped.GetRowPointers()[j];
+    const unsigned char *b = single.GetRowPointers()[j];
+    const unsigned char *r = reference.GetRowPointers()[j];
+    for (int i = 0; i < w; i++)
+    {
+      if ( a[i] != b[i] )
+        stats->thread_mismatches++;
+      if ( lut[j][i].x < 0 )
+        continue;
+      int d = abs(a[i]-r[i]);
+      if ( d > 1 )
+        stats->off_by_more++;
+      stats->max_diff = db_maxi(stats->max_diff,d);
+    }
+  }
+  stats->frames++;
+
+  db_FreeImage_f(lut_x,h);
+  db_FreeImage_f(lut_y,h);
+  db_FreeLutFixed(lut,h);
+}
+
+class SegmentJob
+{
+public:
+  const RegParams *params;
+  const vector<string> *file_names;
+  // frames [first,last) of the list, and the frame this segment contributes from
+  int first;
+  int last;
+  int core;
+  // 9 doubles per frame: homography from the display reference of the segment to the frame
+  double *H;
+  int *nr_inliers;
+  int ok;
+  double ms;
+  // threads for the fixed point LUT warp, 0 for the float LUT, and what it measured
+  int fixed_warp_threads;
+  FixedWarpStats fixed;
+};
+
+/*
+ * Register frames [first,last) of the list against a display reference at frame first.
+ */
+bool register_range(const RegParams& p, const vector<string>& file_names, int first, int last, double *H, int *nr_inliers)
+{
+  db_FrameToReferenceRegistration reg;
+
+  for (int k = first; k < last; k++)
+  {
+    PgmImage ref(file_names[k]);
+
+    if ( ref.GetDataPointer() == NULL )
+    {
+      cerr << "Could not open image" << file_names[k] << "." << endl;
+      return false;
+    }
+    ref.ConvertToGray();
+
+    if ( !reg.Initialized() )
+    {
+      reg.Init(ref.GetWidth(),ref.GetHeight(),p.motion_model_type,DEFAULT_MAX_ITERATIONS,p.linear_polish,p.quarter_resolution,DB_POINT_STANDARDDEV,p.reference_update_period,false,0.0,p.nr_samples,DB_DEFAULT_CHUNK_SIZE,p.nr_corners,p.max_disparity,p.use_smaller_matching_window);
+    }
+
+    double H_ins[9];
+    reg.AddFrame(ref.GetRowPointers(),H_ins,false,false);
+    reg.Get_H_dref_to_ins(H+9*(k-first));
+    nr_inliers[k-first] = reg.GetNrInliers();
+  }
+  return true;
+}
+
+void *register_segment(void *arg)
+{
+  SegmentJob *job = (SegmentJob *) arg;
+  double t = now_ms();
+  job->ok = register_range(*job->params,*job->file_names,job->first,job->last,job->H,job->nr_inliers);
+  job->ms = now_ms()-t;
+  return NULL;
+}
+
+/*
+ * Largest distance, in pixels, between the image corners mapped by H1 and by H2.
+ */
+double corner_deviation(const double H1[9], const double H2[9], int w, int h)
+{
+  const double cx[4] = {0.0, w-1.0, 0.0, w-1.0};
+  const double cy[4] = {0.0, 0.0, h-1.0, h-1.0};
+  double d = 0.0;
+
+  for (int i = 0; i < 4; i++)
+  {
+    double z1 = H1[6]*cx[i]+H1[7]*cy[i]+H1[8];
+    double z2 = H2[6]*cx[i]+H2[7]*cy[i]+H2[8];
+    double dx = (H1[0]*cx[i]+H1[1]*cy[i]+H1[2])/z1-(H2[0]*cx[i]+H2[1]*cy[i]+H2[2])/z2;
+    double dy = (H1[3]*cx[i]+H1[4]*cy[i]+H1[5])/z1-(H2[3]*cx[i]+H2[4]*cy[i]+H2[5])/z2;
+    d = db_maxd(d,sqrt(dx*dx+dy*dy));
+  }
+  return d;
+}
+
+void smooth_trajectory(double *H, int nr_frames, double gain)
+{
+  db_StabilizationSmoother smoother;
+  smoother.setSmoothingFactor(gain);
+
+  for (int k = 1; k < nr_frames; k++)
+  {
+    double *Hk = H+9*k;
+    VP_MOTION inmot,outmot;
+
+    MXX(inmot) = Hk[0]; MXY(inmot) = Hk[1]; MXZ(inmot) = Hk[2]; MXW(inmot) = 0.0;
+    MYX(inmot) = Hk[3]; MYY(inmot) = Hk[4]; MYZ(inmot) = Hk[5]; MYW(inmot) = 0.0;
+    MZX(inmot) = Hk[6]; MZY(inmot) = Hk[7]; MZZ(inmot) = Hk[8]; MZW(inmot) = 0.0;
+    MWX(inmot) = 0.0;   MWY(inmot) = 0.0;   MWZ(inmot) = 0.0;   MWW(inmot) = 1.0;
+    inmot.type = VP_MOTION_AFFINE;
+
+    smoother.smoothMotion(&inmot,&outmot);
+
+    Hk[0] = MXX(outmot); Hk[1] = MXY(outmot); Hk[2] = MXZ(outmot);
+    Hk[3] = MYX(outmot); Hk[4] = MYY(outmot); Hk[5] = MYZ(outmot);
+    Hk[6] = MZX(outmot); Hk[7] = MZY(outmot); Hk[8] = MZZ(outmot);
+  }
+}
+
+bool warp_range(const vector<string>& file_names, int first, int last, const double *H,
+                int fixed_warp_threads, FixedWarpStats *fixed)
+{
+  float ** lut_x = NULL, **lut_y = NULL;
+  int w = 0, h = 0;
+  bool ok = true;
+
+  for (int k = first; k < last && ok; k++)
+  {
+    PgmImage image(file_names[k]);
+
+    if ( image.GetDataPointer() == NULL )
+    {
+      cerr << "Could not open image" << file_names[k] << "." << endl;
+      ok = false;
+      break;
+    }
+
+    if ( lut_x == NULL )
+    {
+      w = image.GetWidth();
+      h = image.GetHeight();
+      lut_x = db_AllocImage_f(w,h);
+      lut_y = db_AllocImage_f(w,h);
+    }
+
+    if ( fixed_warp_threads > 0 )
+    {
+      image.ConvertToGray();
+      PgmImage warped(w,h);
+      warp_fixed(image,warped,H+9*k,fixed_warp_threads,fixed);
+      ok = warped.WritePGM("aligned_" + file_names[k]);
+      continue;
+    }
+
+    db_GenerateHomographyLut(lut_x,lut_y,w,h,H+9*k);
+
+    PgmImage warped(w,h,image.GetFormat());
+
+    if ( image.GetFormat() == PgmImage::PGM_BINARY_PIXMAP )
+      db_WarpImageLutBilinear_rgb(image.GetRowPointers(),warped.GetRowPointers(),w,h,lut_x,lut_y);
+    else
+      db_WarpImageLut_u(image.GetRowPointers(),warped.GetRowPointers(),w,h,lut_x,lut_y,DB_WARP_FAST);
+
+    ok = warped.WritePGM("aligned_" + file_names[k]);
+  }
+
+  if ( lut_x != NULL )
+  {
+    db_FreeImage_f(lut_x,h);
+    db_FreeImage_f(lut_y,h);
+  }
+  return ok;
+}
+
+void *warp_segment(void *arg)
+{
+  SegmentJob *job = (SegmentJob *) arg;
+  job->ok = warp_range(*job->file_names,job->core,job->last,job->H,job->fixed_warp_threads,&job->fixed);
+  return NULL;
+}
+
+/*
+ * Run jobs[1..nr_jobs-1] on their own threads and jobs[0] on the calling thread. A job whose thread
+ * fails to start runs on the calling thread too.
+ */
+void run_segment_jobs(SegmentJob *jobs, int nr_jobs, void *(*func)(void *))
+{
+  pthread_t threads[MAX_NR_SEGMENTS];
+  bool started[MAX_NR_SEGMENTS];
+
+  for (int s = 1; s < nr_jobs; s++)
+  {
+    started[s] = pthread_create(&threads[s],NULL,func,&jobs[s]) == 0;
+  }
+
+  func(&jobs[0]);
+
+  for (int s = 1; s < nr_jobs; s++)
+  {
+    if ( started[s] )
+      pthread_join(threads[s],NULL);
+    else
+      func(&jobs[s]);
+  }
+}
+
+/*
+ * Offline registration of a recorded sequence in overlapping segments. Each segment runs its own
+ * db_FrameToReferenceRegistration on its own thread, starting from a fresh reference at its first frame.
+ * The segment motions are chained into one trajectory through the frames that consecutive segments
+ * share, and the trajectory is smoothed afterwards.
+ */
+int register_segments(const RegParams& p, const vector<string>& file_names, int nr_segments, int overlap,
+                      bool do_motion_smoothing, double motion_smoothing_gain, double verify_tolerance,
+                      int fixed_warp_threads)
+{
+  int nr_frames = file_names.size();
+
+  PgmImage first(file_names[0]);
+  if ( first.GetDataPointer() == NULL )
+  {
+    cerr << "Could not open image" << file_names[0] << ". Exiting." << endl;
+    return -1;
+  }
+  int w = first.GetWidth();
+  int h = first.GetHeight();
+
+  // A segment starts on a frame the serial run also takes as its reference, i.e. a multiple of the
+  // reference update period, so that it sees the same reference frames as the serial run from there on.
+  int period = db_maxi(p.reference_update_period,1);
+  overlap = db_maxi(overlap,1);
+  nr_segments = db_mini(db_mini(db_maxi(nr_segments,1),MAX_NR_SEGMENTS),db_maxi(nr_frames/(overlap+period),1));
+
+  SegmentJob jobs[MAX_NR_SEGMENTS];
+  int nr_registered = 0;
+
+  for (int s = 0; s < nr_segments; s++)
+  {
+    jobs[s].params = &p;
+    jobs[s].file_names = &file_names;
+    jobs[s].core = (int)(((long long)nr_frames*s)/nr_segments);
+    jobs[s].first = s == 0 ? 0 : db_maxi((jobs[s].core-overlap)/period,0)*period;
+    jobs[s].last = (int)(((long long)nr_frames*(s+1))/nr_segments);
+    jobs[s].fixed_warp_threads = fixed_warp_threads;
+    nr_registered += jobs[s].last-jobs[s].first;
+  }
+
+  vector<double> local(9*nr_registered);
+  vector<int> nr_inliers(db_maxi(nr_registered,nr_frames));
+  int offset = 0;
+
+  for (int s = 0; s < nr_segments; s++)
+  {
+    jobs[s].H = &local[9*offset];
+    jobs[s].nr_inliers = &nr_inliers[offset];
+    offset += jobs[s].last-jobs[s].first;
+  }
+
+  double t = now_ms();
+  run_segment_jobs(jobs,nr_segments,register_segment);
+  double registration_ms = now_ms()-t;
+
+  // chain the segments: frame k of segment s is G(first) * H_first_to_k, where G(first) comes from an earlier segment
+  vector<double> global(9*nr_frames);
+  double max_seam = 0.0;
+
+  for (int s = 0; s < nr_segments; s++)
+  {
+    if ( !jobs[s].ok )
+    {
+      cerr << "Segment " << s << " failed. Exiting." << endl;
+      return -1;
+    }
+
+    double G_first[9];
+    if ( s == 0 )
+      db_Identity3x3(G_first);
+    else
+      db_Copy9(G_first,&global[9*jobs[s].first]);
+
+    for (int k = jobs[s].first; k < jobs[s].last; k++)
+    {
+      double G[9];
+      db_Multiply3x3_3x3(G,G_first,jobs[s].H+9*(k-jobs[s].first));
+
+      // the shared frames were already placed by the previous segment; measure how well the two agree
+      if ( k < jobs[s].core )
+        max_seam = db_maxd(max_seam,corner_deviation(G,&global[9*k],w,h));
+      else
+        db_Copy9(&global[9*k],G);
+    }
+
+    int min_inliers = jobs[s].last-jobs[s].first > 1 ? jobs[s].nr_inliers[1] : 0;
+    for (int k = 2; k < jobs[s].last-jobs[s].first; k++)
+      min_inliers = db_mini(min_inliers,jobs[s].nr_inliers[k]);
+
+    printf("Segment %d: frames %d-%d, %.1f ms, min #Inliers = %d\n",s,jobs[s].first,jobs[s].last-1,jobs[s].ms,min_inliers);
+  }
+
+  printf("Registered %d frames in %d segments in %.1f ms (%.1f frames/s), max seam deviation %.2f pixels\n",
+         nr_frames,nr_segments,registration_ms,nr_frames*1000.0/registration_ms,max_seam);
+
+  int ret = 0;
+
+  if ( verify_tolerance > 0.0 )
+  {
+    vector<double> serial(9*nr_frames);
+
+    t = now_ms();
+    if ( !register_range(p,file_names,0,nr_frames,&serial[0],&nr_inliers[0]) )
+      return -1;
+    double serial_ms = now_ms()-t;
+
+    double max_deviation = 0.0;
+    int worst = 0;
+    for (int k = 0; k < nr_frames; k++)
+    {
+      double d = corner_deviation(&global[9*k],&serial[9*k],w,h);
+      if ( d > max_deviation )
+      {
+        max_deviation = d;
+        worst = k;
+      }
+    }
+
+    printf("Serial registration %.1f ms, speedup %.2fx, max deviation %.2f pixels at frame %d\n",
+           serial_ms,serial_ms/registration_ms,max_deviation,worst);
+
+    if ( max_deviation > verify_tolerance )
+    {
+      printf("FAIL: deviation from the serial run above %.2f pixels\n",verify_tolerance);
+      ret = 2;
+    }
+  }
+
+  if ( do_motion_smoothing )
+    smooth_trajectory(&global[0],nr_frames,motion_smoothing_gain);
+
+  for (int s = 0; s < nr_segments; s++)
+    jobs[s].H = &global[0];
+
+  t = now_ms();
+  run_segment_jobs(jobs,nr_segments,warp_segment);
+  double warp_ms = now_ms()-t;
+
+  FixedWarpStats fixed;
+  for (int s = 0; s < nr_segments; s++)
+  {
+    if ( !jobs[s].ok )
+    {
+      cerr << "Could not write the aligned frames of segment " << s << "." << endl;
+      return -1;
+    }
+    fixed.add(jobs[s].fixed);
+  }
+
+  printf("Warped and wrote %d frames in %d segments in %.1f ms\n",nr_frames,nr_segments,warp_ms);
+
+  if ( fixed_warp_threads > 0 )
+  {
+    fixed.print(fixed_warp_threads);
+    if ( fixed.thread_mismatches > 0 )
+    {
+      printf("FAIL: the fixed point warp depends on the thread count\n");
+      ret = 2;
+    }
+  }
+
+  return ret;
+}
+
 int main(int argc, char* argv[])
 {
   int    nr_corners = DEFAULT_NR_CORNERS;
@@ -100,6 +572,11 @@ int main(int argc, char* argv[])
 
   bool   linear_polish = DEFAULT_LINEAR_POLISH;
 
+  int    nr_segments = DEFAULT_NR_SEGMENTS;
+  int    segment_overlap = DEFAULT_SEGMENT_OVERLAP;
+  double verify_tolerance = DEFAULT_VERIFY_TOLERANCE;
+  int    fixed_warp_threads = DEFAULT_FIXED_WARP_THREADS;
+
   if (argc < 2) {
     usage(argv[0]);
     exit(1);
@@ -119,7 +596,7 @@ int main(int argc, char* argv[])
     cmdline << argv[c] << " ";
   }
 
-  parse_cmd_line(cmdline, argc, progname, image_list_file_name, nr_corners, max_disparity, motion_model_type,quarter_resolution,reference_update_period,do_motion_smoothing,motion_smoothing_gain);
+  parse_cmd_line(cmdline, argc, progname, image_list_file_name, nr_corners, max_disparity, motion_model_type,quarter_resolution,reference_update_period,do_motion_smoothing,motion_smoothing_gain,nr_segments,segment_overlap,verify_tolerance,fixed_warp_threads);
 
   ifstream in(image_list_file_name.c_str(),ios::in);
 
@@ -130,6 +607,36 @@ int main(int argc, char* argv[])
     return false;
   }
 
+  if ( nr_segments > 1 || verify_tolerance > 0.0 )
+  {
+    vector<string> file_names;
+    string line;
+
+    while ( getline(in,line) )
+    {
+      if ( !line.empty() )
+        file_names.push_back(line);
+    }
+
+    if ( file_names.empty() )
+    {
+      cerr << "No images in " << image_list_file_name << ".  Exiting" << endl;
+      return -1;
+    }
+
+    RegParams p;
+    p.nr_corners = nr_corners;
+    p.max_disparity = max_disparity;
+    p.motion_model_type = motion_model_type;
+    p.quarter_resolution = quarter_resolution;
+    p.reference_update_period = reference_update_period;
+    p.nr_samples = default_nr_samples;
+    p.use_smaller_matching_window = use_smaller_matching_window;
+    p.linear_polish = linear_polish;
+
+    return register_segments(p,file_names,nr_segments,segment_overlap,do_motion_smoothing,motion_smoothing_gain,verify_tolerance,fixed_warp_threads);
+  }
+
   // feature-based image registration class:
   db_FrameToReferenceRegistration reg;
 //  db_StabilizationSmoother stab_smoother;
@@ -148,9 +655,13 @@ int main(int argc, char* argv[])
 
   int frame_number = 0;
 
-  while ( !in.eof() )
+  FixedWarpStats fixed;
+
+  while ( getline(in,file_name) )
   {
-    getline(in,file_name);
+    // skip blank lines, e.g. after the last file name, like the segment list does
+    if ( file_name.empty() )
+      continue;
 
     PgmImage ref(file_name);
 
@@ -223,19 +734,24 @@ int main(int argc, char* argv[])
 
     reg.Get_H_dref_to_ins(H);
 
-    db_GenerateHomographyLut(lut_x,lut_y,w,h,H);
-
     // create a new image and warp:
-    PgmImage warped(w,h,format);
+    PgmImage warped(w,h,fixed_warp_threads > 0 ? (int)PgmImage::PGM_BINARY_GRAYMAP : format);
 
 #if PROFILE
     gettimeofday(&ts3, NULL);
 #endif
 
-    if ( color )
-      db_WarpImageLutBilinear_rgb(color_ref.GetRowPointers(),warped.GetRowPointers(),w,h,lut_x,lut_y);
+    if ( fixed_warp_threads > 0 )
+      warp_fixed(ref,warped,H,fixed_warp_threads,&fixed);
     else
-      db_WarpImageLut_u(ref.GetRowPointers(),warped.GetRowPointers(),w,h,lut_x,lut_y,DB_WARP_FAST);
+    {
+      db_GenerateHomographyLut(lut_x,lut_y,w,h,H);
+
+      if ( color )
+        db_WarpImageLutBilinear_rgb(color_ref.GetRowPointers(),warped.GetRowPointers(),w,h,lut_x,lut_y);
+      else
+        db_WarpImageLut_u(ref.GetRowPointers(),warped.GetRowPointers(),w,h,lut_x,lut_y,DB_WARP_FAST);
+    }
 
 #if PROFILE
     gettimeofday(&ts4, NULL);
@@ -298,6 +814,16 @@ int main(int argc, char* argv[])
     db_FreeImage_f(lut_y,h);
   }
 
+  if ( fixed_warp_threads > 0 )
+  {
+    fixed.print(fixed_warp_threads);
+    if ( fixed.thread_mismatches > 0 )
+    {
+      printf("FAIL: the fixed point warp depends on the thread count\n");
+      return 2;
+    }
+  }
+
   return 0;
 }
 
@@ -311,7 +837,11 @@ void parse_cmd_line(stringstream& cmdline,
             bool& quarter_resolution,
             unsigned int& reference_update_period,
             bool& do_motion_smoothing,
-            double& motion_smoothing_gain)
+            double& motion_smoothing_gain,
+            int& nr_segments,
+            int& segment_overlap,
+            double& verify_tolerance,
+            int& fixed_warp_threads)
 {
   // for counting down the parsed arguments.
   int c = argc;
@@ -366,6 +896,18 @@ void parse_cmd_line(stringstream& cmdline,
     break;
       case 'g':
     --c; cmdline >> motion_smoothing_gain;
+    break;
+      case 'p':
+    --c; cmdline >> nr_segments;
+    break;
+      case 'o':
+    --c; cmdline >> segment_overlap;
+    break;
+      case 'v':
+    --c; cmdline >> verify_tolerance;
+    break;
+      case 'x':
+    --c; cmdline >> fixed_warp_threads;
     break;
       default:
     cerr << progname << "illegal option " << token << endl;
@@ -0,0 +1,430 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Replays the benchmark frames at a camera frame rate. A producer thread
+// delivers a frame every 1/fps seconds into a bounded queue, dropping it if
+// the queue is full, while the main thread adds the queued frames to the
+// mosaic. Reports the capture-to-aligned latency distribution, the time
+// spent in Mosaic::addFrame, the queue depth and the dropped frames, and
+// then the time createMosaic takes after the last frame. The corner
+// matching time and inlier count of every aligned frame are reported next
+// to each other, so matcher settings (-c) can be compared on both. With
+// a preview file (-v), the mosaic is created with createMosaicProgressive
+// instead, and the times until the preview and the final mosaic arrive
+// are reported.
+
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mosaic/Mosaic.h"
+#include "mosaic/ImageUtils.h"
+
+#define MAX_FRAMES 200
+#define MAX_QUEUE_SIZE 64
+
+#define DEFAULT_FPS 30.0
+#define DEFAULT_QUEUE_SIZE 2
+#define DEFAULT_PREVIEW_SCALE_LOG2 2
+
+// Synthetic pan: a random block texture moved horizontally every frame
+#define SYNTHETIC_WIDTH 640
+#define SYNTHETIC_HEIGHT 360
+#define SYNTHETIC_FRAMES 60
+#define SYNTHETIC_PAN 12
+#define SYNTHETIC_BLOCK 8
+
+const int blendingType = Blend::BLEND_TYPE_HORZ;
+const int stripType = Blend::STRIP_TYPE_WIDE;
+
+ImageType yvuFrames[MAX_FRAMES];
+
+int loadImages(const char* basename, int &width, int &height)
+{
+    char filename[512];
+    struct stat filestat;
+    int i;
+
+    for (i = 0; i < MAX_FRAMES; i++) {
+        sprintf(filename, "%s_%03d.ppm", basename, i + 1);
+        if (stat(filename, &filestat) != 0) break;
+        ImageType rgbFrame = ImageUtils::readBinaryPPM(filename, width, height);
+        yvuFrames[i] = ImageUtils::allocateImage(width, height,
+                                ImageUtils::IMAGE_TYPE_NUM_CHANNELS);
+        ImageUtils::rgb2yvu(yvuFrames[i], rgbFrame, width, height);
+        ImageUtils::freeImage(rgbFrame);
+    }
+    return i;
+}
+
+int makeSyntheticPan(int frames, int &width, int &height)
+{
+    width = SYNTHETIC_WIDTH;
+    height = SYNTHETIC_HEIGHT;
+
+    int sceneBlocks = (width + frames * SYNTHETIC_PAN) / SYNTHETIC_BLOCK + 1;
+    int rowBlocks = height / SYNTHETIC_BLOCK + 1;
+    unsigned char *scene = new unsigned char[sceneBlocks * rowBlocks];
+
+    // Fixed LCG seed so that every run sees the same scene
+    unsigned int seed = 12345;
+    for (int i = 0; i < sceneBlocks * rowBlocks; i++) {
+        seed = seed * 1103515245 + 12345;
+        scene[i] = (unsigned char) (32 + ((seed >> 16) % 192));
+    }
+
+    for (int f = 0; f < frames; f++) {
+        yvuFrames[f] = ImageUtils::allocateImage(width, height,
+                                ImageUtils::IMAGE_TYPE_NUM_CHANNELS);
+        ImageType y = yvuFrames[f];
+        for (int j = 0; j < height; j++) {
+            unsigned char *sceneRow = scene + (j / SYNTHETIC_BLOCK) * sceneBlocks;
+            for (int i = 0; i < width; i++) {
+                *y++ = sceneRow[(i + f * SYNTHETIC_PAN) / SYNTHETIC_BLOCK];
+            }
+        }
+        memset(y, 128, 2 * width * height);
+    }
+
+    delete[] scene;
+    return frames;
+}
+
+double nowMs()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+// Bounded queue of frame indices and their capture times
+class FrameQueue {
+public:
+    int index[MAX_QUEUE_SIZE];
+    double captureMs[MAX_QUEUE_SIZE];
+    int head, count, size;
+    bool done;
+
+    int delivered, dropped, maxDepth;
+    double depthSum;
+
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+};
+
+struct Producer {
+    FrameQueue *queue;
+    int frames;
+    double periodMs;
+};
+
+void *produceFrames(void *arg)
+{
+    Producer *p = (Producer *) arg;
+    FrameQueue *q = p->queue;
+    struct timespec start, due;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < p->frames; i++) {
+        long long ns = start.tv_nsec + (long long) (i * p->periodMs * 1e6);
+        due.tv_sec = start.tv_sec + ns / 1000000000;
+        due.tv_nsec = ns % 1000000000;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR)
+            ;
+
+        pthread_mutex_lock(&q->lock);
+        q->delivered++;
+        if (q->count == q->size) {
+            // The camera does not wait for us
+            q->dropped++;
+        } else {
+            int slot = (q->head + q->count) % q->size;
+            q->index[slot] = i;
+            q->captureMs[slot] = nowMs();
+            q->count++;
+            pthread_cond_signal(&q->ready);
+        }
+        q->depthSum += q->count;
+        if (q->count > q->maxDepth) q->maxDepth = q->count;
+        pthread_mutex_unlock(&q->lock);
+    }
+
+    pthread_mutex_lock(&q->lock);
+    q->done = true;
+    pthread_cond_signal(&q->ready);
+    pthread_mutex_unlock(&q->lock);
+    return NULL;
+}
+
+int compareDouble(const void *a, const void *b)
+{
+    double d = *(const double *) a - *(const double *) b;
+    return (d > 0) - (d < 0);
+}
+
+double percentile(const double *sorted, int n, int p)
+{
+    if (n == 0) return 0.0;
+    int k = (n * p + 99) / 100 - 1;
+    return sorted[k < 0 ? 0 : (k >= n ? n - 1 : k)];
+}
+
+void printDistribution(const char *name, double *values, int n)
+{
+    qsort(values, n, sizeof(double), compareDouble);
+    printf("%s ms: p50 %.2f  p90 %.2f  p99 %.2f  max %.2f\n", name,
+           percentile(values, n, 50), percentile(values, n, 90),
+           percentile(values, n, 99), n ? values[n - 1] : 0.0);
+}
+
+// Times the deliveries of Mosaic::createMosaicProgressive
+struct Progressive {
+    const char *previewFile;
+    double startMs;
+    double previewMs, finalMs;
+    double writeMs;          // spent writing the preview, not by the mosaic
+    int previewWidth, previewHeight;
+    int calls;
+    bool ordered;            // the preview came first, then the final mosaic
+};
+
+void mosaicReady(ImageType imageYVU, int width, int height, bool final, void *cookie)
+{
+    Progressive *p = (Progressive *) cookie;
+    double ms = nowMs() - p->startMs - p->writeMs;
+
+    if (final != (p->calls == 1)) p->ordered = false;
+    p->calls++;
+
+    if (final) {
+        p->finalMs = ms;
+        return;
+    }
+
+    p->previewMs = ms;
+    p->previewWidth = width;
+    p->previewHeight = height;
+
+    double writeStart = nowMs();
+    ImageType imageRGB = ImageUtils::allocateImage(width, height,
+                                ImageUtils::IMAGE_TYPE_NUM_CHANNELS);
+    ImageUtils::yvu2rgb(imageRGB, imageYVU, width, height);
+    ImageUtils::writeBinaryPPM(imageRGB, p->previewFile, width, height);
+    ImageUtils::freeImage(imageRGB);
+    p->writeMs += nowMs() - writeStart;
+}
+
+void usage(const char *name)
+{
+    printf("Usage: %s [options] input_prefix|synthetic\n"
+           "  -f fps         capture frame rate (default %.0f)\n"
+           "  -q size        frames the capture queue holds (default %d)\n"
+           "  -s pixels      thresh_still passed to Mosaic::initialize (default 0)\n"
+           "  -r             align at quarter resolution\n"
+           "  -b ms          alignment time budget per frame (default none)\n"
+           "  -n frames      number of synthetic frames (default %d)\n"
+           "  -p             build the frame pyramids in the background during capture\n"
+           "  -c             match corners with the coarse-to-fine cascade\n"
+           "  -v file.ppm    create the mosaic progressively and write the 1/%d preview\n"
+           "  -l ms          fail if the p99 latency exceeds this\n",
+           name, DEFAULT_FPS, DEFAULT_QUEUE_SIZE, SYNTHETIC_FRAMES,
+           1 << DEFAULT_PREVIEW_SCALE_LOG2);
+}
+
+int main(int argc, char **argv)
+{
+    double fps = DEFAULT_FPS;
+    int queueSize = DEFAULT_QUEUE_SIZE;
+    float threshStill = 0.0f;
+    bool quarterRes = false;
+    double alignBudget = 0.0;
+    int syntheticFrames = SYNTHETIC_FRAMES;
+    double latencySlo = 0.0;
+    bool capturePyramids = false;
+    bool matchCascade = false;
+    const char *previewFile = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:q:s:rb:n:pcv:l:")) != -1) {
+        switch (opt) {
+            case 'f': fps = atof(optarg); break;
+            case 'q': queueSize = atoi(optarg); break;
+            case 's': threshStill = atof(optarg); break;
+            case 'r': quarterRes = true; break;
+            case 'b': alignBudget = atof(optarg); break;
+            case 'n': syntheticFrames = atoi(optarg); break;
+            case 'p': capturePyramids = true; break;
+            case 'c': matchCascade = true; break;
+            case 'v': previewFile = optarg; break;
+            case 'l': latencySlo = atof(optarg); break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (optind != argc - 1 || fps <= 0.0 || queueSize < 1 || queueSize > MAX_QUEUE_SIZE ||
+            syntheticFrames < 1 || syntheticFrames > MAX_FRAMES) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    int width, height;
+    int totalFrames;
+    if (strcmp(argv[optind], "synthetic") == 0) {
+        totalFrames = makeSyntheticPan(syntheticFrames, width, height);
+    } else {
+        totalFrames = loadImages(argv[optind], width, height);
+    }
+
+    if (totalFrames == 0) {
+        printf("Image files not found. Make sure %s_001.ppm exists.\n", argv[optind]);
+        return 1;
+    }
+
+    printf("%d frames loaded, replaying at %.1f fps with a queue of %d\n",
+           totalFrames, fps, queueSize);
+
+    Mosaic mosaic;
+    mosaic.initialize(blendingType, stripType, width, height, -1, quarterRes, threshStill,
+                      Blend::QUALITY_FINAL, capturePyramids);
+    if (alignBudget > 0.0) {
+        mosaic.getAligner()->setTimeBudget(alignBudget);
+    }
+    if (matchCascade) {
+        mosaic.getAligner()->setMatchCascade(Align::DEFAULT_CASCADE_TOP_K);
+    }
+
+    FrameQueue queue;
+    memset(&queue, 0, sizeof(queue));
+    queue.size = queueSize;
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.ready, NULL);
+
+    Producer producer;
+    producer.queue = &queue;
+    producer.frames = totalFrames;
+    producer.periodMs = 1000.0 / fps;
+
+    double latency[MAX_FRAMES];
+    double service[MAX_FRAMES];
+    double match[MAX_FRAMES];
+    int matched = 0;
+    long inliers = 0;
+    int processed = 0;
+    int late = 0;
+    int returns[4] = { 0, 0, 0, 0 }; // ok, few inliers, low texture, rejected
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, produceFrames, &producer) != 0) {
+        printf("Could not start the capture thread\n");
+        return 1;
+    }
+
+    while (true) {
+        pthread_mutex_lock(&queue.lock);
+        while (queue.count == 0 && !queue.done)
+            pthread_cond_wait(&queue.ready, &queue.lock);
+        if (queue.count == 0) {
+            pthread_mutex_unlock(&queue.lock);
+            break;
+        }
+        int i = queue.index[queue.head];
+        double captured = queue.captureMs[queue.head];
+        queue.head = (queue.head + 1) % queue.size;
+        queue.count--;
+        pthread_mutex_unlock(&queue.lock);
+
+        double start = nowMs();
+        int ret = mosaic.addFrame(yvuFrames[i]);
+        double end = nowMs();
+
+        latency[processed] = end - captured;
+        service[processed] = end - start;
+        if (latency[processed] > producer.periodMs) late++;
+        processed++;
+
+        // The first frame is only the reference, nothing is matched
+        const AlignParams &params = mosaic.getAligner()->getLastParams();
+        if (params.align_ms > 0.0) {
+            match[matched++] = params.match_ms;
+            inliers += params.nr_inliers;
+        }
+
+        switch (ret) {
+            case Mosaic::MOSAIC_RET_OK: returns[0]++; break;
+            case Mosaic::MOSAIC_RET_FEW_INLIERS: returns[1]++; break;
+            case Mosaic::MOSAIC_RET_LOW_TEXTURE: returns[2]++; break;
+            default: returns[3]++; break;
+        }
+    }
+    pthread_join(thread, NULL);
+
+    // Time from the last frame to the finished mosaic
+    float progress = 0.0;
+    bool cancelComputation = false;
+    Progressive progressive;
+    memset(&progressive, 0, sizeof(progressive));
+    progressive.previewFile = previewFile;
+    progressive.ordered = true;
+    double blendStart = nowMs();
+    if (previewFile != NULL) {
+        progressive.startMs = blendStart;
+        mosaic.createMosaicProgressive(DEFAULT_PREVIEW_SCALE_LOG2, mosaicReady,
+                                       &progressive, progress, cancelComputation);
+    } else {
+        mosaic.createMosaic(progress, cancelComputation);
+    }
+    double blendMs = nowMs() - blendStart - progressive.writeMs;
+
+    printf("Delivered %d, processed %d, dropped %d (queue full)\n",
+           queue.delivered, processed, queue.dropped);
+    printf("Aligned %d, few inliers %d, low texture %d, rejected %d (still or error)\n",
+           returns[0], returns[1], returns[2], returns[3]);
+    printf("Queue depth: mean %.2f  max %d\n",
+           queue.delivered ? queue.depthSum / queue.delivered : 0.0, queue.maxDepth);
+    printf("Frames over one frame period of latency: %d\n", late);
+    printDistribution("Latency", latency, processed);
+    printDistribution("addFrame", service, processed);
+    printf("Matched %d frames%s, %ld inliers (mean %.1f)\n", matched,
+           matchCascade ? " with the cascade" : "", inliers,
+           matched ? (double) inliers / matched : 0.0);
+    printDistribution("Match", match, matched);
+    if (previewFile == NULL) {
+        printf("createMosaic ms: %.2f\n", blendMs);
+    } else {
+        printf("createMosaicProgressive ms: preview %.2f (%dx%d), final %.2f\n",
+               progressive.previewMs, progressive.previewWidth,
+               progressive.previewHeight, progressive.finalMs);
+        if (progressive.calls != 2 || !progressive.ordered) {
+            printf("FAIL: expected the preview and then the final mosaic, got %d deliveries\n",
+                   progressive.calls);
+            return 3;
+        }
+    }
+
+    pthread_mutex_destroy(&queue.lock);
+    pthread_cond_destroy(&queue.ready);
+
+    if (latencySlo > 0.0 && percentile(latency, processed, 99) > latencySlo) {
+        printf("FAIL: p99 latency above %.2f ms\n", latencySlo);
+        return 2;
+    }
+    return 0;
+}
@@ -21,7 +21,6 @@
 #include <fstream>
 #include <sstream>
 #include <string>
-#include <vector>
 
 #include "btsnooz_utils.h"
 
@@ -31,17 +30,17 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
-  std::vector<char> buffer;
+  BtSnoozDecoder decoder;
 
-  int read = 0;
+  size_t read = 0;
   if (argc < 3) {
     std::cerr << "<Reading from stdin>\n";
-    read = readLog(std::cin, buffer);
+    read = decoder.readLog(std::cin);
 
   } else {
     std::cerr << "<Reading " << argv[1] << ">\n";
     std::ifstream ff(argv[1]);
-    read = readLog(ff, buffer);
+    read = decoder.readLog(ff);
     ff.close();
   }
 
@@ -52,32 +51,31 @@ int main(int argc, char *argv[]) {
 
   std::cerr << std::setw(8) << read << " bytes of base64 data read\n";
 
-  read = base64Decode(buffer);
-  if (read <= 0) {
+  if (decoder.decoded() <= 0) {
     std::cerr << "Decoding base64 data failed...\n";
     return 3;
   }
 
-  std::cerr << std::setw(8) << read << " bytes of compressed data decoded\n";
+  std::cerr << std::setw(8) << decoder.decoded()
+            << " bytes of compressed data decoded\n";
 
-  std::vector<uint8_t> uncompressed;
-  read = inflate(buffer, uncompressed);
-  if (read <= 0) {
+  if (decoder.inflated() <= 0) {
     std::cerr << "Error inflating data...\n";
     return 4;
   }
 
-  std::cerr << std::setw(8) << read << " bytes of data inflated\n";
+  std::cerr << std::setw(8) << decoder.inflated()
+            << " bytes of data inflated\n";
 
   if (argc < 2) {
     std::cerr << "<Writing to stdout>\n";
-    read = writeBtSnoop(std::cout, uncompressed);
+    read = decoder.writeBtSnoop(std::cout);
 
   } else {
     const int arg = argc > 2 ? 2 : 1;
     std::cerr << "<Writing " << argv[arg] << ">\n";
     std::ofstream ff(argv[arg]);
-    read = writeBtSnoop(ff, uncompressed);
+    read = decoder.writeBtSnoop(ff);
     ff.close();
   }
 
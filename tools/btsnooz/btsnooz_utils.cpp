@@ -16,16 +16,19 @@
  *
  ******************************************************************************/
 
+#include <ctype.h>
 #include <iostream>
 #include <iomanip>
 #include <fstream>
 #include <sstream>
 #include <string>
-#include <string.h> // for memcpy
+#include <string.h> // for memcpy, memset
 #include <vector>
 #include <resolv.h>
 #include <zlib.h>
 
+#include "btsnooz_utils.h"
+
 extern "C" {
 #include "btif/include/btif_debug_btsnoop.h"
 #include "hci/include/bt_hci_bdroid.h"
@@ -36,7 +39,6 @@ extern "C" {
 // Epoch in microseconds since 01/01/0000.
 #define BTSNOOP_EPOCH_DELTA 0x00dcddb30f2f8000ULL
 
-#define INITIAL_BUFFER_SIZE 131072
 #define INFLATE_BUFFER  16384
 
 #define LOG_PREFIX  "--- BEGIN:BTSNOOP_LOG_SUMMARY"
@@ -87,90 +89,130 @@ static uint8_t packetTypeToHciType(const uint8_t type) {
   return 0;
 }
 
-size_t writeBtSnoop(std::ostream &out, std::vector<uint8_t> &in) {
-  if (in.size() < sizeof(btsnooz_preamble_t))
-    return 0;
-
-  // Get preamble
-
-  uint8_t *p = in.data();
-  btsnooz_preamble_t *preamble = reinterpret_cast<btsnooz_preamble_t*>(p);
-  if (preamble->version != BTSNOOZ_CURRENT_VERSION)
-    return 0;
-
-  // Write header
+namespace {
 
-  const uint8_t header[] = {
-    0x62, 0x74, 0x73, 0x6e, 0x6f, 0x6f, 0x70, 0x00,
-    0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x03, 0xea
-  };
+// Runs |length| bytes of compressed data through |zs|, handing each block
+// of output to |sink|. Sets |*ended| at the end of the deflate stream, after
+// which further input is ignored. Returns false on a zlib error.
+template <typename Sink>
+bool inflateChunk(z_stream *zs, bool *ended, const uint8_t *data,
+                  size_t length, Sink sink) {
+  uint8_t buffer[INFLATE_BUFFER];
 
-  out.write(reinterpret_cast<const char*>(header), sizeof(header));
+  zs->next_in = const_cast<uint8_t*>(data);
+  zs->avail_in = length;
 
-  // Calculate first timestamp
+  while (!*ended && length != 0) {
+    zs->avail_out = INFLATE_BUFFER;
+    zs->next_out = buffer;
 
-  uint64_t first_ts = preamble->last_timestamp_ms + BTSNOOP_EPOCH_DELTA;
-  size_t left = in.size() - sizeof(btsnooz_preamble_t);
-  p = in.data() + sizeof(btsnooz_preamble_t);
+    int ret = inflate(zs, Z_NO_FLUSH);
+    if (ret == Z_STREAM_END)
+      *ended = true;
+    else if (ret != Z_OK && ret != Z_BUF_ERROR)
+      return false;
 
-  while (left > sizeof(btsnooz_header_t)) {
-    btsnooz_header_t *p_hdr = reinterpret_cast<btsnooz_header_t*>(p);
-    p += sizeof(btsnooz_header_t) + (p_hdr->length - 1);
-    left -= sizeof(btsnooz_header_t) + (p_hdr->length - 1);
+    if (zs->avail_out != INFLATE_BUFFER)
+      sink(buffer, INFLATE_BUFFER - zs->avail_out);
 
-    first_ts -= p_hdr->delta_time_ms;
+    if (zs->avail_out != 0)
+      break;
   }
 
-  // Process packets
+  return true;
+}
 
-  size_t packets = 0;
-  left = in.size() - sizeof(btsnooz_preamble_t);
-  p = in.data() + sizeof(btsnooz_preamble_t);
+// Appends inflated log data to |pending| and hands every complete packet
+// to |handler|. A trailing partial packet stays in |pending|, so it never
+// holds more than one packet and one block of inflated data. Returns false
+// on a packet with a zero length, which cannot be parsed past.
+template <typename Handler>
+bool parsePackets(std::vector<uint8_t> &pending, const uint8_t *data,
+                  size_t length, Handler handler) {
+  pending.insert(pending.end(), data, data + length);
+
+  size_t pos = 0;
+  bool ok = true;
+  while (pending.size() - pos >= sizeof(btsnooz_header_t)) {
+    btsnooz_header_t hdr;
+    memcpy(&hdr, &pending[pos], sizeof(hdr));
+
+    // The length includes the packet type, which is in the header.
+    if (hdr.length == 0) {
+      ok = false;
+      break;
+    }
+    if (pending.size() - pos - sizeof(hdr) < size_t(hdr.length - 1))
+      break;
 
-  while (left > sizeof(btsnooz_header_t)) {
-    btsnooz_header_t *p_hdr = reinterpret_cast<btsnooz_header_t*>(p);
-    p += sizeof(btsnooz_header_t);
-    left -= sizeof(btsnooz_header_t);
+    handler(hdr, &pending[pos + sizeof(hdr)]);
+    pos += sizeof(hdr) + (hdr.length - 1);
+  }
 
-    const uint32_t h_length = htonl(p_hdr->length);
-    out.write(reinterpret_cast<const char*>(&h_length), 4);
-    out.write(reinterpret_cast<const char*>(&h_length), 4);
+  pending.erase(pending.begin(), pending.begin() + pos);
+  return ok;
+}
 
-    const uint32_t h_flags = htonl(packetTypeToFlags(p_hdr->type));
-    out.write(reinterpret_cast<const char*>(&h_flags), 4);
+void writePacket(std::ostream &out, const btsnooz_header_t &hdr,
+                 const uint8_t *payload, uint64_t *ts) {
+  const uint32_t h_length = htonl(hdr.length);
+  out.write(reinterpret_cast<const char*>(&h_length), 4);
+  out.write(reinterpret_cast<const char*>(&h_length), 4);
 
-    const uint32_t h_dropped = 0;
-    out.write(reinterpret_cast<const char*>(&h_dropped), 4);
+  const uint32_t h_flags = htonl(packetTypeToFlags(hdr.type));
+  out.write(reinterpret_cast<const char*>(&h_flags), 4);
 
-    first_ts += p_hdr->delta_time_ms;
-    const uint32_t h_time_hi = htonl(first_ts >> 32);
-    const uint32_t h_time_lo = htonl(first_ts & 0xFFFFFFFF);
-    out.write(reinterpret_cast<const char*>(&h_time_hi), 4);
-    out.write(reinterpret_cast<const char*>(&h_time_lo), 4);
+  const uint32_t h_dropped = 0;
+  out.write(reinterpret_cast<const char*>(&h_dropped), 4);
 
-    const uint8_t type = packetTypeToHciType(p_hdr->type);
-    out.write(reinterpret_cast<const char*>(&type), 1);
+  *ts += hdr.delta_time_ms;
+  const uint32_t h_time_hi = htonl(*ts >> 32);
+  const uint32_t h_time_lo = htonl(*ts & 0xFFFFFFFF);
+  out.write(reinterpret_cast<const char*>(&h_time_hi), 4);
+  out.write(reinterpret_cast<const char*>(&h_time_lo), 4);
 
-    out.write(reinterpret_cast<const char*>(p), p_hdr->length - 1);
+  const uint8_t type = packetTypeToHciType(hdr.type);
+  out.write(reinterpret_cast<const char*>(&type), 1);
 
-    p += p_hdr->length - 1;
-    left -= p_hdr->length - 1;
+  out.write(reinterpret_cast<const char*>(payload), hdr.length - 1);
+}
 
-    ++packets;
-  }
+}  // namespace
+
+BtSnoozDecoder::BtSnoozDecoder()
+    : padded_(false),
+      decoded_(0),
+      spool_(tmpfile()),
+      spoolFailed_(spool_ == NULL),
+      inflateEnded_(false),
+      inflateFailed_(false),
+      inflated_(0),
+      totalDelta_(0) {
+  memset(&zs_, 0, sizeof(zs_));
+  zsReady_ = inflateInit(&zs_) == Z_OK;
+}
 
-  return packets;
+BtSnoozDecoder::~BtSnoozDecoder() {
+  if (zsReady_)
+    inflateEnd(&zs_);
+  if (spool_)
+    fclose(spool_);
 }
 
-int readLog(std::istream &in, std::vector<char> &buffer) {
-  buffer.reserve(INITIAL_BUFFER_SIZE);
+int BtSnoozDecoder::inflated() const {
+  if (!zsReady_ || inflateFailed_ || spoolFailed_)
+    return -1;
+  return preamble_.size() + inflated_;
+}
 
+size_t BtSnoozDecoder::readLog(std::istream &in) {
   std::string line;
 
   const std::string log_prefix(LOG_PREFIX);
   const std::string log_postfix(LOG_POSTFIX);
 
   bool in_block = false;
+  size_t read = 0;
 
   while (std::getline(in, line)) {
     // Ensure line endings aren't wonky...
@@ -191,54 +233,137 @@ int readLog(std::istream &in, std::vector<char> &buffer) {
 
     // Process data
 
-    buffer.insert(buffer.end(), line.begin(), line.end());
+    read += line.size();
+    addBase64(line);
   }
 
-  if (buffer.size() != 0)
-    buffer.push_back(0);
+  // A final partial quad is decoded as is so that b64_pton rejects it.
+  if (!quads_.empty())
+    decodeQuads(quads_.size());
 
-  return buffer.size();
+  return read;
 }
 
-int base64Decode(std::vector<char> &buffer) {
-  char *p = buffer.data();
-  return b64_pton(p, reinterpret_cast<uint8_t*>(p), buffer.size());
-}
+void BtSnoozDecoder::addBase64(const std::string &line) {
+  for (char c : line) {
+    if (isspace(static_cast<unsigned char>(c)))
+      continue;
+    // Nothing may follow the padding.
+    if (padded_)
+      decoded_ = -1;
+    quads_.push_back(c);
+  }
 
-int inflate(std::vector<char> &in, std::vector<uint8_t> &out) {
-  out.reserve(in.size());
+  decodeQuads(quads_.size() & ~size_t(3));
+}
 
-  uint8_t buffer[INFLATE_BUFFER];
-  z_stream zs;
+void BtSnoozDecoder::decodeQuads(size_t length) {
+  if (decoded_ < 0 || length == 0)
+    return;
+
+  std::string src(quads_, 0, length);
+  quads_.erase(0, length);
+  if (src.find('=') != std::string::npos)
+    padded_ = true;
+
+  decodeBuffer_.resize(length / 4 * 3 + 3);
+  const int n = b64_pton(src.c_str(), decodeBuffer_.data(),
+                         decodeBuffer_.size());
+  if (n < 0) {
+    decoded_ = -1;
+    return;
+  }
 
-  int ret = inflateInit(&zs);
-  if (Z_OK != ret)
-    return -1;
+  decoded_ += n;
+  addDecoded(decodeBuffer_.data(), n);
+}
 
-  // Copy preamble as-is
+void BtSnoozDecoder::addDecoded(const uint8_t *data, size_t length) {
+  // The preamble is stored uncompressed ahead of the deflate stream.
 
-  for (size_t i = 0; i != sizeof(btsnooz_preamble_t); ++i) {
-    out.push_back(in[i]);
+  while (length != 0 && preamble_.size() < sizeof(btsnooz_preamble_t)) {
+    preamble_.push_back(*data++);
+    --length;
   }
 
-  // De-compress data
+  if (length == 0)
+    return;
+
+  if (!spoolFailed_ && fwrite(data, length, 1, spool_) != 1)
+    spoolFailed_ = true;
+
+  // First pass: inflate now, only to total up the packet time deltas.
+
+  if (!zsReady_ || inflateFailed_)
+    return;
+
+  bool parsed = true;
+  const bool ok = inflateChunk(&zs_, &inflateEnded_, data, length,
+      [&](const uint8_t *out, size_t n) {
+        inflated_ += n;
+        if (parsed)
+          parsed = parsePackets(pending_, out, n,
+              [this](const btsnooz_header_t &hdr, const uint8_t *) {
+                totalDelta_ += hdr.delta_time_ms;
+              });
+      });
+  if (!ok || !parsed)
+    inflateFailed_ = true;
+}
 
-  zs.avail_in = in.size() - sizeof(btsnooz_preamble_t);;
-  zs.next_in = reinterpret_cast<uint8_t*>(in.data()) + sizeof(btsnooz_preamble_t);
+size_t BtSnoozDecoder::writeBtSnoop(std::ostream &out) {
+  if (preamble_.size() < sizeof(btsnooz_preamble_t) || inflated() < 0)
+    return 0;
 
-  do {
-    zs.avail_out = INFLATE_BUFFER;
-    zs.next_out = buffer;
+  // Get preamble
 
-    ret = inflate(&zs, Z_NO_FLUSH);
+  btsnooz_preamble_t preamble;
+  memcpy(&preamble, preamble_.data(), sizeof(preamble));
+  if (preamble.version != BTSNOOZ_CURRENT_VERSION)
+    return 0;
 
-    size_t read = INFLATE_BUFFER - zs.avail_out;
-    uint8_t *p = buffer;
-    while (read--)
-      out.push_back(*p++);
-  } while (zs.avail_out == 0);
+  // Write header
+
+  const uint8_t header[] = {
+    0x62, 0x74, 0x73, 0x6e, 0x6f, 0x6f, 0x70, 0x00,
+    0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x03, 0xea
+  };
+
+  out.write(reinterpret_cast<const char*>(header), sizeof(header));
+
+  // Calculate first timestamp
+
+  uint64_t ts = preamble.last_timestamp_ms + BTSNOOP_EPOCH_DELTA - totalDelta_;
+
+  // Second pass: inflate again and write packets as they complete
+
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  if (inflateInit(&zs) != Z_OK)
+    return 0;
+
+  size_t packets = 0;
+  bool ended = false;
+  std::vector<uint8_t> pending;
+  uint8_t compressed[INFLATE_BUFFER];
+  size_t length;
+
+  rewind(spool_);
+  while (!ended &&
+         (length = fread(compressed, 1, sizeof(compressed), spool_)) != 0) {
+    const bool ok = inflateChunk(&zs, &ended, compressed, length,
+        [&](const uint8_t *data, size_t n) {
+          parsePackets(pending, data, n,
+              [&](const btsnooz_header_t &hdr, const uint8_t *payload) {
+                writePacket(out, hdr, payload, &ts);
+                ++packets;
+              });
+        });
+    if (!ok)
+      break;
+  }
 
   inflateEnd(&zs);
 
-  return out.size();
+  return packets;
 }
@@ -18,10 +18,60 @@
 
 #pragma once
 
+#include <stdio.h>
 #include <iostream>
+#include <string>
 #include <vector>
+#include <zlib.h>
 
-size_t writeBtSnoop(std::ostream &out, std::vector<uint8_t> &in);
-int readLog(std::istream &in, std::vector<char> &buffer);
-int base64Decode(std::vector<char> &buffer);
-int inflate(std::vector<char> &in, std::vector<uint8_t> &out);
+// Converts the BTSNOOZ block of a bug report into a btsnoop file.
+//
+// Each line of the block is base64 decoded and inflated as soon as it is
+// read, and packets are parsed out of the inflated data as they complete.
+// None of the base64 text, the compressed data or the inflated log is held
+// in memory. Packet timestamps count back from the last one, so every
+// packet has to be seen before the first can be written; the compressed
+// data is spooled to a temporary file, and writeBtSnoop() inflates it
+// again from there.
+class BtSnoozDecoder {
+ public:
+  BtSnoozDecoder();
+  ~BtSnoozDecoder();
+
+  // Reads and decodes the log block from |in|. Returns the number of
+  // base64 characters read, which is 0 if there is no block.
+  size_t readLog(std::istream &in);
+
+  // Writes the decoded log to |out|. Returns the number of packets written.
+  size_t writeBtSnoop(std::ostream &out);
+
+  // Number of bytes base64 decoded, or -1 if the block is not valid base64.
+  int decoded() const { return decoded_; }
+
+  // Number of bytes inflated, preamble included, or -1 on an inflate error,
+  // a corrupt packet header, or if the data could not be spooled.
+  int inflated() const;
+
+ private:
+  void addBase64(const std::string &line);
+  void decodeQuads(size_t length);
+  void addDecoded(const uint8_t *data, size_t length);
+
+  std::string quads_;                // base64 not yet decoded
+  bool padded_;                      // decoded the final, padded quad
+  std::vector<uint8_t> decodeBuffer_;
+  int decoded_;
+
+  std::vector<uint8_t> preamble_;
+  FILE *spool_;                      // compressed data for the second pass
+  bool spoolFailed_;
+
+  z_stream zs_;
+  bool zsReady_;
+  bool inflateEnded_;
+  bool inflateFailed_;               // inflate error or corrupt packet
+  size_t inflated_;
+
+  std::vector<uint8_t> pending_;     // partial packet awaiting more data
+  uint64_t totalDelta_;              // sum of the packet time deltas
+};
@@ -22,10 +22,11 @@ LOCAL_STATIC_LIBRARIES := \
 	libETC1
 
 # Statically link libz for MinGW (Win SDK under Linux),
-# and dynamically link for all others.
+# and dynamically link for all others. Windows has no pthreads and
+# etc1tool encodes serially there.
 LOCAL_STATIC_LIBRARIES_windows := libz
-LOCAL_LDLIBS_darwin := -lz
-LOCAL_LDLIBS_linux := -lrt -lz
+LOCAL_LDLIBS_darwin := -lz -lpthread
+LOCAL_LDLIBS_linux := -lrt -lz -lpthread
 
 LOCAL_MODULE := etc1tool
 LOCAL_MODULE_HOST_OS := darwin linux windows
@@ -17,16 +17,122 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <string>
+#include <vector>
 
 #include <png.h>
 #include <ETC1/etc1.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+
+// Worker threads and the lock and condition they share. The Windows host
+// build has no pthreads, so there a thread never starts and the calling
+// thread, which is always one of the workers, does all of the work by
+// itself and never has to wait for another.
+#ifdef _WIN32
+typedef int Thread;
+typedef int Lock;
+typedef int Condition;
+
+static void lockInit(Lock*) {}
+static void lockDestroy(Lock*) {}
+static void lockAcquire(Lock*) {}
+static void lockRelease(Lock*) {}
+
+static void conditionInit(Condition*) {}
+static void conditionDestroy(Condition*) {}
+static void conditionWait(Condition*, Lock*) {}
+static void conditionBroadcast(Condition*) {}
+
+static
+bool startThread(Thread*, void* (*)(void*), void*) {
+    return false;
+}
+
+static void joinThread(Thread) {}
+#else
+typedef pthread_t Thread;
+typedef pthread_mutex_t Lock;
+typedef pthread_cond_t Condition;
+
+static void lockInit(Lock* pLock) { pthread_mutex_init(pLock, NULL); }
+static void lockDestroy(Lock* pLock) { pthread_mutex_destroy(pLock); }
+static void lockAcquire(Lock* pLock) { pthread_mutex_lock(pLock); }
+static void lockRelease(Lock* pLock) { pthread_mutex_unlock(pLock); }
+
+static void conditionInit(Condition* pCond) { pthread_cond_init(pCond, NULL); }
+static void conditionDestroy(Condition* pCond) { pthread_cond_destroy(pCond); }
+static void conditionWait(Condition* pCond, Lock* pLock) { pthread_cond_wait(pCond, pLock); }
+static void conditionBroadcast(Condition* pCond) { pthread_cond_broadcast(pCond); }
+
+static
+bool startThread(Thread* pThread, void* (*pFunc)(void*), void* arg) {
+    return pthread_create(pThread, NULL, pFunc, arg) == 0;
+}
+
+static void joinThread(Thread thread) { pthread_join(thread, NULL); }
+#endif
 
 int writePNGFile(const char* pOutput, png_uint_32 width, png_uint_32 height,
         const png_bytep pImageData, png_uint_32 imageStride);
 
 const char* gpExeName;
 
+// Image and encoded data buffers. They only ever grow, so a batch worker
+// can reuse one set for every file it converts. pMips holds the mipmap
+// levels below the source image when encoding with --mipmaps.
+struct ImageBuffers {
+    etc1_byte* pImage;
+    etc1_uint32 imageCapacity;
+    etc1_byte* pEncoded;
+    etc1_uint32 encodedCapacity;
+    etc1_byte* pMips;
+    etc1_uint32 mipsCapacity;
+
+    ImageBuffers() : pImage(NULL), imageCapacity(0), pEncoded(NULL), encodedCapacity(0),
+            pMips(NULL), mipsCapacity(0) {
+    }
+
+    ~ImageBuffers() {
+        delete[] pImage;
+        delete[] pEncoded;
+        delete[] pMips;
+    }
+};
+
+// Make sure *ppBuffer holds at least size bytes.
+// Returns non-zero if out of memory.
+static
+int reserveBuffer(etc1_byte** ppBuffer, etc1_uint32* pCapacity, etc1_uint32 size) {
+    if (*ppBuffer && *pCapacity >= size) {
+        return 0;
+    }
+    delete[] *ppBuffer;
+    *pCapacity = 0;
+    *ppBuffer = new etc1_byte[size > 0 ? size : 1];
+    if (!*ppBuffer) {
+        fprintf(stderr, "Out of memory.\n");
+        return -1;
+    }
+    *pCapacity = size;
+    return 0;
+}
+
 static
 void usage(char* message, ...) {
     if (message) {
@@ -39,7 +145,11 @@ void usage(char* message, ...) {
     }
     fprintf(
             stderr,
-            "%s infile [--help | --encode | --encodeNoHeader | --decode] [--showDifference difffile] [-o outfile]\n",
+            "%s infile [--help | --encode | --encodeNoHeader | --decode] [--showDifference difffile] [--threads n] [--mipmaps] [-o outfile]\n",
+            gpExeName);
+    fprintf(
+            stderr,
+            "%s --batch listfile|dir [--encode | --encodeNoHeader | --decode] [--jobs n] [--threads n] [--mipmaps] [-o outdir]\n",
             gpExeName);
     fprintf(stderr, "\tDefault is --encode\n");
     fprintf(stderr, "\t\t--help           print this usage information.\n");
@@ -54,6 +164,22 @@ void usage(char* message, ...) {
             "\t\t--showDifference difffile    Write difference between original and encoded\n");
     fprintf(stderr,
             "\t\t                             image to difffile. (Only valid when encoding).\n");
+    fprintf(stderr,
+            "\t\t--threads n      encode using n threads. (Only valid when encoding).\n");
+    fprintf(stderr,
+            "\t\t--mipmaps        encode the whole mipmap chain, writing level n to outfile\n");
+    fprintf(stderr,
+            "\t\t                 with _n added before its extension. (Only valid when encoding).\n");
+    fprintf(stderr,
+            "\t\t--batch listfile|dir  convert every file named in listfile (one per line),\n");
+    fprintf(stderr,
+            "\t\t                      or every .png (.pkm when decoding) file in dir.\n");
+    fprintf(stderr,
+            "\t\t--jobs n              convert n batch files at a time. Default is one per CPU.\n");
+    fprintf(stderr,
+            "\tIn batch mode outputs go to outdir (which must exist), or next to each\n");
+    fprintf(stderr,
+            "\tinput without -o. A throughput report is printed when done.\n");
     fprintf(stderr,
             "\tIf outfile is not specified, an outfile path is constructed from infile,\n");
     fprintf(stderr, "\twith the apropriate suffix (.pkm or .png).\n");
@@ -129,54 +255,67 @@ int fread_big_endian_uint16(png_uint_32* data, FILE* pIn) {
     return 0;
 }
 
-// Read a PNG file into a contiguous buffer.
-// Returns non-zero if an error occurred.
-// caller has to delete[] *ppImageData when done with the image.
+static const size_t PNG_HEADER_SIZE = 8;
 
-int read_PNG_File(const char* pInput, etc1_byte** ppImageData,
-        etc1_uint32* pWidth, etc1_uint32* pHeight) {
-    FILE* pIn = NULL;
-    png_structp png_ptr = NULL;
-    png_infop info_ptr = NULL;
-    png_infop end_info = NULL;
-    png_bytep* row_pointers = NULL; // Does not need to be deallocated.
-    png_uint_32 width = 0;
-    png_uint_32 height = 0;
-    png_uint_32 stride = 0;
-    int result = -1;
-    etc1_byte* pSourceImage = 0;
+// Open a PNG file, check its signature and create the libpng read structs.
+// The caller must set up png_jmpbuf before calling into libpng, and close
+// *ppIn and destroy *ppPng (when set) whether or not this succeeds.
+// Returns non-zero if an error occurred.
 
-    if ((pIn = fopen(pInput, "rb")) == NULL) {
+static
+int openPNGFile(const char* pInput, FILE** ppIn, png_structp* ppPng,
+        png_infop* ppInfo, png_infop* ppEndInfo) {
+    if ((*ppIn = fopen(pInput, "rb")) == NULL) {
         fprintf(stderr, "Could not open input file %s for reading: %d\n",
                 pInput, errno);
-        goto exit;
+        return -1;
     }
 
-    static const size_t PNG_HEADER_SIZE = 8;
     png_byte pngHeader[PNG_HEADER_SIZE];
-    if (fread(pngHeader, 1, PNG_HEADER_SIZE, pIn) != PNG_HEADER_SIZE) {
+    if (fread(pngHeader, 1, PNG_HEADER_SIZE, *ppIn) != PNG_HEADER_SIZE) {
         fprintf(stderr, "Could not read PNG header from %s: %d\n", pInput,
                 errno);
-        goto exit;
+        return -1;
     }
 
     if (png_sig_cmp(pngHeader, 0, PNG_HEADER_SIZE)) {
         fprintf(stderr, "%s is not a PNG file.\n", pInput);
-        goto exit;
+        return -1;
     }
 
-    if (!(png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING,
+    if (!(*ppPng = png_create_read_struct(PNG_LIBPNG_VER_STRING,
             (png_voidp) NULL, user_error_fn, user_warning_fn))) {
         fprintf(stderr, "Could not initialize png read struct.\n");
-        goto exit;
+        return -1;
     }
 
-    if (!(info_ptr = png_create_info_struct(png_ptr))) {
+    if (!(*ppInfo = png_create_info_struct(*ppPng))) {
         fprintf(stderr, "Could not create info struct.\n");
-        goto exit;
+        return -1;
     }
-    if (!(end_info = png_create_info_struct(png_ptr))) {
+    if (!(*ppEndInfo = png_create_info_struct(*ppPng))) {
         fprintf(stderr, "Could not create end_info struct.\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Read a PNG file into pBuffers->pImage.
+// Returns non-zero if an error occurred.
+
+int read_PNG_File(const char* pInput, ImageBuffers* pBuffers,
+        etc1_uint32* pWidth, etc1_uint32* pHeight) {
+    FILE* pIn = NULL;
+    png_structp png_ptr = NULL;
+    png_infop info_ptr = NULL;
+    png_infop end_info = NULL;
+    png_bytep* row_pointers = NULL; // Does not need to be deallocated.
+    png_uint_32 width = 0;
+    png_uint_32 height = 0;
+    png_uint_32 stride = 0;
+    int result = -1;
+
+    if (openPNGFile(pInput, &pIn, &png_ptr, &info_ptr, &end_info)) {
         goto exit;
     }
 
@@ -199,25 +338,19 @@ int read_PNG_File(const char* pInput, etc1_byte** ppImageData,
 
     stride = 3 * width;
 
-    pSourceImage = new etc1_byte[stride * height];
-    if (! pSourceImage) {
-        fprintf(stderr, "Out of memory.\n");
+    if (reserveBuffer(&pBuffers->pImage, &pBuffers->imageCapacity, stride * height)) {
         goto exit;
     }
 
     for (etc1_uint32 y = 0; y < height; y++) {
-        memcpy(pSourceImage + y * stride, row_pointers[y], stride);
+        memcpy(pBuffers->pImage + y * stride, row_pointers[y], stride);
     }
 
     *pWidth = width;
     *pHeight = height;
-    *ppImageData = pSourceImage;
 
     result = 0;
     exit:
-    if (result) {
-        delete[] pSourceImage;
-    }
     if (png_ptr) {
         png_destroy_read_struct(&png_ptr, &info_ptr, &end_info);
     }
@@ -228,16 +361,14 @@ int read_PNG_File(const char* pInput, etc1_byte** ppImageData,
     return result;
 }
 
-// Read a PNG file into a contiguous buffer.
+// Read and decode a PKM file into pBuffers->pImage.
+// The encoded data is read into pBuffers->pEncoded.
 // Returns non-zero if an error occurred.
-// caller has to delete[] *ppImageData when done with the image.
-int readPKMFile(const char* pInput, etc1_byte** ppImageData,
+int readPKMFile(const char* pInput, ImageBuffers* pBuffers,
         etc1_uint32* pWidth, etc1_uint32* pHeight) {
     int result = -1;
     FILE* pIn = NULL;
     etc1_byte header[ETC_PKM_HEADER_SIZE];
-    png_bytep pEncodedData = NULL;
-    png_bytep pImageData = NULL;
 
     png_uint_32 width = 0;
     png_uint_32 height = 0;
@@ -265,13 +396,11 @@ int readPKMFile(const char* pInput, etc1_byte** ppImageData,
     height = etc1_pkm_get_height(header);
     encodedSize = etc1_get_encoded_data_size(width, height);
 
-    pEncodedData = new png_byte[encodedSize];
-    if (!pEncodedData) {
-        fprintf(stderr, "Out of memory.\n");
+    if (reserveBuffer(&pBuffers->pEncoded, &pBuffers->encodedCapacity, encodedSize)) {
         goto exit;
     }
 
-    if (fread(pEncodedData, encodedSize, 1, pIn) != 1) {
+    if (fread(pBuffers->pEncoded, encodedSize, 1, pIn) != 1) {
         fprintf(stderr, "Could not read encoded data from input file %s: %d\n",
                 pInput, errno);
         goto exit;
@@ -281,24 +410,18 @@ int readPKMFile(const char* pInput, etc1_byte** ppImageData,
     pIn = NULL;
 
     stride = width * 3;
-    pImageData = new png_byte[stride * height];
-    if (!pImageData) {
-        fprintf(stderr, "Out of memory.\n");
+    if (reserveBuffer(&pBuffers->pImage, &pBuffers->imageCapacity, stride * height)) {
         goto exit;
     }
 
-    etc1_decode_image(pEncodedData, pImageData, width, height, 3, stride);
+    etc1_decode_image(pBuffers->pEncoded, pBuffers->pImage, width, height, 3, stride);
 
     // Success
     result = 0;
-    *ppImageData = pImageData;
-    pImageData = 0;
     *pWidth = width;
     *pHeight = height;
 
     exit:
-    delete[] pEncodedData;
-    delete[] pImageData;
     if (pIn) {
         fclose(pIn);
     }
@@ -307,32 +430,393 @@ int readPKMFile(const char* pInput, etc1_byte** ppImageData,
 }
 
 
-// Encode the file.
+// A band of whole 4x4 block rows, encoded by one thread.
+struct EncodeBand {
+    const etc1_byte* pIn;
+    etc1_uint32 width;
+    etc1_uint32 height;
+    etc1_uint32 stride;
+    etc1_byte* pOut;
+    int result;
+};
+
+// Bands shared by a pool of encoding threads, each of which takes the
+// next unclaimed band until none are left.
+struct EncodeQueue {
+    EncodeBand* pBands;
+    int bandCount;
+    int next;
+    Lock lock;
+};
+
+static
+void* encodeQueueThread(void* arg) {
+    EncodeQueue* pQueue = (EncodeQueue*) arg;
+    for (;;) {
+        lockAcquire(&pQueue->lock);
+        int index = pQueue->next;
+        if (index < pQueue->bandCount) {
+            pQueue->next++;
+        }
+        lockRelease(&pQueue->lock);
+        if (index >= pQueue->bandCount) {
+            break;
+        }
+        EncodeBand* pBand = &pQueue->pBands[index];
+        pBand->result = etc1_encode_image(pBand->pIn, pBand->width, pBand->height,
+                3, pBand->stride, pBand->pOut);
+    }
+    return NULL;
+}
+
+// Split an RGB image into bandCount bands of whole block rows, each
+// encoding into its own slice of pOut. bandCount must not exceed the
+// number of block rows.
+
+static
+void splitIntoBands(const etc1_byte* pIn, etc1_uint32 width, etc1_uint32 height,
+        etc1_uint32 stride, etc1_byte* pOut, int bandCount, EncodeBand* pBands) {
+    etc1_uint32 blockRows = (height + 3) / 4;
+    etc1_uint32 blockRowSize = ((width + 3) / 4) * ETC1_ENCODED_BLOCK_SIZE;
+    for (int i = 0; i < bandCount; i++) {
+        etc1_uint32 firstRow = blockRows * i / bandCount;
+        etc1_uint32 lastRow = blockRows * (i + 1) / bandCount;
+        etc1_uint32 y = firstRow * 4;
+        etc1_uint32 yEnd = lastRow * 4 < height ? lastRow * 4 : height;
+        pBands[i].pIn = pIn + y * stride;
+        pBands[i].width = width;
+        pBands[i].height = yEnd - y;
+        pBands[i].stride = stride;
+        pBands[i].pOut = pOut + firstRow * blockRowSize;
+        pBands[i].result = -1;
+    }
+}
+
+// Encode bands using a pool of up to threadCount threads. The calling
+// thread is one of the pool, and threads that cannot be started just
+// leave their share to the others.
+// Returns non-zero if any band failed to encode.
+
+static
+int encodeBands(EncodeBand* pBands, int bandCount, int threadCount) {
+    EncodeQueue queue;
+    queue.pBands = pBands;
+    queue.bandCount = bandCount;
+    queue.next = 0;
+    lockInit(&queue.lock);
+
+    if (threadCount > bandCount) {
+        threadCount = bandCount;
+    }
+    Thread* pThreads = new Thread[threadCount > 0 ? threadCount : 1];
+    bool* pStarted = new bool[threadCount > 0 ? threadCount : 1];
+    for (int i = 1; i < threadCount; i++) {
+        pStarted[i] = startThread(&pThreads[i], encodeQueueThread, &queue);
+    }
+    encodeQueueThread(&queue);
+    for (int i = 1; i < threadCount; i++) {
+        if (pStarted[i]) {
+            joinThread(pThreads[i]);
+        }
+    }
+    delete[] pThreads;
+    delete[] pStarted;
+    lockDestroy(&queue.lock);
+
+    for (int i = 0; i < bandCount; i++) {
+        if (pBands[i].result) {
+            return pBands[i].result;
+        }
+    }
+    return 0;
+}
+
+// Encode an RGB image using up to threadCount threads.
+// Blocks are encoded independently, so the image is split into bands of
+// whole block rows, each written to its own slice of pOut. The result is
+// byte-identical to a single etc1_encode_image call.
 // Returns non-zero if an error occurred.
 
-int encode(const char* pInput, const char* pOutput, bool bEmitHeader, const char* pDiffFile) {
-    FILE* pOut = NULL;
-    etc1_uint32 width = 0;
-    etc1_uint32 height = 0;
-    etc1_uint32 encodedSize = 0;
+int encodeImage(const etc1_byte* pIn, etc1_uint32 width, etc1_uint32 height,
+        etc1_uint32 stride, etc1_byte* pOut, int threadCount) {
+    etc1_uint32 blockRows = (height + 3) / 4;
+    if (threadCount < 1) {
+        threadCount = 1;
+    }
+    if ((etc1_uint32) threadCount > blockRows) {
+        threadCount = blockRows > 0 ? blockRows : 1;
+    }
+    if (threadCount == 1) {
+        return etc1_encode_image(pIn, width, height, 3, stride, pOut);
+    }
+
+    EncodeBand* pBands = new EncodeBand[threadCount];
+    splitIntoBands(pIn, width, height, stride, pOut, threadCount, pBands);
+    int result = encodeBands(pBands, threadCount, threadCount);
+    delete[] pBands;
+    return result;
+}
+
+// Streamed bands are this many block rows tall. Each worker holds one band
+// of source and encoded data, so this bounds memory use per thread.
+static const etc1_uint32 STREAM_BAND_BLOCK_ROWS = 4;
+
+// A PNG file streamed through one pool of encoding threads. A worker takes
+// the next band and reads its rows while it holds the lock, so the file is
+// read in order. It then encodes the band alongside the other workers and
+// appends it to the output once every band above it has been written.
+struct EncodeStream {
+    const char* pInput;
+    const char* pOutput;
+    png_structp png_ptr;
+    FILE* pOut;
+    etc1_uint32 width;
+    etc1_uint32 height;
+    etc1_uint32 stride;
+    etc1_uint32 blockRowSize;
+
+    Lock lock;
+    Condition written;
+    etc1_uint32 nextRow;
+    int nextBand;
+    int nextWrite;
+    bool failed;
+};
+
+struct StreamWorker {
+    EncodeStream* pStream;
+    ImageBuffers* pBuffers;
+};
+
+static
+void* encodeStreamThread(void* arg) {
+    StreamWorker* pWorker = (StreamWorker*) arg;
+    EncodeStream* pStream = pWorker->pStream;
+    etc1_byte* pImage = pWorker->pBuffers->pImage;
+    etc1_byte* pEncoded = pWorker->pBuffers->pEncoded;
+    for (;;) {
+        lockAcquire(&pStream->lock);
+        if (pStream->failed || pStream->nextRow >= pStream->height) {
+            lockRelease(&pStream->lock);
+            break;
+        }
+        int band = pStream->nextBand++;
+        etc1_uint32 rows = pStream->height - pStream->nextRow;
+        if (rows > 4 * STREAM_BAND_BLOCK_ROWS) {
+            rows = 4 * STREAM_BAND_BLOCK_ROWS;
+        }
+        pStream->nextRow += rows;
+        if (setjmp(png_jmpbuf(pStream->png_ptr))) {
+            pStream->failed = true;
+            conditionBroadcast(&pStream->written);
+            lockRelease(&pStream->lock);
+            break;
+        }
+        for (etc1_uint32 row = 0; row < rows; row++) {
+            png_read_row(pStream->png_ptr, pImage + row * pStream->stride, NULL);
+        }
+        lockRelease(&pStream->lock);
+
+        int result = etc1_encode_image(pImage, pStream->width, rows, 3, pStream->stride,
+                pEncoded);
+
+        lockAcquire(&pStream->lock);
+        while (!pStream->failed && pStream->nextWrite != band) {
+            conditionWait(&pStream->written, &pStream->lock);
+        }
+        if (!pStream->failed) {
+            if (result) {
+                fprintf(stderr, "Could not encode %s.\n", pStream->pInput);
+                pStream->failed = true;
+            } else if (fwrite(pEncoded, pStream->blockRowSize * ((rows + 3) / 4), 1,
+                    pStream->pOut) != 1) {
+                fprintf(stderr,
+                        "Could not write encoded data to output file %s: %d\n",
+                        pStream->pOutput, errno);
+                pStream->failed = true;
+            }
+        }
+        pStream->nextWrite++;
+        conditionBroadcast(&pStream->written);
+        lockRelease(&pStream->lock);
+    }
+    return NULL;
+}
+
+// Encode a non-interlaced PNG file one band of block rows at a time, using
+// one pool of up to threadCount threads for the whole file. Each worker
+// holds one band of source and encoded data, the calling thread's in
+// pBuffers, so memory use grows with the image width and thread count only.
+// Sets *pbStreamed to false, without creating the output, if the file is
+// interlaced and has to be read in full instead.
+// Returns non-zero if an error occurred.
+
+int encodeStreaming(const char* pInput, const char* pOutput, bool bEmitHeader,
+        int threadCount, ImageBuffers* pBuffers, bool* pbStreamed) {
+    FILE* pIn = NULL;
+    FILE* volatile pOut = NULL;
+    png_structp png_ptr = NULL;
+    png_infop info_ptr = NULL;
+    png_infop end_info = NULL;
     int result = -1;
-    etc1_byte* pSourceImage = 0;
-    etc1_byte* pEncodedData = 0;
-    etc1_byte* pDiffImage = 0; // Used for differencing
+    *pbStreamed = true;
 
-    if (read_PNG_File(pInput, &pSourceImage, &width, &height)) {
+    if (openPNGFile(pInput, &pIn, &png_ptr, &info_ptr, &end_info)) {
         goto exit;
     }
 
-    encodedSize = etc1_get_encoded_data_size(width, height);
-    pEncodedData = new etc1_byte[encodedSize];
-    if (!pEncodedData) {
-        fprintf(stderr, "Out of memory.\n");
+    if (setjmp(png_jmpbuf(png_ptr))) {
         goto exit;
     }
 
-    etc1_encode_image(pSourceImage,
-            width, height, 3, width * 3, pEncodedData);
+    png_init_io(png_ptr, pIn);
+    png_set_sig_bytes(png_ptr, PNG_HEADER_SIZE);
+    png_read_info(png_ptr, info_ptr);
+
+    if (png_get_interlace_type(png_ptr, info_ptr) != PNG_INTERLACE_NONE) {
+        *pbStreamed = false;
+        result = 0;
+        goto exit;
+    }
+
+    png_set_strip_16(png_ptr);
+    png_set_strip_alpha(png_ptr);
+    png_set_packing(png_ptr);
+    png_read_update_info(png_ptr, info_ptr);
+
+    {
+        etc1_uint32 width = png_get_image_width(png_ptr, info_ptr);
+        etc1_uint32 height = png_get_image_height(png_ptr, info_ptr);
+        etc1_uint32 stride = 3 * width;
+        if (png_get_rowbytes(png_ptr, info_ptr) != stride) {
+            fprintf(stderr, "%s is not an 8 bit RGB PNG file.\n", pInput);
+            goto exit;
+        }
+
+        etc1_uint32 bandCount = ((height + 3) / 4 + STREAM_BAND_BLOCK_ROWS - 1)
+                / STREAM_BAND_BLOCK_ROWS;
+        if (threadCount < 1) {
+            threadCount = 1;
+        }
+        if ((etc1_uint32) threadCount > bandCount) {
+            threadCount = bandCount > 0 ? bandCount : 1;
+        }
+        etc1_uint32 blockRowSize = ((width + 3) / 4) * ETC1_ENCODED_BLOCK_SIZE;
+        if (reserveBuffer(&pBuffers->pImage, &pBuffers->imageCapacity,
+                        stride * 4 * STREAM_BAND_BLOCK_ROWS)
+                || reserveBuffer(&pBuffers->pEncoded, &pBuffers->encodedCapacity,
+                        blockRowSize * STREAM_BAND_BLOCK_ROWS)) {
+            goto exit;
+        }
+
+        if ((pOut = fopen(pOutput, "wb")) == NULL) {
+            fprintf(stderr, "Could not open output file %s: %d\n", pOutput, errno);
+            goto exit;
+        }
+
+        if (bEmitHeader) {
+            etc1_byte header[ETC_PKM_HEADER_SIZE];
+            etc1_pkm_format_header(header, width, height);
+            if (fwrite(header, sizeof(header), 1, pOut) != 1) {
+                fprintf(stderr,
+                        "Could not write header output file %s: %d\n",
+                        pOutput, errno);
+                goto exit;
+            }
+        }
+
+        EncodeStream stream;
+        stream.pInput = pInput;
+        stream.pOutput = pOutput;
+        stream.png_ptr = png_ptr;
+        stream.pOut = pOut;
+        stream.width = width;
+        stream.height = height;
+        stream.stride = stride;
+        stream.blockRowSize = blockRowSize;
+        stream.nextRow = 0;
+        stream.nextBand = 0;
+        stream.nextWrite = 0;
+        stream.failed = false;
+        lockInit(&stream.lock);
+        conditionInit(&stream.written);
+
+        // This thread is the first worker. A worker thread that cannot be
+        // started, or its buffers reserved, leaves its bands to the others.
+        ImageBuffers* pWorkerBuffers = new ImageBuffers[threadCount];
+        StreamWorker* pWorkers = new StreamWorker[threadCount];
+        Thread* pThreads = new Thread[threadCount];
+        bool* pStarted = new bool[threadCount];
+        for (int i = 0; i < threadCount; i++) {
+            pWorkers[i].pStream = &stream;
+            pWorkers[i].pBuffers = i == 0 ? pBuffers : &pWorkerBuffers[i];
+            pStarted[i] = false;
+            if (i > 0 && !reserveBuffer(&pWorkerBuffers[i].pImage,
+                            &pWorkerBuffers[i].imageCapacity,
+                            stride * 4 * STREAM_BAND_BLOCK_ROWS)
+                    && !reserveBuffer(&pWorkerBuffers[i].pEncoded,
+                            &pWorkerBuffers[i].encodedCapacity,
+                            blockRowSize * STREAM_BAND_BLOCK_ROWS)) {
+                pStarted[i] = startThread(&pThreads[i], encodeStreamThread, &pWorkers[i]);
+            }
+        }
+        encodeStreamThread(&pWorkers[0]);
+        for (int i = 1; i < threadCount; i++) {
+            if (pStarted[i]) {
+                joinThread(pThreads[i]);
+            }
+        }
+        delete[] pThreads;
+        delete[] pStarted;
+        delete[] pWorkers;
+        delete[] pWorkerBuffers;
+        conditionDestroy(&stream.written);
+        lockDestroy(&stream.lock);
+
+        if (stream.failed) {
+            goto exit;
+        }
+    }
+
+    // The workers pointed libpng's error handling at their own stacks.
+    if (setjmp(png_jmpbuf(png_ptr))) {
+        goto exit;
+    }
+    png_read_end(png_ptr, end_info);
+
+    if (fclose(pOut)) {
+        pOut = NULL;
+        fprintf(stderr, "Could not write output file %s: %d\n", pOutput, errno);
+        remove(pOutput);
+        goto exit;
+    }
+    pOut = NULL;
+
+    // Success
+    result = 0;
+
+    exit:
+    if (pOut) {
+        fclose(pOut);
+        remove(pOutput);
+    }
+    if (png_ptr) {
+        png_destroy_read_struct(&png_ptr, &info_ptr, &end_info);
+    }
+    if (pIn) {
+        fclose(pIn);
+    }
+    return result;
+}
+
+// Write encoded data to a file, preceded by a PKM header if bEmitHeader.
+// Returns non-zero if an error occurred.
+
+static
+int writeEncodedFile(const char* pOutput, bool bEmitHeader, etc1_uint32 width,
+        etc1_uint32 height, const etc1_byte* pEncodedData, etc1_uint32 encodedSize) {
+    FILE* pOut = NULL;
+    int result = -1;
 
     if ((pOut = fopen(pOutput, "wb")) == NULL) {
         fprintf(stderr, "Could not open output file %s: %d\n", pOutput, errno);
@@ -357,13 +841,235 @@ int encode(const char* pInput, const char* pOutput, bool bEmitHeader, const char
         goto exit;
     }
 
-    fclose(pOut);
+    result = fclose(pOut);
     pOut = NULL;
+    if (result) {
+        fprintf(stderr, "Could not write output file %s: %d\n", pOutput, errno);
+    }
+
+    exit:
+    if (pOut) {
+        fclose(pOut);
+    }
+    return result;
+}
+
+// Enough levels for the largest image a PKM header can describe.
+static const int MAX_MIP_LEVELS = 17;
+
+// Encoded bands of a mipmap level are this many block rows tall, so the
+// larger levels are shared out between threads as well as the levels.
+static const etc1_uint32 MIP_BAND_BLOCK_ROWS = 16;
+
+struct MipLevel {
+    etc1_uint32 width;
+    etc1_uint32 height;
+    etc1_byte* pImage;
+    etc1_byte* pEncoded;
+    etc1_uint32 encodedSize;
+};
+
+// The output path of a mipmap level: pOutput with "_level" added before
+// its extension.
+
+std::string mipLevelPath(const char* pOutput, int level) {
+    std::string path(pOutput);
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), "_%d", level);
+    size_t dot = path.rfind('.');
+    size_t slash = path.rfind('/');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+        return path + suffix;
+    }
+    return path.substr(0, dot) + suffix + path.substr(dot);
+}
+
+// Add two rows of count bytes into 16 bit sums.
+
+static
+void sumRows(const etc1_byte* pRow0, const etc1_byte* pRow1, etc1_uint32 count,
+        unsigned short* pSum) {
+    etc1_uint32 i = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= count; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*) (pRow0 + i));
+        __m128i b = _mm_loadu_si128((const __m128i*) (pRow1 + i));
+        _mm_storeu_si128((__m128i*) (pSum + i),
+                _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero)));
+        _mm_storeu_si128((__m128i*) (pSum + i + 8),
+                _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero)));
+    }
+#endif
+    for (; i < count; i++) {
+        pSum[i] = pRow0[i] + pRow1[i];
+    }
+}
+
+// Box filter the RGB image of pSrc into the next smaller level pDst.
+// Each destination pixel is the rounded mean of a 2x2 source square; an
+// odd last row or column is dropped, and a dimension of 1 is averaged
+// with itself. pSum must hold 3 * pSrc->width values.
+
+static
+void downsampleLevel(const MipLevel* pSrc, MipLevel* pDst, unsigned short* pSum) {
+    etc1_uint32 srcStride = 3 * pSrc->width;
+    etc1_uint32 nextRow = pSrc->height > 1 ? srcStride : 0;
+    etc1_uint32 nextPixel = pSrc->width > 1 ? 3 : 0;
+    for (etc1_uint32 y = 0; y < pDst->height; y++) {
+        const etc1_byte* pRow = pSrc->pImage + 2 * y * srcStride;
+        sumRows(pRow, pRow + nextRow, srcStride, pSum);
+        etc1_byte* pOut = pDst->pImage + y * 3 * pDst->width;
+        const unsigned short* pIn = pSum;
+        for (etc1_uint32 x = 0; x < pDst->width; x++) {
+            pOut[0] = (etc1_byte) ((pIn[0] + pIn[nextPixel] + 2) >> 2);
+            pOut[1] = (etc1_byte) ((pIn[1] + pIn[nextPixel + 1] + 2) >> 2);
+            pOut[2] = (etc1_byte) ((pIn[2] + pIn[nextPixel + 2] + 2) >> 2);
+            pOut += 3;
+            pIn += 6;
+        }
+    }
+}
+
+// Encode a PNG file and its whole mipmap chain, down to 1x1.
+// The source is decoded once and each level is box filtered from the one
+// above it. The block rows of every level are then encoded by one pool of
+// threadCount threads, and level n is written to mipLevelPath(pOutput, n).
+// Sets *pLevelCount to the number of levels written.
+// Returns non-zero if an error occurred.
+
+int encodeMipmaps(const char* pInput, const char* pOutput, bool bEmitHeader,
+        int threadCount, ImageBuffers* pBuffers, int* pLevelCount) {
+    MipLevel levels[MAX_MIP_LEVELS];
+    int levelCount = 1;
+    etc1_uint32 mipsSize = 0;
+    etc1_uint32 encodedSize = 0;
+    int bandCount = 0;
+    EncodeBand* pBands = NULL;
+    unsigned short* pSum = NULL;
+    int result = -1;
+    *pLevelCount = 0;
+
+    if (read_PNG_File(pInput, pBuffers, &levels[0].width, &levels[0].height)) {
+        goto exit;
+    }
+    if (levels[0].width > 0xffff || levels[0].height > 0xffff) {
+        fprintf(stderr, "%s is too large for a PKM file.\n", pInput);
+        goto exit;
+    }
+
+    while (levels[levelCount - 1].width > 1 || levels[levelCount - 1].height > 1) {
+        const MipLevel& above = levels[levelCount - 1];
+        MipLevel& level = levels[levelCount++];
+        level.width = above.width > 1 ? above.width / 2 : 1;
+        level.height = above.height > 1 ? above.height / 2 : 1;
+        mipsSize += 3 * level.width * level.height;
+    }
+    for (int i = 0; i < levelCount; i++) {
+        levels[i].encodedSize = etc1_get_encoded_data_size(levels[i].width, levels[i].height);
+        encodedSize += levels[i].encodedSize;
+        bandCount += ((levels[i].height + 3) / 4 + MIP_BAND_BLOCK_ROWS - 1) / MIP_BAND_BLOCK_ROWS;
+    }
+
+    if (reserveBuffer(&pBuffers->pMips, &pBuffers->mipsCapacity, mipsSize)
+            || reserveBuffer(&pBuffers->pEncoded, &pBuffers->encodedCapacity, encodedSize)) {
+        goto exit;
+    }
+    levels[0].pImage = pBuffers->pImage;
+    levels[0].pEncoded = pBuffers->pEncoded;
+    for (int i = 1; i < levelCount; i++) {
+        const MipLevel& above = levels[i - 1];
+        levels[i].pImage = (i == 1 ? pBuffers->pMips : above.pImage + 3 * above.width * above.height);
+        levels[i].pEncoded = above.pEncoded + above.encodedSize;
+    }
+
+    pSum = new unsigned short[3 * levels[0].width];
+    for (int i = 1; i < levelCount; i++) {
+        downsampleLevel(&levels[i - 1], &levels[i], pSum);
+    }
+
+    pBands = new EncodeBand[bandCount];
+    {
+        EncodeBand* pBand = pBands;
+        for (int i = 0; i < levelCount; i++) {
+            etc1_uint32 blockRows = (levels[i].height + 3) / 4;
+            int levelBands = (blockRows + MIP_BAND_BLOCK_ROWS - 1) / MIP_BAND_BLOCK_ROWS;
+            splitIntoBands(levels[i].pImage, levels[i].width, levels[i].height,
+                    3 * levels[i].width, levels[i].pEncoded, levelBands, pBand);
+            pBand += levelBands;
+        }
+    }
+    if (encodeBands(pBands, bandCount, threadCount < 1 ? 1 : threadCount)) {
+        fprintf(stderr, "Could not encode %s.\n", pInput);
+        goto exit;
+    }
+
+    for (int i = 0; i < levelCount; i++) {
+        std::string path = mipLevelPath(pOutput, i);
+        if (writeEncodedFile(path.c_str(), bEmitHeader, levels[i].width, levels[i].height,
+                levels[i].pEncoded, levels[i].encodedSize)) {
+            goto exit;
+        }
+        *pLevelCount = i + 1;
+    }
+
+    // Success
+    result = 0;
+
+    exit:
+    delete[] pBands;
+    delete[] pSum;
+    return result;
+}
+
+// Encode the file, using pBuffers for the source image and encoded data.
+// Returns non-zero if an error occurred.
+
+int encode(const char* pInput, const char* pOutput, bool bEmitHeader, const char* pDiffFile,
+        int threadCount, ImageBuffers* pBuffers) {
+    etc1_uint32 width = 0;
+    etc1_uint32 height = 0;
+    etc1_uint32 encodedSize = 0;
+    int result = -1;
+    etc1_byte* pSourceImage = 0;
+    etc1_byte* pEncodedData = 0;
+    ImageBuffers diffBuffers; // Used for differencing
+
+    // Differencing needs the whole source image; otherwise stream it.
+    if (!pDiffFile) {
+        bool bStreamed;
+        result = encodeStreaming(pInput, pOutput, bEmitHeader, threadCount,
+                pBuffers, &bStreamed);
+        if (bStreamed) {
+            return result;
+        }
+        result = -1;
+    }
+
+    if (read_PNG_File(pInput, pBuffers, &width, &height)) {
+        goto exit;
+    }
+    pSourceImage = pBuffers->pImage;
+
+    encodedSize = etc1_get_encoded_data_size(width, height);
+    if (reserveBuffer(&pBuffers->pEncoded, &pBuffers->encodedCapacity, encodedSize)) {
+        goto exit;
+    }
+    pEncodedData = pBuffers->pEncoded;
+
+    if (encodeImage(pSourceImage, width, height, width * 3, pEncodedData, threadCount)) {
+        fprintf(stderr, "Could not encode %s.\n", pInput);
+        goto exit;
+    }
+
+    if (writeEncodedFile(pOutput, bEmitHeader, width, height, pEncodedData, encodedSize)) {
+        goto exit;
+    }
 
     if (pDiffFile) {
         etc1_uint32 outWidth;
         etc1_uint32 outHeight;
-        if (readPKMFile(pOutput, &pDiffImage, &outWidth, &outHeight)) {
+        if (readPKMFile(pOutput, &diffBuffers, &outWidth, &outHeight)) {
             goto exit;
         }
         if (outWidth != width || outHeight != height) {
@@ -372,7 +1078,7 @@ int encode(const char* pInput, const char* pOutput, bool bEmitHeader, const char
             goto exit;
         }
         const etc1_byte* pSrc = pSourceImage;
-        etc1_byte* pDest = pDiffImage;
+        etc1_byte* pDest = diffBuffers.pImage;
         etc1_uint32 size = width * height * 3;
         for (etc1_uint32 i = 0; i < size; i++) {
             int diff = *pSrc++ - *pDest;
@@ -385,20 +1091,13 @@ int encode(const char* pInput, const char* pOutput, bool bEmitHeader, const char
             }
             *pDest++ = (png_byte) diff;
         }
-        writePNGFile(pDiffFile, outWidth, outHeight, pDiffImage, 3 * outWidth);
+        writePNGFile(pDiffFile, outWidth, outHeight, diffBuffers.pImage, 3 * outWidth);
     }
 
     // Success
     result = 0;
 
     exit:
-    delete[] pSourceImage;
-    delete[] pEncodedData;
-    delete[] pDiffImage;
-
-    if (pOut) {
-        fclose(pOut);
-    }
     return result;
 }
 
@@ -450,28 +1149,292 @@ int writePNGFile(const char* pOutput, png_uint_32 width, png_uint_32 height,
     return result;
 }
 
-int decode(const char* pInput, const char* pOutput) {
+// Decode the file, using pBuffers for the encoded data and decoded image.
+// Returns non-zero if an error occurred.
+
+int decode(const char* pInput, const char* pOutput, ImageBuffers* pBuffers) {
     int result = -1;
-    png_bytep pImageData = NULL;
     etc1_uint32 width = 0;
     etc1_uint32 height = 0;
 
-    if (readPKMFile(pInput, &pImageData, &width, &height)) {
+    if (readPKMFile(pInput, pBuffers, &width, &height)) {
         goto exit;
     }
 
-    if (writePNGFile(pOutput, width, height, pImageData, width * 3)) {
+    if (writePNGFile(pOutput, width, height, pBuffers->pImage, width * 3)) {
         goto exit;
     }
 
     // Success
     result = 0;
 
-    exit: delete[] pImageData;
-
+    exit:
     return result;
 }
 
+// A list of files converted by a pool of worker threads. Each worker keeps
+// its own ImageBuffers, and while one worker reads or writes a file the
+// others keep encoding, so file I/O overlaps with compression.
+struct Batch {
+    std::vector<std::string> inputs;
+    std::vector<std::string> outputs;
+    bool bEncode;
+    bool bEmitHeader;
+    bool bMipmaps;
+    int threadCount;
+
+    Lock lock;
+    size_t next;
+    int converted;
+    int failed;
+    double bytesRead;
+    double bytesWritten;
+};
+
+static
+double fileSize(const char* pPath) {
+    struct stat st;
+    if (stat(pPath, &st)) {
+        return 0;
+    }
+    return (double) st.st_size;
+}
+
+static
+double now() {
+#ifdef _WIN32
+    LARGE_INTEGER counter;
+    LARGE_INTEGER frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return (double) counter.QuadPart / frequency.QuadPart;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+#endif
+}
+
+static
+void* batchWorker(void* arg) {
+    Batch* pBatch = (Batch*) arg;
+    ImageBuffers buffers;
+    for (;;) {
+        lockAcquire(&pBatch->lock);
+        size_t index = pBatch->next;
+        if (index < pBatch->inputs.size()) {
+            pBatch->next++;
+        }
+        lockRelease(&pBatch->lock);
+        if (index >= pBatch->inputs.size()) {
+            break;
+        }
+
+        const char* pInput = pBatch->inputs[index].c_str();
+        const char* pOutput = pBatch->outputs[index].c_str();
+        int result;
+        int levelCount = 0;
+        if (pBatch->bMipmaps) {
+            result = encodeMipmaps(pInput, pOutput, pBatch->bEmitHeader,
+                    pBatch->threadCount, &buffers, &levelCount);
+        } else if (pBatch->bEncode) {
+            result = encode(pInput, pOutput, pBatch->bEmitHeader, NULL,
+                    pBatch->threadCount, &buffers);
+        } else {
+            result = decode(pInput, pOutput, &buffers);
+        }
+        double bytesRead = result ? 0 : fileSize(pInput);
+        double bytesWritten = 0;
+        if (!result && pBatch->bMipmaps) {
+            for (int i = 0; i < levelCount; i++) {
+                bytesWritten += fileSize(mipLevelPath(pOutput, i).c_str());
+            }
+        } else if (!result) {
+            bytesWritten = fileSize(pOutput);
+        }
+
+        lockAcquire(&pBatch->lock);
+        if (result) {
+            pBatch->failed++;
+        } else {
+            pBatch->converted++;
+            pBatch->bytesRead += bytesRead;
+            pBatch->bytesWritten += bytesWritten;
+        }
+        lockRelease(&pBatch->lock);
+    }
+    return NULL;
+}
+
+static
+bool hasExtension(const char* pName, const char* pExtension) {
+    size_t nameLen = strlen(pName);
+    size_t extensionLen = strlen(pExtension);
+    return nameLen > extensionLen
+            && strcmp(pName + nameLen - extensionLen, pExtension) == 0;
+}
+
+// Fill pInputs from a directory (every file with the given extension, in
+// name order) or from a list file (one path per line, '#' starts a comment).
+// Returns non-zero if an error occurred.
+
+static
+int collectBatchInputs(const char* pPath, const char* pExtension,
+        std::vector<std::string>* pInputs) {
+    struct stat st;
+    if (stat(pPath, &st)) {
+        fprintf(stderr, "Could not find %s: %d\n", pPath, errno);
+        return -1;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+        std::vector<std::string> names;
+#ifdef _WIN32
+        WIN32_FIND_DATAA entry;
+        HANDLE hFind = FindFirstFileA((std::string(pPath) + "/*").c_str(), &entry);
+        if (hFind == INVALID_HANDLE_VALUE) {
+            fprintf(stderr, "Could not open directory %s: %lu\n", pPath, GetLastError());
+            return -1;
+        }
+        do {
+            if (hasExtension(entry.cFileName, pExtension)) {
+                names.push_back(entry.cFileName);
+            }
+        } while (FindNextFileA(hFind, &entry));
+        FindClose(hFind);
+#else
+        DIR* pDir = opendir(pPath);
+        if (!pDir) {
+            fprintf(stderr, "Could not open directory %s: %d\n", pPath, errno);
+            return -1;
+        }
+        struct dirent* pEntry;
+        while ((pEntry = readdir(pDir)) != NULL) {
+            if (hasExtension(pEntry->d_name, pExtension)) {
+                names.push_back(pEntry->d_name);
+            }
+        }
+        closedir(pDir);
+#endif
+        std::sort(names.begin(), names.end());
+        for (size_t i = 0; i < names.size(); i++) {
+            pInputs->push_back(std::string(pPath) + "/" + names[i]);
+        }
+        return 0;
+    }
+
+    FILE* pIn = fopen(pPath, "r");
+    if (!pIn) {
+        fprintf(stderr, "Could not open list file %s: %d\n", pPath, errno);
+        return -1;
+    }
+    char line[4096];
+    while (fgets(line, sizeof(line), pIn)) {
+        size_t len = strlen(line);
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = '\0';
+        }
+        if (len > 0 && line[0] != '#') {
+            pInputs->push_back(line);
+        }
+    }
+    fclose(pIn);
+    return 0;
+}
+
+// Convert every file named by pBatchPath using jobCount workers, then print
+// a throughput report.
+// Returns non-zero if any file could not be converted.
+
+int convertBatch(const char* pBatchPath, const char* pOutDir, bool bEncode,
+        bool bEmitHeader, bool bMipmaps, int threadCount, int jobCount) {
+    const char* kExtension = bEncode ? ".pkm" : ".png";
+    Batch batch;
+    batch.bEncode = bEncode;
+    batch.bEmitHeader = bEmitHeader;
+    batch.bMipmaps = bMipmaps;
+    batch.threadCount = threadCount;
+    batch.next = 0;
+    batch.converted = 0;
+    batch.failed = 0;
+    batch.bytesRead = 0;
+    batch.bytesWritten = 0;
+
+    if (collectBatchInputs(pBatchPath, bEncode ? ".png" : ".pkm", &batch.inputs)) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < batch.inputs.size(); i++) {
+        std::string output = batch.inputs[i];
+        if (pOutDir) {
+            size_t slash = output.rfind('/');
+            output = std::string(pOutDir) + "/"
+                    + (slash == std::string::npos ? output : output.substr(slash + 1));
+        }
+        size_t buffSize = output.size() + strlen(kExtension) + 1;
+        char* pOutputBuff = new char[buffSize];
+        strcpy(pOutputBuff, output.c_str());
+        if (changeExtension(pOutputBuff, buffSize, kExtension)) {
+            fprintf(stderr, "Could not change extension of input file name: %s\n",
+                    batch.inputs[i].c_str());
+            delete[] pOutputBuff;
+            return -1;
+        }
+        batch.outputs.push_back(pOutputBuff);
+        delete[] pOutputBuff;
+    }
+
+    if ((size_t) jobCount > batch.inputs.size()) {
+        jobCount = batch.inputs.size() > 0 ? batch.inputs.size() : 1;
+    }
+
+    double start = now();
+    lockInit(&batch.lock);
+
+    // This thread is the first worker. If a worker thread cannot be
+    // started the others simply take its share of the files.
+    Thread* pThreads = new Thread[jobCount];
+    bool* pStarted = new bool[jobCount];
+    for (int i = 1; i < jobCount; i++) {
+        pStarted[i] = startThread(&pThreads[i], batchWorker, &batch);
+    }
+    batchWorker(&batch);
+    for (int i = 1; i < jobCount; i++) {
+        if (pStarted[i]) {
+            joinThread(pThreads[i]);
+        }
+    }
+    delete[] pThreads;
+    delete[] pStarted;
+
+    lockDestroy(&batch.lock);
+    double seconds = now() - start;
+    if (seconds <= 0) {
+        seconds = 1e-6;
+    }
+
+    printf("%s %d of %d files with %d job%s in %.2f s\n",
+            bEncode ? "Encoded" : "Decoded", batch.converted,
+            (int) batch.inputs.size(), jobCount, jobCount == 1 ? "" : "s", seconds);
+    printf("%.1f images/s, %.2f MB/s read, %.2f MB/s written\n",
+            batch.converted / seconds,
+            batch.bytesRead / (1024 * 1024) / seconds,
+            batch.bytesWritten / (1024 * 1024) / seconds);
+
+    return batch.failed ? -1 : 0;
+}
+
+static
+int defaultJobCount() {
+#if !defined(_WIN32) && defined(_SC_NPROCESSORS_ONLN)
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus > 0) {
+        return (int) cpus;
+    }
+#endif
+    return 1;
+}
+
 void multipleEncodeDecodeCheck(bool* pbEncodeDecodeSeen) {
     if (*pbEncodeDecodeSeen) {
         usage("At most one occurrence of --encode --encodeNoHeader or --decode is allowed.\n");
@@ -484,6 +1447,7 @@ int main(int argc, char** argv) {
     const char* pInput = NULL;
     const char* pOutput = NULL;
     const char* pDiffFile = NULL;
+    const char* pBatchPath = NULL;
     char* pOutputFileBuff = NULL;
 
     bool bEncodeDecodeSeen = false;
@@ -491,6 +1455,9 @@ int main(int argc, char** argv) {
     bool bEncodeHeader = false;
     bool bDecode = false;
     bool bShowDifference = false;
+    bool bMipmaps = false;
+    int threadCount = 1;
+    int jobCount = 0;
 
     for (int i = 1; i < argc; i++) {
         const char* pArg = argv[i];
@@ -527,6 +1494,32 @@ int main(int argc, char** argv) {
                         usage("Expected difffile after --showDifference");
                     }
                     pDiffFile = argv[++i];
+                } else if (strcmp(pArg, "--threads") == 0) {
+                    if (i + 1 >= argc) {
+                        usage("Expected a thread count after --threads");
+                    }
+                    threadCount = atoi(argv[++i]);
+                    if (threadCount < 1) {
+                        usage("Thread count must be at least 1, got %s", argv[i]);
+                    }
+                } else if (strcmp(pArg, "--mipmaps") == 0) {
+                    bMipmaps = true;
+                } else if (strcmp(pArg, "--batch") == 0) {
+                    if (pBatchPath != NULL) {
+                        usage("Only one --batch option allowed.\n");
+                    }
+                    if (i + 1 >= argc) {
+                        usage("Expected a list file or directory after --batch");
+                    }
+                    pBatchPath = argv[++i];
+                } else if (strcmp(pArg, "--jobs") == 0) {
+                    if (i + 1 >= argc) {
+                        usage("Expected a job count after --jobs");
+                    }
+                    jobCount = atoi(argv[++i]);
+                    if (jobCount < 1) {
+                        usage("Job count must be at least 1, got %s", argv[i]);
+                    }
                 } else if (strcmp(pArg, "--help") == 0) {
                     usage( NULL);
                 } else {
@@ -555,6 +1548,30 @@ int main(int argc, char** argv) {
     if ((! bEncode) && bShowDifference) {
         usage("--showDifference is only valid when encoding.");
     }
+    if ((! bEncode) && bMipmaps) {
+        usage("--mipmaps is only valid when encoding.");
+    }
+    if (bMipmaps && bShowDifference) {
+        usage("--showDifference can not be combined with --mipmaps.");
+    }
+
+    if (pBatchPath) {
+        if (pInput) {
+            usage("An input file can not be combined with --batch.");
+        }
+        if (bShowDifference) {
+            usage("--showDifference can not be combined with --batch.");
+        }
+        if (jobCount == 0) {
+            jobCount = defaultJobCount();
+        }
+        int result = convertBatch(pBatchPath, pOutput, bEncode, bEncodeHeader,
+                bMipmaps, threadCount, jobCount);
+        return result ? 1 : 0;
+    }
+    if (jobCount) {
+        usage("--jobs is only valid with --batch.");
+    }
 
     if (!pInput) {
         usage("Expected an input file.");
@@ -571,10 +1588,16 @@ int main(int argc, char** argv) {
         pOutput = pOutputFileBuff;
     }
 
-    if (bEncode) {
-        encode(pInput, pOutput, bEncodeHeader, pDiffFile);
-    } else {
-        decode(pInput, pOutput);
+    {
+        ImageBuffers buffers;
+        if (bMipmaps) {
+            int levelCount;
+            encodeMipmaps(pInput, pOutput, bEncodeHeader, threadCount, &buffers, &levelCount);
+        } else if (bEncode) {
+            encode(pInput, pOutput, bEncodeHeader, pDiffFile, threadCount, &buffers);
+        } else {
+            decode(pInput, pOutput, &buffers);
+        }
     }
 
     delete[] pOutputFileBuff;
@@ -10,5 +10,7 @@ LOCAL_SRC_FILES := \
 
 LOCAL_MODULE := line_endings
 
+LOCAL_LDLIBS := -lpthread
+
 include $(BUILD_HOST_EXECUTABLE)
 
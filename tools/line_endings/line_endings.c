@@ -1,158 +1,490 @@
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
-#define BUFSIZE (1024*8)
-static void to_unix(char* buf);
-static void unix_to_dos(char* buf2, const char* buf);
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define BUFSIZE (1024*64)
 
 int usage()
 {
-    fprintf(stderr, "usage: line_endings unix|dos FILES\n"
+    fprintf(stderr, "usage: line_endings [-v] [-j N] unix|dos FILES\n"
+            "\n"
+            "Convert FILES to either unix or dos line endings.\n"
+            "Files that are already converted are left untouched.\n"
             "\n"
-            "Convert FILES to either unix or dos line endings.\n");
+            "  -j N    convert N files at a time (default: one per CPU)\n"
+            "  -v      print how many files and bytes were scanned and rewritten\n");
     return 1;
 }
 
-typedef struct Node {
-    struct Node *next;
-    char buf[BUFSIZE*2+3];
-} Node;
+typedef enum { UNIX, DOS } Ending;
 
-int
-main(int argc, char** argv)
-{
-    enum { UNIX, DOS } ending;
-    int i;
+// Conversion state carried from one chunk of a file to the next.
+typedef struct Converter {
+    Ending ending;
+    int pending_cr;     // the previous chunk ended in '\r'
+} Converter;
 
-    if (argc < 2) {
-        return usage();
+// Returns the first '\r' or '\n' in [p, end), or end if there is none.
+static const char*
+find_eol(const char* p, const char* end)
+{
+#ifdef __SSE2__
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, cr),
+                                                  _mm_cmpeq_epi8(v, lf)));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for (; p < end; p++) {
+        if (*p == '\r' || *p == '\n') {
+            return p;
+        }
     }
+    return end;
+}
 
-    if (0 == strcmp("unix", argv[1])) {
-        ending = UNIX;
+// Returns the next line break that needs rewriting in [p, end). For unix
+// output a '\n' is already correct, so only '\r' has to be found.
+static const char*
+find_break(const Converter* c, const char* p, const char* end)
+{
+    if (c->ending == UNIX) {
+        const char* q = memchr(p, '\r', end - p);
+        return q ? q : end;
     }
-    else if (0 == strcmp("dos", argv[1])) {
-        ending = DOS;
+    return find_eol(p, end);
+}
+
+// Returns non-zero if [p, end) already uses only the target line ending.
+static int
+is_converted(const Converter* c, const char* p, const char* end)
+{
+    const char* start = p;
+    while (p < end) {
+        const char* eol = find_break(c, p, end);
+        if (eol == end) {
+            return 1;
+        }
+        if (c->ending == UNIX) {
+            return 0;
+        }
+        if (*eol == '\n') {
+            if (eol == start || eol[-1] != '\r') {
+                return 0;
+            }
+            p = eol + 1;
+        } else {
+            if (eol + 1 == end || eol[1] != '\n') {
+                return 0;
+            }
+            p = eol + 2;
+        }
     }
-    else {
-        return usage();
+    return 1;
+}
+
+// Appends the target line ending at q and returns the new end.
+static char*
+put_eol(const Converter* c, char* q)
+{
+    if (c->ending == DOS) {
+        *q++ = '\r';
     }
+    *q++ = '\n';
+    return q;
+}
 
-    for (i=2; i<argc; i++) {
-        int fd;
-        int len;
+// Converts len bytes of buf into out, which must hold 2*len+2 bytes, and
+// returns the number of bytes written. A '\r\n' pair, a lone '\r' and a
+// lone '\n' all become the target line ending. A '\r' at the end of buf is
+// held back until the next chunk shows whether a '\n' follows it.
+static size_t
+convert_chunk(Converter* c, const char* buf, size_t len, char* out)
+{
+    const char* p = buf;
+    const char* end = buf + len;
+    char* q = out;
 
-        // force implied
-        chmod(argv[i], S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP);
+    if (c->pending_cr && p < end) {
+        c->pending_cr = 0;
+        q = put_eol(c, q);
+        if (*p == '\n') {
+            p++;
+        }
+    }
 
-        fd = open(argv[i], O_RDWR);
-        if (fd < 0) {
-            fprintf(stderr, "unable to open file for read/write: %s\n", argv[i]);
-            return 1;
+    while (p < end) {
+        const char* eol = find_break(c, p, end);
+        memcpy(q, p, eol - p);
+        q += eol - p;
+        if (eol == end) {
+            break;
         }
+        if (*eol == '\r' && eol + 1 == end) {
+            c->pending_cr = 1;
+            break;
+        }
+        q = put_eol(c, q);
+        p = eol + (eol[0] == '\r' && eol[1] == '\n' ? 2 : 1);
+    }
+    return q - out;
+}
 
-        len = lseek(fd, 0, SEEK_END);
-        lseek(fd, 0, SEEK_SET);
-
-        if (len > 0) {
-            Node* root = malloc(sizeof(Node));
-            Node* node = root;
-            node->buf[0] = 0;
-
-            while (len > 0) {
-                node->next = malloc(sizeof(Node));
-                node = node->next;
-                node->next = NULL;
-
-                char buf[BUFSIZE+2];
-                ssize_t amt;
-                ssize_t amt2 = len < BUFSIZE ? len : BUFSIZE;
-                amt = read(fd, buf, amt2);
-                if (amt != amt2) {
-                    fprintf(stderr, "unable to read file: %s\n", argv[i]);
-                    return 1;
-                }
-                buf[amt2] = '\0';
-                to_unix(buf);
-                if (ending == UNIX) {
-                    strcpy(node->buf, buf);
-                } else {
-                    char buf2[(BUFSIZE*2)+3];
-                    unix_to_dos(buf2, buf);
-                    strcpy(node->buf, buf2);
-                }
-                len -= amt2;
-            }
+// Finishes a file, flushing a held back '\r'.
+static size_t
+convert_finish(Converter* c, char* out)
+{
+    if (c->pending_cr) {
+        c->pending_cr = 0;
+        return put_eol(c, out) - out;
+    }
+    return 0;
+}
 
-            ftruncate(fd, 0);
-            lseek(fd, 0, SEEK_SET);
-            while (root) {
-                ssize_t amt2 = strlen(root->buf);
-                if (amt2 > 0) {
-                    ssize_t amt = write(fd, root->buf, amt2);
-                    if (amt != amt2) {
-                        fprintf(stderr, "unable to write file: %s\n", argv[i]);
-                        return 1;
-                    }
-                }
-                node = root;
-                root = root->next;
-                free(node);
+static int
+write_all(int fd, const char* buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t amt = write(fd, buf, len);
+        if (amt < 0) {
+            if (errno == EINTR) {
+                continue;
             }
+            return -1;
         }
-        close(fd);
+        buf += amt;
+        len -= amt;
     }
     return 0;
 }
 
-void
-to_unix(char* buf)
+// Byte and file counts for the summary.
+typedef struct Stats {
+    long long scanned;
+    long long rewritten;
+    int files_scanned;
+    int files_rewritten;
+} Stats;
+
+// Copies the whole of in to out. Returns non-zero on error.
+static int
+copy_file(int in, int out, char* buf, size_t size)
 {
-    char* p = buf;
-    char* q = buf;
-    while (*p) {
-        if (p[0] == '\r' && p[1] == '\n') {
-            // dos
-            *q = '\n';
-            p += 2;
-            q += 1;
-        }
-        else if (p[0] == '\r') {
-            // old mac
-            *q = '\n';
-            p += 1;
-            q += 1;
+    if (lseek(in, 0, SEEK_SET) < 0) {
+        return -1;
+    }
+    for (;;) {
+        ssize_t amt = read(in, buf, size);
+        if (amt < 0 && errno == EINTR) {
+            continue;
         }
-        else {
-            *q = *p;
-            p += 1;
-            q += 1;
+        if (amt <= 0) {
+            return amt;
+        }
+        if (write_all(out, buf, amt)) {
+            return -1;
         }
     }
-    *q = '\0';
 }
 
-void
-unix_to_dos(char* buf2, const char* buf)
+// Converts one file a chunk at a time into a temporary file next to it,
+// then renames that over the original. Symlinks are resolved first so the
+// link survives and its target is converted. A file with other hard links
+// is instead rewritten in place from the temporary file, keeping the
+// links. Memory use does not depend on the size of the file. The file is
+// mapped and scanned first, and left alone if it already uses the target
+// line ending; the conversion then reads straight from the mapping. Files
+// that cannot be mapped are read instead. Adds to *stats and returns
+// non-zero on error.
+static int
+convert_file(const char* name, Ending ending, Stats* stats)
 {
-    const char* p = buf;
-    char* q = buf2;
-    while (*p) {
-        if (*p == '\n') {
-            q[0] = '\r';
-            q[1] = '\n';
-            q += 2;
-            p += 1;
-        } else {
-            *q = *p;
-            p += 1;
-            q += 1;
+    Converter c;
+    char* filename = NULL;
+    const char* data = NULL;
+    char* buf = NULL;
+    char* out = NULL;
+    char* tmpname = NULL;
+    int fd = -1;
+    int tmpfd = -1;
+    int result = 1;
+    size_t len;
+    struct stat st;
+
+    filename = realpath(name, NULL);
+    if (!filename) {
+        fprintf(stderr, "unable to open file for read: %s\n", name);
+        goto done;
+    }
+
+    // force implied
+    chmod(filename, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP);
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "unable to open file for read: %s\n", filename);
+        goto done;
+    }
+    stats->files_scanned++;
+    stats->scanned += st.st_size;
+    if (st.st_size == 0) {
+        result = 0;
+        goto done;
+    }
+
+    c.ending = ending;
+    c.pending_cr = 0;
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        data = NULL;
+    } else {
+        madvise((void*)data, st.st_size, MADV_SEQUENTIAL);
+        if (is_converted(&c, data, data + st.st_size)) {
+            result = 0;
+            goto done;
+        }
+    }
+
+    tmpname = malloc(strlen(filename) + sizeof(".XXXXXX"));
+    buf = data ? NULL : malloc(BUFSIZE);
+    out = malloc(BUFSIZE*2 + 2);
+    if (!tmpname || (!data && !buf) || !out) {
+        fprintf(stderr, "out of memory: %s\n", filename);
+        goto done;
+    }
+    sprintf(tmpname, "%s.XXXXXX", filename);
+    tmpfd = mkstemp(tmpname);
+    if (tmpfd < 0) {
+        fprintf(stderr, "unable to create temporary file: %s\n", tmpname);
+        free(tmpname);
+        tmpname = NULL;
+        goto done;
+    }
+    fchmod(tmpfd, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP);
+
+    for (off_t off = 0; data && off < st.st_size; off += BUFSIZE) {
+        size_t amt = st.st_size - off < BUFSIZE ? st.st_size - off : BUFSIZE;
+        len = convert_chunk(&c, data + off, amt, out);
+        if (write_all(tmpfd, out, len)) {
+            fprintf(stderr, "unable to write file: %s\n", filename);
+            goto done;
+        }
+        stats->rewritten += len;
+    }
+    while (!data) {
+        ssize_t amt = read(fd, buf, BUFSIZE);
+        if (amt < 0 && errno == EINTR) {
+            continue;
+        }
+        if (amt < 0) {
+            fprintf(stderr, "unable to read file: %s\n", filename);
+            goto done;
+        }
+        if (amt == 0) {
+            break;
+        }
+        len = convert_chunk(&c, buf, amt, out);
+        if (write_all(tmpfd, out, len)) {
+            fprintf(stderr, "unable to write file: %s\n", filename);
+            goto done;
+        }
+        stats->rewritten += len;
+    }
+    len = convert_finish(&c, out);
+    if (write_all(tmpfd, out, len)) {
+        fprintf(stderr, "unable to write file: %s\n", filename);
+        goto done;
+    }
+    stats->rewritten += len;
+
+    if (st.st_nlink > 1) {
+        int outfd = open(filename, O_WRONLY|O_TRUNC);
+        int failed = outfd < 0 || copy_file(tmpfd, outfd, out, BUFSIZE*2 + 2);
+        if (outfd >= 0 && close(outfd)) {
+            failed = 1;
+        }
+        if (failed) {
+            fprintf(stderr, "unable to write file: %s\n", filename);
+            goto done;
+        }
+    } else {
+        if (close(tmpfd)) {
+            tmpfd = -1;
+            fprintf(stderr, "unable to write file: %s\n", filename);
+            goto done;
+        }
+        tmpfd = -1;
+        if (rename(tmpname, filename)) {
+            fprintf(stderr, "unable to replace file: %s\n", filename);
+            goto done;
+        }
+        free(tmpname);
+        tmpname = NULL;
+    }
+    stats->files_rewritten++;
+    result = 0;
+
+done:
+    if (tmpfd >= 0) {
+        close(tmpfd);
+    }
+    if (tmpname) {
+        unlink(tmpname);
+        free(tmpname);
+    }
+    if (data) {
+        munmap((void*)data, st.st_size);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(filename);
+    free(buf);
+    free(out);
+    return result;
+}
+
+// The files of one run, shared out between worker threads.
+typedef struct Work {
+    char** files;
+    int count;
+    Ending ending;
+    pthread_mutex_t lock;
+    int next;
+    int failed;
+    Stats stats;
+} Work;
+
+static void*
+worker(void* arg)
+{
+    Work* work = arg;
+    for (;;) {
+        Stats stats = { 0, 0, 0, 0 };
+        int index;
+        int failed;
+
+        pthread_mutex_lock(&work->lock);
+        index = work->next;
+        if (index < work->count) {
+            work->next++;
         }
+        pthread_mutex_unlock(&work->lock);
+        if (index >= work->count) {
+            break;
+        }
+
+        failed = convert_file(work->files[index], work->ending, &stats);
+
+        pthread_mutex_lock(&work->lock);
+        work->failed |= failed;
+        work->stats.scanned += stats.scanned;
+        work->stats.rewritten += stats.rewritten;
+        work->stats.files_scanned += stats.files_scanned;
+        work->stats.files_rewritten += stats.files_rewritten;
+        pthread_mutex_unlock(&work->lock);
     }
-    *q = '\0';
+    return NULL;
 }
 
+int
+main(int argc, char** argv)
+{
+    Work work;
+    pthread_t* threads;
+    int* started;
+    int count = 0;
+    int verbose = 0;
+    int arg = 1;
+    int i;
+
+    while (arg < argc && argv[arg][0] == '-') {
+        if (0 == strcmp("-v", argv[arg])) {
+            verbose = 1;
+            arg++;
+        }
+        else if (0 == strcmp("-j", argv[arg]) && arg + 1 < argc) {
+            count = atoi(argv[arg + 1]);
+            if (count < 1) {
+                return usage();
+            }
+            arg += 2;
+        }
+        else {
+            return usage();
+        }
+    }
+
+    if (argc < arg + 1) {
+        return usage();
+    }
+
+    if (0 == strcmp("unix", argv[arg])) {
+        work.ending = UNIX;
+    }
+    else if (0 == strcmp("dos", argv[arg])) {
+        work.ending = DOS;
+    }
+    else {
+        return usage();
+    }
+
+    work.files = argv + arg + 1;
+    work.count = argc - arg - 1;
+    work.next = 0;
+    work.failed = 0;
+    memset(&work.stats, 0, sizeof(work.stats));
+    pthread_mutex_init(&work.lock, NULL);
+
+    // By default one worker per CPU, this thread included.
+    if (count == 0) {
+        count = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+        count = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    }
+    if (count > work.count) {
+        count = work.count;
+    }
+    if (count < 1) {
+        count = 1;
+    }
+    threads = malloc(count * sizeof(pthread_t));
+    started = calloc(count, sizeof(int));
+    for (i=1; i<count; i++) {
+        started[i] = !pthread_create(&threads[i], NULL, worker, &work);
+    }
+    worker(&work);
+    for (i=1; i<count; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+    free(threads);
+    free(started);
+    pthread_mutex_destroy(&work.lock);
+
+    if (verbose) {
+        fprintf(stderr, "scanned %d files, %lld bytes; "
+                "rewrote %d files, %lld bytes\n",
+                work.stats.files_scanned, work.stats.scanned,
+                work.stats.files_rewritten, work.stats.rewritten);
+    }
+
+    return work.failed;
+}
@@ -12,5 +12,7 @@ LOCAL_SRC_FILES := yuv420sp2rgb.c cmdline.c debug.c
 
 LOCAL_MODULE := yuv420sp2rgb
 
+LOCAL_LDLIBS := -lpthread
+
 include $(BUILD_HOST_EXECUTABLE)
 endif
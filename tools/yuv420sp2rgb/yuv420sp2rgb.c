@@ -8,6 +8,12 @@
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #ifndef max
 #define max(a,b) ({typeof(a) _a = (a); typeof(b) _b = (b); _a > _b ? _a : _b; })
@@ -17,6 +23,7 @@
 #define CONVERT_TYPE_PPM 0
 #define CONVERT_TYPE_RGB 1
 #define CONVERT_TYPE_ARGB 2
+#define CONVERT_TYPE_RGB565 3
 
 /*
    YUV 4:2:0 image with a plane of 8 bit Y samples followed by an interleaved
@@ -29,199 +36,456 @@
    V (Cr) Sample Period 2 2
  */
 
-typedef struct rgb_context {
-    unsigned char *buffer;
-    int width;
-    int height;
-    int rotate;
-    int i;
-    int j;
-    int size; /* for debugging */
-} rgb_context;
+const int bytes_per_pixel = 2;
 
-typedef void (*rgb_cb)(
-    unsigned char r,
-    unsigned char g,
-    unsigned char b,
-    rgb_context *ctx);
+/* Output pixel layouts, indexed by CONVERT_TYPE_*. */
+static const int output_bpp[] = { 3, 3, 4, 2 };
 
-const int bytes_per_pixel = 2;
+/* Fixed-point (10 bit) conversion of one pixel; matches the SIMD kernel. */
+static inline void yuv_to_rgb(int nY, int nU, int nV,
+                              unsigned char *r,
+                              unsigned char *g,
+                              unsigned char *b)
+{
+    int nR, nG, nB;
 
-static void color_convert_common(
-    unsigned char *pY, unsigned char *pUV,
-    int width, int height,
-    unsigned char *buffer,
-    int size, /* buffer size in bytes */
-    int gray,
-    int rotate,
-    rgb_cb cb) 
+    // Yuv Convert
+    nY -= 16;
+    nU -= 128;
+    nV -= 128;
+
+    if (nY < 0)
+        nY = 0;
+
+    // nR = (int)(1.164 * nY + 2.018 * nU);
+    // nG = (int)(1.164 * nY - 0.813 * nV - 0.391 * nU);
+    // nB = (int)(1.164 * nY + 1.596 * nV);
+
+    nB = (int)(1192 * nY + 2066 * nU);
+    nG = (int)(1192 * nY - 833 * nV - 400 * nU);
+    nR = (int)(1192 * nY + 1634 * nV);
+
+    nR = min(262143, max(0, nR));
+    nG = min(262143, max(0, nG));
+    nB = min(262143, max(0, nB));
+
+    nR >>= 10; nR &= 0xff;
+    nG >>= 10; nG &= 0xff;
+    nB >>= 10; nB &= 0xff;
+
+    *r = nR;
+    *g = nG;
+    *b = nB;
+}
+
+#ifdef __SSE2__
+/* Converts 8 pixels held as 16 bit Y and per-pixel U and V (already offset
+   by -16 and -128) to saturated 16 bit R, G and B.  _mm_madd_epi16 keeps
+   the sums in 32 bits, so the result is the same as yuv_to_rgb(). */
+static inline void yuv_to_rgb_sse2(__m128i y, __m128i u, __m128i v,
+                                   __m128i *r, __m128i *g, __m128i *b)
 {
-	int i, j;
-	int nR, nG, nB;
-	int nY, nU, nV;
-    rgb_context ctx;
+    const __m128i k_yu = _mm_setr_epi16(1192, 2066, 1192, 2066, 1192, 2066, 1192, 2066);
+    const __m128i k_yv_r = _mm_setr_epi16(1192, 1634, 1192, 1634, 1192, 1634, 1192, 1634);
+    const __m128i k_yv_g = _mm_setr_epi16(1192, -833, 1192, -833, 1192, -833, 1192, -833);
+    const __m128i k_u_g = _mm_setr_epi16(-400, 0, -400, 0, -400, 0, -400, 0);
+    const __m128i zero = _mm_setzero_si128();
+
+    __m128i yu_lo = _mm_unpacklo_epi16(y, u), yu_hi = _mm_unpackhi_epi16(y, u);
+    __m128i yv_lo = _mm_unpacklo_epi16(y, v), yv_hi = _mm_unpackhi_epi16(y, v);
+    __m128i u_lo = _mm_unpacklo_epi16(u, zero), u_hi = _mm_unpackhi_epi16(u, zero);
+
+    *b = _mm_packs_epi32(_mm_srai_epi32(_mm_madd_epi16(yu_lo, k_yu), 10),
+                         _mm_srai_epi32(_mm_madd_epi16(yu_hi, k_yu), 10));
+    *r = _mm_packs_epi32(_mm_srai_epi32(_mm_madd_epi16(yv_lo, k_yv_r), 10),
+                         _mm_srai_epi32(_mm_madd_epi16(yv_hi, k_yv_r), 10));
+    *g = _mm_packs_epi32(
+            _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(yv_lo, k_yv_g),
+                                         _mm_madd_epi16(u_lo, k_u_g)), 10),
+            _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(yv_hi, k_yv_g),
+                                         _mm_madd_epi16(u_hi, k_u_g)), 10));
+}
 
-    ctx.buffer = buffer;
-    ctx.size = size; /* debug */
-    ctx.width = width;
-    ctx.height = height;
-    ctx.rotate = rotate;
+/* Converts 16 pixels of one luma row sharing the duplicated chroma in
+   u_lo/u_hi and v_lo/v_hi, storing planar R, G and B bytes. */
+static inline void convert_16_sse2(const unsigned char *pY,
+                                   __m128i u_lo, __m128i u_hi,
+                                   __m128i v_lo, __m128i v_hi,
+                                   unsigned char *r,
+                                   unsigned char *g,
+                                   unsigned char *b)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i k16 = _mm_set1_epi16(16);
+    __m128i y = _mm_loadu_si128((const __m128i *)pY);
+    __m128i y_lo = _mm_max_epi16(_mm_sub_epi16(_mm_unpacklo_epi8(y, zero), k16), zero);
+    __m128i y_hi = _mm_max_epi16(_mm_sub_epi16(_mm_unpackhi_epi8(y, zero), k16), zero);
+    __m128i r_lo, g_lo, b_lo, r_hi, g_hi, b_hi;
+
+    yuv_to_rgb_sse2(y_lo, u_lo, v_lo, &r_lo, &g_lo, &b_lo);
+    yuv_to_rgb_sse2(y_hi, u_hi, v_hi, &r_hi, &g_hi, &b_hi);
+    _mm_storeu_si128((__m128i *)r, _mm_packus_epi16(r_lo, r_hi));
+    _mm_storeu_si128((__m128i *)g, _mm_packus_epi16(g_lo, g_hi));
+    _mm_storeu_si128((__m128i *)b, _mm_packus_epi16(b_lo, b_hi));
+}
+#endif
 
-    if (gray) {
-        for (i = 0; i < height; i++) {
-            for (j = 0; j < width; j++) {
-                nB = *(pY + i * width + j);
-                ctx.i = i;
-                ctx.j = j;
-                cb(nB, nB, nB, &ctx);
-            }
-        }	
-    } else {
-        // YUV 4:2:0
-        for (i = 0; i < height; i++) {
-            for (j = 0; j < width; j++) {
-                nY = *(pY + i * width + j);
-                nV = *(pUV + (i/2) * width + bytes_per_pixel * (j/2));
-                nU = *(pUV + (i/2) * width + bytes_per_pixel * (j/2) + 1);
-            
-                // Yuv Convert
-                nY -= 16;
-                nU -= 128;
-                nV -= 128;
-            
-                if (nY < 0)
-                    nY = 0;
-            
-                // nR = (int)(1.164 * nY + 2.018 * nU);
-                // nG = (int)(1.164 * nY - 0.813 * nV - 0.391 * nU);
-                // nB = (int)(1.164 * nY + 1.596 * nV);
-            
-                nB = (int)(1192 * nY + 2066 * nU);
-                nG = (int)(1192 * nY - 833 * nV - 400 * nU);
-                nR = (int)(1192 * nY + 1634 * nV);
-            
-                nR = min(262143, max(0, nR));
-                nG = min(262143, max(0, nG));
-                nB = min(262143, max(0, nB));
-            
-                nR >>= 10; nR &= 0xff;
-                nG >>= 10; nG &= 0xff;
-                nB >>= 10; nB &= 0xff;
-
-                ctx.i = i;
-                ctx.j = j;
-                cb(nR, nG, nB, &ctx);
-            }
-        }
+/* Converts one or two luma rows sharing the chroma row pUV into planar R,
+   G and B rows.  pY1 and the second set of outputs are unused when pY1 is
+   NULL (the last row of an image with an odd height). */
+static void convert_row_pair(const unsigned char *pY0,
+                             const unsigned char *pY1,
+                             const unsigned char *pUV,
+                             int width,
+                             unsigned char *r0, unsigned char *g0, unsigned char *b0,
+                             unsigned char *r1, unsigned char *g1, unsigned char *b1)
+{
+    int j = 0;
+
+#ifdef __SSE2__
+    const __m128i k128 = _mm_set1_epi16(128);
+    const __m128i low_bytes = _mm_set1_epi16(0xff);
+    for (; j + 16 <= width; j += 16) {
+        /* 16 bytes of V/U pairs cover 16 pixels; spread each to two lanes. */
+        __m128i uv = _mm_loadu_si128((const __m128i *)(pUV + j));
+        __m128i v = _mm_sub_epi16(_mm_and_si128(uv, low_bytes), k128);
+        __m128i u = _mm_sub_epi16(_mm_srli_epi16(uv, 8), k128);
+        __m128i u_lo = _mm_unpacklo_epi16(u, u), u_hi = _mm_unpackhi_epi16(u, u);
+        __m128i v_lo = _mm_unpacklo_epi16(v, v), v_hi = _mm_unpackhi_epi16(v, v);
+
+        convert_16_sse2(pY0 + j, u_lo, u_hi, v_lo, v_hi, r0 + j, g0 + j, b0 + j);
+        if (pY1)
+            convert_16_sse2(pY1 + j, u_lo, u_hi, v_lo, v_hi, r1 + j, g1 + j, b1 + j);
     }
-}   
+#endif
 
-static void rgb16_cb(
-    unsigned char r,
-    unsigned char g,
-    unsigned char b,
-    rgb_context *ctx)
-{
-    unsigned short *rgb16 = (unsigned short *)ctx->buffer;
-    *(rgb16 + ctx->i * ctx->width + ctx->j) = b | (g << 5) | (r << 11);
+    for (; j < width; j++) {
+        int nV = *(pUV + bytes_per_pixel * (j/2));
+        int nU = *(pUV + bytes_per_pixel * (j/2) + 1);
+        yuv_to_rgb(pY0[j], nU, nV, r0 + j, g0 + j, b0 + j);
+        if (pY1)
+            yuv_to_rgb(pY1[j], nU, nV, r1 + j, g1 + j, b1 + j);
+    }
 }
 
-static void common_rgb_cb(
-    unsigned char r,
-    unsigned char g,
-    unsigned char b,
-    rgb_context *ctx,
-    int alpha)
+/* Writes a row of planar R, G and B as count pixels of the given type,
+   starting at out and stepping step bytes between pixels. */
+static void write_row(const unsigned char *r,
+                      const unsigned char *g,
+                      const unsigned char *b,
+                      int count,
+                      int type,
+                      unsigned char *out,
+                      int step)
 {
-    unsigned char *out = ctx->buffer;
-    int offset = 0;
-    int bpp;
-    int i = 0;
-    switch(ctx->rotate) {
-    case 0: /* no rotation */
-        offset = ctx->i * ctx->width + ctx->j;
-        break;
-    case 1: /* 90 degrees */
-        offset = ctx->height * (ctx->j + 1) - ctx->i;
+    int j;
+    switch (type) {
+    case CONVERT_TYPE_PPM:
+    case CONVERT_TYPE_RGB:
+        for (j = 0; j < count; j++, out += step) {
+            out[0] = r[j];
+            out[1] = g[j];
+            out[2] = b[j];
+        }
         break;
-    case 2: /* 180 degrees */
-        offset = (ctx->height - 1 - ctx->i) * ctx->width + ctx->j;
+    case CONVERT_TYPE_ARGB:
+        for (j = 0; j < count; j++, out += step) {
+            out[0] = 0xff;
+            out[1] = r[j];
+            out[2] = g[j];
+            out[3] = b[j];
+        }
         break;
-    case 3: /* 270 degrees */
-        offset = (ctx->width - 1 - ctx->j) * ctx->height + ctx->i;
+    case CONVERT_TYPE_RGB565:
+        for (j = 0; j < count; j++, out += step) {
+            *(unsigned short *)out =
+                ((r[j] >> 3) << 11) | ((g[j] >> 2) << 5) | (b[j] >> 3);
+        }
         break;
-    default:
-        FAILIF(1, "Unexpected roation value %d!\n", ctx->rotate);
     }
+}
+
+typedef struct convert_job {
+    const unsigned char *pY;
+    const unsigned char *pUV;
+    int width;
+    int height;
+    int first_row; /* even */
+    int last_row;  /* exclusive */
+    unsigned char *buffer;
+    int gray;
+    int rotate;
+    int type;
+} convert_job;
+
+/* Rows converted before a 90 or 270 degree rotation writes them out.  Each
+   output row then receives TILE_ROWS contiguous pixels at a time instead of
+   a single one.  Must be even; a multiple of 16 keeps the SSE2 transpose
+   busy. */
+#define TILE_ROWS 256
+
+/* Columns transposed together, so that every cache line of the converted
+   rows is read once.  The SSE2 transpose handles exactly 16. */
+#define TILE_COLS 16
+
+#ifdef __SSE2__
+/* Transposes the 16x16 bytes starting at column col of the 16 rows in src
+   into 16 rows of dst, dst_stride bytes apart.  Four rounds of interleaving
+   row i with row i + 8 move every byte into place. */
+static inline void transpose_16x16_sse2(const unsigned char *const *src, int col,
+                                        unsigned char *dst, int dst_stride)
+{
+    __m128i a[16], b[16];
+    int i, round;
+
+    for (i = 0; i < 16; i++)
+        a[i] = _mm_loadu_si128((const __m128i *)(src[i] + col));
+    for (round = 0; round < 4; round++) {
+        for (i = 0; i < 8; i++) {
+            b[2 * i] = _mm_unpacklo_epi8(a[i], a[i + 8]);
+            b[2 * i + 1] = _mm_unpackhi_epi8(a[i], a[i + 8]);
+        }
+        memcpy(a, b, sizeof(a));
+    }
+    for (i = 0; i < 16; i++)
+        _mm_storeu_si128((__m128i *)(dst + i * dst_stride), a[i]);
+}
+#endif
+
+/* Writes the converted rows [row, row + rows) of a 90 or 270 degree
+   rotation.  Source column j becomes output row j (90) or width - 1 - j
+   (270).  The rows are transposed TILE_COLS columns at a time into a small
+   cache-resident tile, in output order, and each tile column is then
+   written forwards as one contiguous span of its output row.  Output rows
+   are visited in ascending order for both rotations. */
+static void write_tile_transposed(const convert_job *job, int row, int rows,
+                                  const unsigned char **pR,
+                                  const unsigned char **pG,
+                                  const unsigned char **pB)
+{
+    unsigned char r[TILE_COLS][TILE_ROWS];
+    unsigned char g[TILE_COLS][TILE_ROWS];
+    unsigned char b[TILE_COLS][TILE_ROWS];
+    const unsigned char *src[3][TILE_ROWS];
+    int width = job->width;
+    int height = job->height;
+    int bpp = output_bpp[job->type];
+    int o, j, k, c, n;
+
+    /* Source rows in output order: a 90 degree rotation reverses them. */
+    for (k = 0; k < rows; k++) {
+        int t = job->rotate == 1 ? rows - 1 - k : k;
+        src[0][t] = pR[k];
+        src[1][t] = pG[k];
+        src[2][t] = pB[k];
+    }
+
+    for (o = 0; o < width; o += TILE_COLS) {
+        /* Output rows [o, o + cols) come from source columns [j, j + cols). */
+        int cols = min(TILE_COLS, width - o);
+        j = job->rotate == 1 ? o : width - o - cols;
+        k = 0;
+#ifdef __SSE2__
+        if (cols == 16) {
+            for (; k + 16 <= rows; k += 16) {
+                transpose_16x16_sse2(src[0] + k, j, &r[0][k], TILE_ROWS);
+                transpose_16x16_sse2(src[1] + k, j, &g[0][k], TILE_ROWS);
+                transpose_16x16_sse2(src[2] + k, j, &b[0][k], TILE_ROWS);
+            }
+        }
+#endif
+        for (; k < rows; k++) {
+            for (c = 0; c < cols; c++) {
+                r[c][k] = src[0][k][j + c];
+                g[c][k] = src[1][k][j + c];
+                b[c][k] = src[2][k][j + c];
+            }
+        }
+        for (n = 0; n < cols; n++) {
+            int offset = (o + n) * height;
+            if (job->rotate == 1) {
+                c = n;
+                offset += height - row - rows;
+            } else {
+                c = cols - 1 - n;
+                offset += row;
+            }
+            write_row(r[c], g[c], b[c], rows, job->type,
+                      job->buffer + offset * bpp, bpp);
+        }
+    }
+}
+
+/* Converts rows [first_row, last_row) of the image, two at a time, or a
+   tile of TILE_ROWS at a time when rotating by 90 or 270 degrees. */
+static void convert_rows(const convert_job *job)
+{
+    int width = job->width;
+    int height = job->height;
+    int bpp = output_bpp[job->type];
+    int tile_rows = (job->rotate & 1) ? TILE_ROWS : 2;
+    unsigned char *rgb = MALLOC(3 * tile_rows * width);
+    const unsigned char *pR[TILE_ROWS], *pG[TILE_ROWS], *pB[TILE_ROWS];
+    int i, k;
+
+    for (i = job->first_row; i < job->last_row; i += tile_rows) {
+        int rows = min(tile_rows, job->last_row - i);
+
+        for (k = 0; k < rows; k += 2) {
+            const unsigned char *pY0 = job->pY + (i + k) * width;
+            const unsigned char *pY1 = k + 1 < rows ? pY0 + width : NULL;
+            if (job->gray) {
+                /* Gray output is the luma sample in every channel. */
+                pR[k] = pG[k] = pB[k] = pY0;
+                pR[k + 1] = pG[k + 1] = pB[k + 1] = pY1;
+            } else {
+                unsigned char *out = rgb + 3 * k * width;
+                convert_row_pair(pY0, pY1, job->pUV + ((i + k)/2) * width, width,
+                                 out, out + width, out + 2 * width,
+                                 out + 3 * width, out + 4 * width, out + 5 * width);
+                pR[k] = out;
+                pG[k] = out + width;
+                pB[k] = out + 2 * width;
+                pR[k + 1] = out + 3 * width;
+                pG[k + 1] = out + 4 * width;
+                pB[k + 1] = out + 5 * width;
+            }
+        }
 
-    bpp = 3 + !!alpha;
-    offset *= bpp;
-    FAILIF(offset < 0, "point (%d, %d) generates a negative offset.\n", ctx->i, ctx->j);
-    FAILIF(offset + bpp > ctx->size, "point (%d, %d) at offset %d exceeds the size %d of the buffer.\n",
-           ctx->i, ctx->j,
-           offset,
-           ctx->size);
+        if (job->rotate & 1) {
+            write_tile_transposed(job, i, rows, pR, pG, pB);
+            continue;
+        }
 
-    out += offset;
+        for (k = 0; k < rows; k++) {
+            int row = i + k;
+            int offset, step;
+            /* Output offset of the row's first pixel, and the step between
+               pixels, both in pixels. */
+            if (job->rotate == 0) {
+                offset = row * width;
+                step = 1;
+            } else { /* 180 degrees */
+                offset = (height - 1 - row) * width + width - 1;
+                step = -1;
+            }
+            write_row(pR[k], pG[k], pB[k], width, job->type,
+                      job->buffer + offset * bpp, step * bpp);
+        }
+    }
 
-    if (alpha) out[i++] = 0xff;
-    out[i++] = r;
-    out[i++] = g;
-    out[i] = b;
+    FREE(rgb);
 }
 
-static void rgb24_cb(
-    unsigned char r,
-    unsigned char g,
-    unsigned char b,
-    rgb_context *ctx)
+static void *convert_thread(void *arg)
 {
-    return common_rgb_cb(r,g,b,ctx,0);
+    convert_rows((const convert_job *)arg);
+    return NULL;
 }
 
-static void argb_cb(
-    unsigned char r,
-    unsigned char g,
-    unsigned char b,
-    rgb_context *ctx)
+static void color_convert_common(
+    unsigned char *pY, unsigned char *pUV,
+    int width, int height,
+    unsigned char *buffer,
+    int size, /* buffer size in bytes */
+    int gray,
+    int rotate,
+    int type,
+    int threads)
 {
-    return common_rgb_cb(r,g,b,ctx,1);
+    int pairs = (height + 1) / 2;
+    convert_job *jobs;
+    pthread_t *tids;
+    int *started;
+    int t;
+
+    FAILIF(rotate < 0 || rotate > 3, "Unexpected roation value %d!\n", rotate);
+    FAILIF(width * height * output_bpp[type] > size,
+           "A %dx%d image exceeds the size %d of the buffer.\n",
+           width, height, size);
+
+    threads = max(1, min(threads, pairs));
+    jobs = MALLOC(threads * sizeof(convert_job));
+    tids = MALLOC(threads * sizeof(pthread_t));
+    started = CALLOC(threads, sizeof(int));
+
+    /* Split the image into bands of whole row pairs, so that each chroma
+       row is converted by exactly one thread. */
+    for (t = 0; t < threads; t++) {
+        jobs[t].pY = pY;
+        jobs[t].pUV = pUV;
+        jobs[t].width = width;
+        jobs[t].height = height;
+        jobs[t].first_row = 2 * (pairs * t / threads);
+        jobs[t].last_row = min(height, 2 * (pairs * (t + 1) / threads));
+        jobs[t].buffer = buffer;
+        jobs[t].gray = gray;
+        jobs[t].rotate = rotate;
+        jobs[t].type = type;
+    }
+
+    /* Band 0 runs here, as does any band whose thread fails to start. */
+    for (t = 1; t < threads; t++)
+        started[t] = !pthread_create(&tids[t], NULL, convert_thread, &jobs[t]);
+    for (t = 0; t < threads; t++)
+        if (!started[t])
+            convert_rows(&jobs[t]);
+    for (t = 1; t < threads; t++)
+        if (started[t])
+            pthread_join(tids[t], NULL);
+
+    FREE(jobs);
+    FREE(tids);
+    FREE(started);
 }
 
-static void convert(const char *infile,
-                    const char *outfile,
-                    int height,
-                    int width,
-                    int gray,
-                    int type,
-                    int rotate)
+/* Formats the header of an output image (only PPM has one) and returns
+   its size in bytes. */
+static int output_header(int type, int width, int height, int rotate,
+                         char *header, size_t size)
 {
-    void *in, *out;
-    int ifd, ofd, rc;
-    int psz = getpagesize();
-    static char header[1024];
-    int header_size;
-    size_t outsize;
+    int header_size = 0;
 
-    int bpp = 3;
     switch (type) {
     case CONVERT_TYPE_PPM:
         PRINT("encoding PPM\n");
         if (rotate & 1)
-            header_size = snprintf(header, sizeof(header), "P6\n%d %d\n255\n", height, width);
+            header_size = snprintf(header, size, "P6\n%d %d\n255\n", height, width);
         else
-            header_size = snprintf(header, sizeof(header), "P6\n%d %d\n255\n", width, height);
+            header_size = snprintf(header, size, "P6\n%d %d\n255\n", width, height);
 	break;
     case CONVERT_TYPE_RGB:
         PRINT("encoding raw RGB24\n");
-        header_size = 0;
         break;
     case CONVERT_TYPE_ARGB:
         PRINT("encoding raw ARGB\n");
-        header_size = 0;
-        bpp = 4;
+        break;
+    case CONVERT_TYPE_RGB565:
+        PRINT("encoding raw RGB565\n");
         break;
     }
+    return header_size;
+}
+
+static void convert(const char *infile,
+                    const char *outfile,
+                    int height,
+                    int width,
+                    int gray,
+                    int type,
+                    int rotate,
+                    int threads)
+{
+    void *in, *out;
+    int ifd, ofd, rc;
+    int psz = getpagesize();
+    static char header[1024];
+    int header_size;
+    size_t outsize;
+
+    int bpp = output_bpp[type];
+    header_size = output_header(type, width, height, rotate,
+                                header, sizeof(header));
         
     outsize = header_size + width * height * bpp;
     outsize = (outsize + psz - 1) & ~(psz - 1);
@@ -256,12 +520,219 @@ static void convert(const char *infile,
            "Error wrinting PPM header: %s (%d)\n",
            strerror(errno), errno);
 
-    INFO("Converting %dx%d YUV 4:2:0 to RGB24...\n", width, height);
+    INFO("Converting %dx%d YUV 4:2:0 to RGB using %d threads...\n",
+         width, height, threads);
     color_convert_common(in, in + width * height,
                          width, height, 
                          out + header_size, outsize - header_size,
-                         gray, rotate,
-                         type == CONVERT_TYPE_ARGB ? argb_cb : rgb24_cb);
+                         gray, rotate, type, threads);
+}
+
+/* Bytes of input mapped at a time in stream mode (at least one frame per
+   thread is always mapped). */
+#define STREAM_WINDOW_SIZE (64 << 20)
+
+typedef struct stream_context {
+    const char *outfile;
+    int width;
+    int height;
+    int gray;
+    int type;
+    int rotate;
+    int fd;             /* raw output stream, or -1 to write PPM files */
+    const char *header;
+    int header_size;
+    size_t frame_size;  /* input bytes per frame */
+    size_t image_size;  /* output bytes per frame, without the header */
+
+    /* The mapped window of input frames [first_frame, end_frame). */
+    const unsigned char *window;
+    int first_frame;
+    int end_frame;
+
+    pthread_mutex_t lock;
+    int next_frame;
+} stream_context;
+
+typedef struct stream_worker {
+    stream_context *ctx;
+    pthread_t tid;
+    int started;
+    unsigned char *buffer; /* header followed by one output image */
+} stream_worker;
+
+/* Returns outfile with _<frame> added before its extension. */
+static char *frame_file_name(const char *outfile, int frame)
+{
+    const char *dot = strrchr(outfile, '.');
+    const char *slash = strrchr(outfile, '/');
+    size_t len = strlen(outfile);
+    size_t stem = (dot && (!slash || dot > slash)) ? (size_t)(dot - outfile) : len;
+    char *name = MALLOC(len + 16);
+
+    memcpy(name, outfile, stem);
+    sprintf(name + stem, "_%05d%s", frame, outfile + stem);
+    return name;
+}
+
+/* Converts frames of the current window until none are left. */
+static void *stream_thread(void *arg)
+{
+    stream_worker *worker = (stream_worker *)arg;
+    stream_context *ctx = worker->ctx;
+    unsigned char *image = worker->buffer + ctx->header_size;
+
+    while (1) {
+        const unsigned char *in;
+        int frame;
+
+        pthread_mutex_lock(&ctx->lock);
+        frame = ctx->next_frame;
+        if (frame < ctx->end_frame)
+            ctx->next_frame++;
+        pthread_mutex_unlock(&ctx->lock);
+        if (frame >= ctx->end_frame)
+            break;
+
+        in = ctx->window + (frame - ctx->first_frame) * ctx->frame_size;
+        color_convert_common((unsigned char *)in,
+                             (unsigned char *)in + ctx->width * ctx->height,
+                             ctx->width, ctx->height,
+                             image, ctx->image_size,
+                             ctx->gray, ctx->rotate, ctx->type, 1);
+
+        if (ctx->fd >= 0) {
+            off_t offset = (off_t)frame * ctx->image_size;
+            FAILIF(pwrite(ctx->fd, image, ctx->image_size, offset) !=
+                   (ssize_t)ctx->image_size,
+                   "Error writing frame %d: %s (%d)\n",
+                   frame, strerror(errno), errno);
+        } else {
+            char *name = frame_file_name(ctx->outfile, frame);
+            size_t size = ctx->header_size + ctx->image_size;
+            int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0664);
+            FAILIF(fd < 0, "open(%s) failed: %s (%d)\n",
+                   name, strerror(errno), errno);
+            FAILIF(write(fd, worker->buffer, size) != (ssize_t)size,
+                   "Error writing %s: %s (%d)\n", name, strerror(errno), errno);
+            close(fd);
+            FREE(name);
+        }
+    }
+    return NULL;
+}
+
+/* Converts every whole frame of infile.  The input is mapped a window of
+   frames at a time, and the frames of each window are shared out between
+   threads, each converting a whole frame.  PPM output goes to one file per
+   frame; raw output is one stream of frames in outfile. */
+static void convert_stream(const char *infile,
+                           const char *outfile,
+                           int height,
+                           int width,
+                           int gray,
+                           int type,
+                           int rotate,
+                           int threads)
+{
+    static char header[1024];
+    stream_context ctx;
+    stream_worker *workers;
+    struct stat st;
+    struct timeval start, end;
+    double seconds;
+    size_t psz = getpagesize();
+    int frames, window_frames, ifd, t;
+
+    ctx.outfile = outfile;
+    ctx.width = width;
+    ctx.height = height;
+    ctx.gray = gray;
+    ctx.type = type;
+    ctx.rotate = rotate;
+    /* An odd height still has a chroma row for its last luma row. */
+    ctx.frame_size = width * height + width * ((height + 1) / 2);
+    ctx.image_size = width * height * output_bpp[type];
+    ctx.header = header;
+    ctx.header_size = output_header(type, width, height, rotate,
+                                    header, sizeof(header));
+    pthread_mutex_init(&ctx.lock, NULL);
+
+    INFO("Opening input file %s\n", infile);
+    ifd = open(infile, O_RDONLY);
+    FAILIF(ifd < 0, "open(%s) failed: %s (%d)\n",
+           infile, strerror(errno), errno);
+    FAILIF(fstat(ifd, &st) < 0, "fstat(%s) failed: %s (%d)\n",
+           infile, strerror(errno), errno);
+    frames = st.st_size / ctx.frame_size;
+    if (st.st_size % ctx.frame_size)
+        ERROR("Ignoring %d bytes of partial frame at the end of %s\n",
+              (int)(st.st_size % ctx.frame_size), infile);
+
+    ctx.fd = -1;
+    if (type != CONVERT_TYPE_PPM) {
+        INFO("Opening output file %s\n", outfile);
+        ctx.fd = open(outfile, O_WRONLY | O_CREAT | O_TRUNC, 0664);
+        FAILIF(ctx.fd < 0, "open(%s) failed: %s (%d)\n",
+               outfile, strerror(errno), errno);
+    }
+
+    threads = max(1, min(threads, frames));
+    window_frames = max(threads, (int)(STREAM_WINDOW_SIZE / ctx.frame_size));
+    workers = MALLOC(threads * sizeof(stream_worker));
+    for (t = 0; t < threads; t++) {
+        workers[t].ctx = &ctx;
+        workers[t].buffer = MALLOC(ctx.header_size + ctx.image_size);
+        memcpy(workers[t].buffer, header, ctx.header_size);
+    }
+
+    INFO("Converting %d %dx%d frames using %d threads...\n",
+         frames, width, height, threads);
+    gettimeofday(&start, NULL);
+
+    for (ctx.first_frame = 0; ctx.first_frame < frames;
+         ctx.first_frame = ctx.end_frame) {
+        /* mmap offsets must be page aligned, so the window may start
+           part-way into the frame before first_frame. */
+        off_t begin = (off_t)ctx.first_frame * ctx.frame_size;
+        off_t map_offset = begin & ~(off_t)(psz - 1);
+        size_t map_size;
+        void *map;
+
+        ctx.end_frame = min(frames, ctx.first_frame + window_frames);
+        ctx.next_frame = ctx.first_frame;
+        map_size = (off_t)ctx.end_frame * ctx.frame_size - map_offset;
+        map = mmap(0, map_size, PROT_READ, MAP_PRIVATE, ifd, map_offset);
+        FAILIF(map == MAP_FAILED, "could not mmap input file: %s (%d)\n",
+               strerror(errno), errno);
+        madvise(map, map_size, MADV_SEQUENTIAL);
+        ctx.window = (const unsigned char *)map + (begin - map_offset);
+
+        /* Worker 0 runs here, and a worker that fails to start leaves its
+           frames to the others. */
+        for (t = 1; t < threads; t++)
+            workers[t].started = !pthread_create(&workers[t].tid, NULL,
+                                                 stream_thread, &workers[t]);
+        stream_thread(&workers[0]);
+        for (t = 1; t < threads; t++)
+            if (workers[t].started)
+                pthread_join(workers[t].tid, NULL);
+
+        munmap(map, map_size);
+    }
+
+    gettimeofday(&end, NULL);
+    seconds = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+    PRINT("Converted %d frames in %.2f s (%.1f frames/s)\n",
+          frames, seconds, seconds > 0 ? frames / seconds : 0);
+
+    for (t = 0; t < threads; t++)
+        FREE(workers[t].buffer);
+    FREE(workers);
+    if (ctx.fd >= 0)
+        close(ctx.fd);
+    close(ifd);
+    pthread_mutex_destroy(&ctx.lock);
 }
 
 int verbose_flag;
@@ -270,7 +741,7 @@ int quiet_flag;
 int main(int argc, char **argv) {
 
     char *infile, *outfile, *type;
-    int height, width, gray, rotate;
+    int height, width, gray, rotate, threads, stream;
     int cmdline_error = 0;
 
     /* Parse command-line arguments. */
@@ -282,6 +753,8 @@ int main(int argc, char **argv) {
                             &gray,
                             &type,
                             &rotate,
+                            &threads,
+                            &stream,
                             &verbose_flag);
 
     if (first == argc) {
@@ -298,6 +771,7 @@ int main(int argc, char **argv) {
     }
 
     FAILIF(rotate % 90, "Rotation angle must be a multiple of 90 degrees!\n");
+    FAILIF(threads < 1, "The thread count must be at least 1!\n");
 
     rotate /= 90;
     rotate %= 4;
@@ -317,6 +791,8 @@ int main(int argc, char **argv) {
     INFO("gray only: %d\n", gray);
     INFO("encode as: %s\n", type);
     INFO("rotation: %d\n", rotate);
+    INFO("threads: %d\n", threads);
+    INFO("stream: %d\n", stream);
     
     /* Convert the image */
 
@@ -327,12 +803,22 @@ int main(int argc, char **argv) {
         conv_type = CONVERT_TYPE_RGB;
     else if (!strcmp(type, "argb"))
         conv_type = CONVERT_TYPE_ARGB;
+    else if (!strcmp(type, "rgb565"))
+        conv_type = CONVERT_TYPE_RGB565;
     else FAILIF(1, "Unknown encoding type %s.\n", type);
     
-    convert(infile, outfile,
-            height, width, gray,
-            conv_type,
-            rotate);
+    if (stream)
+        convert_stream(infile, outfile,
+                       height, width, gray,
+                       conv_type,
+                       rotate,
+                       threads);
+    else
+        convert(infile, outfile,
+                height, width, gray,
+                conv_type,
+                rotate,
+                threads);
         
     free(outfile);
     return 0;